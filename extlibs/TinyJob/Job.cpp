@@ -25,10 +25,10 @@ void Job::Execute()
 
 void Job::Finish()
 {
-	pendingJobs--;
-
-	if ( IsFinished() && parent != nullptr )
+	// read the parent first, the job may be deleted by a waiting thread as soon as the count is zero
+	Job *parentJob = parent;
+	if ( --pendingJobs == 0 && parentJob != nullptr )
 	{
-		parent->Finish();
+		parentJob->Finish();
 	}
 }
\ No newline at end of file
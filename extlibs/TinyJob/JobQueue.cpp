@@ -12,21 +12,21 @@ JobQueue::JobQueue( size_t maxJobs )
 
 void JobQueue::Push( Job *job )
 {
-	int bottom = bottomIndex.load( std::memory_order_acquire );
-	queue[ bottom ] = job;
+	int bottom = bottomIndex.load( std::memory_order_relaxed );
+	queue[ bottom % maxJobs ] = job;
 	bottomIndex.store( bottom + 1, std::memory_order_release );
 }
 
 Job* JobQueue::Pop()
 {
-	int bottom = bottomIndex.load( std::memory_order_acquire );
-	bottom = std::max ( 0, bottom - 1 );
-	bottomIndex.store( bottom, std::memory_order_release );
-    int top = topIndex.load( std::memory_order_acquire );
+	// Publish the smaller bottom before reading top, so a concurrent Steal() either sees it or loses the race on top
+	int bottom = bottomIndex.load( std::memory_order_relaxed ) - 1;
+	bottomIndex.store( bottom, std::memory_order_seq_cst );
+	int top = topIndex.load( std::memory_order_seq_cst );
 
 	if ( top <= bottom )
 	{
-		Job *job = queue[ bottom ];
+		Job *job = queue[ bottom % maxJobs ];
 
 		// There are several jobs in the queue, we don't need to worry about Steal()
 		if ( top != bottom )
@@ -34,34 +34,33 @@ Job* JobQueue::Pop()
 			return job;
 		}
 
-		// This is the last item in the queue, we need to check if a Steal() has increased top
-		int stolenTop = top + 1;
-		if( topIndex.compare_exchange_strong( stolenTop, top + 1, std::memory_order_acq_rel ) )
+		// This is the last item in the queue, take it by increasing top unless a Steal() was faster
+		if( !topIndex.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst ) )
 		{
 			// An Steal() call has stolen our job (https://www.youtube.com/watch?v=DEiWU1MbBfk)
-			bottomIndex.store( stolenTop, std::memory_order_release );
-			return nullptr;
+			job = nullptr;
 		}
+		bottomIndex.store( bottom + 1, std::memory_order_relaxed );
 		return job;
 	}
 	else
 	{
-		bottomIndex.store( top, std::memory_order_release );
+		bottomIndex.store( bottom + 1, std::memory_order_relaxed );
 		return nullptr;
 	}
 }
 
 Job* JobQueue::Steal()
 {
-	int top = topIndex.load( std::memory_order_acquire );
-	int bottom = bottomIndex.load( std::memory_order_acquire );
+	int top = topIndex.load( std::memory_order_seq_cst );
+	int bottom = bottomIndex.load( std::memory_order_seq_cst );
 
-	if ( topIndex < bottomIndex )
+	if ( top < bottom )
 	{
-		Job *job = queue[ top ];
+		Job *job = queue[ top % maxJobs ];
 
 		// Check if a Pop() or another Steal() operation has stolen our job
-		if( topIndex.compare_exchange_strong( top, top + 1, std::memory_order_acq_rel) )
+		if( topIndex.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst ) )
 		{
 			return job;
 		}
@@ -1,7 +1,44 @@
 
 #include <cstdint>
+#include <cstdlib>
 #include <float.h>
 #include <chrono>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define USE_AVX2 1
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX2_NO_FMA __attribute__((target("avx2")))      //keeps products and sums apart, no contraction into fma
+#elif defined(_MSC_VER)
+#define USE_AVX2 1
+#define TARGET_AVX2
+#define TARGET_AVX2_NO_FMA
+#include <intrin.h>
+#endif
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -23,23 +60,149 @@ int cMaxDepth = 50;
 
 float cEpsilon = 0.01f;
 
+enum SceneType { SCENE_MATERIALS, SCENE_RANDOM_SPHERES, SCENE_INSTANCES, SCENE_MESHES };
+int cScene = SCENE_MATERIALS;
+int cRandomSceneSize = 22;             //grid size of the random and instances scenes, tessellation of the meshes scene
+
+enum BVHBuilderType { BVH_NONE, BVH_MEDIAN, BVH_SAH, BVH_LBVH, BVH_SBVH, BVH_GRID, BVH_KDTREE };
+const char *cBVHBuilderNames[] = { "none", "median", "sah", "lbvh", "sbvh", "grid", "kdtree" };
+int cBVHBuilder = BVH_SAH;             //grid and kdtree build a uniform grid or a kd-tree instead of a bvh
+enum NodeLayout { LAYOUT_BUILD, LAYOUT_DEPTH_FIRST, LAYOUT_TREELET };
+const char *cNodeLayoutNames[] = { "build", "dfs", "treelet" };
+int cNodeLayout = LAYOUT_BUILD;        //order of the binary bvh nodes in memory, see reorderNodes
+int cMortonCodeBits = 30;              //30 or 63 bit morton codes for the lbvh builder
+int cBVHWidth = 2;                     //children per node, 4 and 8 collapse the binary bvh for SIMD box tests
+bool cOrderedTraversal = true;         //visit the near child first and cull by the closest hit
+bool cQuantizedNodes = false;          //store the child bounds of the wide bvh nodes as 8 bit steps, halves the node size
+int cNumberWorkers = 0;                //background threads of the job system, 0: one per additional hardware thread
+bool cPacketTracing = false;           //trace the primary rays of 8x8 pixel blocks as packets
+bool cBVHCache = false;                //map the binary bvh from a cache file keyed by a scene hash, write it after building
+bool cBuildOnly = false;               //only build and update the bvh, for timing large scenes
+int cNumberFrames = 1;                 //frames after the first move the small spheres and refit the bvh
+const char *cStatisticsFile = nullptr;  //json file for the bvh report and traversal statistics of the run, -stats
+float cRebuildThreshold = 1.5f;        //rebuild instead of refit once the sah cost grew by this factor
+bool cMotionBlur = false;              //the diffuse spheres of the random scene move up during the shutter interval
+float cShutterOpen = 0.0f;             //the camera samples ray times between these
+float cShutterClose = 1.0f;
+bool cCompareAccelerators = false;     //render the scene once with every builder and compare build time, memory and Mrays/s
+bool cTypeSortedGeometry = true;       //leaves of the binary bvh intersect per type arrays instead of calling Hitable::hit
+bool cSphereBatches = true;            //intersect the sphere arrays 8 at a time with SIMD, leaves hold up to 8 primitives
+const char *cMeshFile = nullptr;       //obj, binary ply or native .lyrmesh mesh shown by the meshes scene instead of the tori
+const char *cConvertMeshFile = nullptr;  //write cMeshFile to this native mesh file and exit
+
 PCGRandom rnd;
 
+bool cpuSupportsAVX2() {
+#if defined(USE_AVX2) && defined(__GNUC__)
+   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#elif defined(USE_AVX2) && defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 1);
+   bool osSupport = (info[2] & (1<<27)) && (info[2] & (1<<28)) && (_xgetbv(0) & 6) == 6;     //osxsave, avx, ymm state
+   __cpuidex(info, 7, 0);
+   return osSupport && (info[1] & (1<<5));
+#else
+   return false;
+#endif
+}
+bool gUseAVX2 = cpuSupportsAVX2();
+
+enum RayType { RAY_PRIMARY, RAY_SECONDARY, NUMBER_RAY_TYPES };
+const char *cRayTypeNames[] = { "primary", "secondary" };
+
+// traversal counters of a single ray
+struct RayCounters {
+   uint32_t mNodesVisited;
+   uint32_t mPrimitivesTested;
+   uint32_t mCacheLines;         //node fetches from another cache line or page than the one before, binary bvh only
+   uint32_t mPages;
+};
+
+// traversal counters of all rays of one type
+struct RayStatistics {
+   RayStatistics() {
+      reset();
+   }
+   void reset() {
+      mNumberRays = 0;
+      mNodesVisited = 0;
+      mPrimitivesTested = 0;
+      mCacheLines = 0;
+      mPages = 0;
+      mMaxNodesVisited = 0;
+      mMaxPrimitivesTested = 0;
+   }
+   void add(const RayCounters &ray) {
+      mNumberRays += 1;
+      mNodesVisited += ray.mNodesVisited;
+      mPrimitivesTested += ray.mPrimitivesTested;
+      mCacheLines += ray.mCacheLines;
+      mPages += ray.mPages;
+      mMaxNodesVisited = std::max(mMaxNodesVisited, ray.mNodesVisited);
+      mMaxPrimitivesTested = std::max(mMaxPrimitivesTested, ray.mPrimitivesTested);
+   }
+   void merge(const RayStatistics &other) {
+      mNumberRays += other.mNumberRays;
+      mNodesVisited += other.mNodesVisited;
+      mPrimitivesTested += other.mPrimitivesTested;
+      mCacheLines += other.mCacheLines;
+      mPages += other.mPages;
+      mMaxNodesVisited = std::max(mMaxNodesVisited, other.mMaxNodesVisited);
+      mMaxPrimitivesTested = std::max(mMaxPrimitivesTested, other.mMaxPrimitivesTested);
+   }
+   uint64_t mNumberRays;
+   uint64_t mNodesVisited;       //bounding box tests
+   uint64_t mPrimitivesTested;
+   uint64_t mCacheLines;
+   uint64_t mPages;
+   uint32_t mMaxNodesVisited;
+   uint32_t mMaxPrimitivesTested;
+};
+
+// the traversals count into the ray currently traced on their thread, computeColor files the
+// counts under the ray type once the ray is done. the per thread totals are merged into the
+// global statistics once per rendered line, so the workers don't contend on every ray
+thread_local RayCounters tCurrentRay;
+thread_local RayStatistics tRayStatistics[NUMBER_RAY_TYPES];
+
 struct Statistics {
-   uint32_t numberRays;
+   void merge(RayStatistics *rays) {
+      std::lock_guard<std::mutex> lock(mMutex);
+      for(int type=0; type<NUMBER_RAY_TYPES; ++type) {
+         mRays[type].merge(rays[type]);
+         rays[type].reset();
+      }
+   }
+   std::mutex mMutex;
+   RayStatistics mRays[NUMBER_RAY_TYPES];
 } statistics;
 
 class Material;
+class Hitable;
 
 
+const float cMinDirection = 1e-20f;   //smaller direction components are clamped to keep the reciprocal finite
+
+// the direction is normalized on construction, reciprocal direction and its sign bits are
+// precomputed once for all slab tests along the ray
 struct Ray {
    Ray() {}
-   Ray(const vector3f& a, const vector3f& b) {
+   Ray(const vector3f& a, const vector3f& b, float time = 0.0f) {
       mOrigin = a;
+      mTime = time;
       mDirection = b;
+      mDirection.normalize();
+      for(int i=0; i<3; ++i) {
+         float direction = fabs(mDirection[i]) < cMinDirection ? copysign(cMinDirection, mDirection[i]) : mDirection[i];
+         mInvDirection[i] = 1.0f / direction;
+         mSign[i] = mInvDirection[i] < 0.0f ? 1 : 0;
+      }
    }
    vector3f pointAtParameter(float t) const { return mOrigin + t*mDirection; }
    vector3f mOrigin, mDirection;
+   vector3f mInvDirection;
+   int mSign[3];
+   float mTime;                  //within the shutter interval, moving primitives are intersected at this time
 };
 
 vector3f randomInUnitDisk() {
@@ -56,9 +219,14 @@ struct Camera {
       mHorizontal = vector3f(4.0f, 0.0f, 0.0f);
       mVertical = vector3f(0.0f, 2.0f, 0.0f);
       mOrigin = vector3f(0.0f, 0.0f, 0.0f);
+      mTime0 = 0.0f;
+      mTime1 = 0.0f;
    }
-   Camera(vector3f lookFrom, vector3f lookAt, vector3f up, float vFov, float aspect, float aperture, float focusDistance) {
+   Camera(vector3f lookFrom, vector3f lookAt, vector3f up, float vFov, float aspect, float aperture, float focusDistance,
+          float time0 = 0.0f, float time1 = 0.0f) {
       mLensRadius = aperture / 2.0f;
+      mTime0 = time0;
+      mTime1 = time1;
       float theta = vFov * M_PI/180.0;
       float halfHeight = tan(theta/2.0);
       float halfWidth = aspect * halfHeight;
@@ -73,7 +241,8 @@ struct Camera {
    Ray getRay(float s, float t) {
       vector3f random2D = mLensRadius * randomInUnitDisk();
       vector3f offset = u*random2D[0] + v*random2D[1];
-      return Ray(mOrigin+offset, mLowerLeftCorner+s*mHorizontal+t*mVertical-mOrigin-offset);
+      float time = mTime0 + rnd.randomf() * (mTime1 - mTime0);
+      return Ray(mOrigin+offset, mLowerLeftCorner+s*mHorizontal+t*mVertical-mOrigin-offset, time);
    }
    vector3f mLowerLeftCorner;
    vector3f mHorizontal;
@@ -81,6 +250,7 @@ struct Camera {
    vector3f mOrigin;
    vector3f u,v,w;
    float mLensRadius;
+   float mTime0, mTime1;         //shutter open and close
 };
 
 // ================================================================================
@@ -88,6 +258,171 @@ struct Camera {
 inline float ffmin(float a, float b) { return a < b ? a : b; }
 inline float ffmax(float a, float b) { return a > b ? a : b; }
 
+inline int countTrailingZeros(uint32_t value) {
+#ifdef _MSC_VER
+   unsigned long index;
+   _BitScanForward(&index, value);
+   return int(index);
+#else
+   return __builtin_ctz(value);
+#endif
+}
+
+inline int countTrailingZeros64(uint64_t value) {
+#ifdef _MSC_VER
+   unsigned long index;
+   _BitScanForward64(&index, value);
+   return int(index);
+#else
+   return __builtin_ctzll(value);
+#endif
+}
+
+inline int countBits64(uint64_t value) {
+#ifdef _MSC_VER
+   return int(__popcnt64(value));
+#else
+   return __builtin_popcountll(value);
+#endif
+}
+
+// allocator for std::vector with over-aligned elements, e.g. to keep node arrays on cache lines
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+   typedef T value_type;
+   template<typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+   AlignedAllocator() {}
+   template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+   T *allocate(size_t n) {
+#ifdef _WIN32
+      void *memory = _aligned_malloc(n*sizeof(T), Alignment);
+      if(memory == nullptr)
+         throw std::bad_alloc();
+#else
+      void *memory;
+      if(posix_memalign(&memory, Alignment, n*sizeof(T)) != 0)
+         throw std::bad_alloc();
+#endif
+      return (T*)memory;
+   }
+   void deallocate(T *memory, size_t) {
+#ifdef _WIN32
+      _aligned_free(memory);
+#else
+      free(memory);
+#endif
+   }
+};
+template<typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return true; }
+template<typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return false; }
+
+// read only file mapped into memory. the pages are mapped copy on write, so the contents
+// can still be modified in memory without touching the file
+class MappedFile {
+public:
+   MappedFile()
+      : mData(nullptr)
+      , mSize(0)
+   {}
+   ~MappedFile() {
+      close();
+   }
+
+   bool open(const char *filename) {
+      close();
+#ifdef _WIN32
+      HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if(file == INVALID_HANDLE_VALUE)
+         return false;
+      LARGE_INTEGER size;
+      HANDLE mapping = nullptr;
+      if(GetFileSizeEx(file, &size) && size.QuadPart > 0)
+         mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+      CloseHandle(file);
+      if(mapping == nullptr)
+         return false;
+      mData = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+      CloseHandle(mapping);
+      mSize = size_t(size.QuadPart);
+#else
+      int file = ::open(filename, O_RDONLY);
+      if(file < 0)
+         return false;
+      struct stat status;
+      if(fstat(file, &status) != 0 || status.st_size <= 0) {
+         ::close(file);
+         return false;
+      }
+      void *data = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+      ::close(file);
+      mData = data != MAP_FAILED ? data : nullptr;
+      mSize = status.st_size;
+#endif
+      if(mData == nullptr)
+         mSize = 0;
+      return mData != nullptr;
+   }
+
+   void close() {
+      if(mData == nullptr)
+         return;
+#ifdef _WIN32
+      UnmapViewOfFile(mData);
+#else
+      munmap(mData, mSize);
+#endif
+      mData = nullptr;
+      mSize = 0;
+   }
+
+   void *mData;
+   size_t mSize;
+};
+
+// array that either owns its elements in a vector or refers to memory owned by someone else,
+// like the pages of a mapped file. offers the parts of the vector interface the bvhs use
+template<typename T, typename Storage = std::vector<T>>
+class MappableArray {
+public:
+   MappableArray()
+      : mData(nullptr)
+      , mSize(0)
+   {}
+   MappableArray(const MappableArray &) = delete;
+   MappableArray &operator=(const MappableArray &) = delete;
+
+   void swap(Storage &storage) {
+      mStorage.swap(storage);
+      mData = mStorage.data();
+      mSize = mStorage.size();
+   }
+   void map(T *data, size_t size) {
+      Storage().swap(mStorage);
+      mData = data;
+      mSize = size;
+   }
+
+   T &operator[](size_t i) { return mData[i]; }
+   const T &operator[](size_t i) const { return mData[i]; }
+   T *data() { return mData; }
+   const T *data() const { return mData; }
+   T *begin() { return mData; }
+   T *end() { return mData + mSize; }
+   const T *begin() const { return mData; }
+   const T *end() const { return mData + mSize; }
+   size_t size() const { return mSize; }
+   bool empty() const { return mSize == 0; }
+
+private:
+   Storage mStorage;
+   T *mData;
+   size_t mSize;
+};
+
 class AABB {
 public:
    AABB() {}
@@ -110,21 +445,43 @@ public:
       }
       return true;
 #else
+      // branch free, the reciprocal is always finite so the slabs never produce NaNs
       for(int a=0; a<3; ++a) {
-         float invD = 1.0f / ray.mDirection[a];
-         float t0 = (mMin[a] - ray.mOrigin[a]) * invD;
-         float t1 = (mMax[a] - ray.mOrigin[a]) * invD;
-         if(invD < 0.0f)
-            std::swap(t0, t1);
-         tmin = t0 > tmin ? t0 : tmin;
-         tmax = t1 < tmax ? t1 : tmax;
-         if(tmax <= tmin)
-            return false;
+         float t0 = (mMin[a] - ray.mOrigin[a]) * ray.mInvDirection[a];
+         float t1 = (mMax[a] - ray.mOrigin[a]) * ray.mInvDirection[a];
+         tmin = ffmax(ffmin(t0, t1), tmin);
+         tmax = ffmin(ffmax(t0, t1), tmax);
       }
-      return true;
+      return tmin < tmax;
 #endif
    }
 
+   void reset() {
+      mMin = vector3f(FLT_MAX, FLT_MAX, FLT_MAX);
+      mMax = vector3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+   }
+   void extend(const vector3f &point) {
+      for(int a=0; a<3; ++a) {
+         mMin[a] = ffmin(mMin[a], point[a]);
+         mMax[a] = ffmax(mMax[a], point[a]);
+      }
+   }
+   void extend(const AABB &box) {
+      for(int a=0; a<3; ++a) {
+         mMin[a] = ffmin(mMin[a], box.mMin[a]);
+         mMax[a] = ffmax(mMax[a], box.mMax[a]);
+      }
+   }
+   vector3f center() const {
+      return 0.5f * (mMin + mMax);
+   }
+   float surfaceArea() const {
+      vector3f extent = mMax - mMin;
+      if(extent[0] < 0.0f || extent[1] < 0.0f || extent[2] < 0.0f)      //empty box
+         return 0.0f;
+      return 2.0f * (extent[0]*extent[1] + extent[1]*extent[2] + extent[2]*extent[0]);
+   }
+
    vector3f mMin, mMax;
 };
 
@@ -138,22 +495,252 @@ AABB surroundingBox(AABB &box0, AABB &box1) {
    return AABB(small, big);
 }
 
+// the intersection of both boxes, inverted if they don't overlap
+AABB overlapBox(const AABB &box0, const AABB &box1) {
+   AABB box;
+   for(int axis=0; axis<3; ++axis) {
+      box.mMin[axis] = ffmax(box0.mMin[axis], box1.mMin[axis]);
+      box.mMax[axis] = ffmin(box0.mMax[axis], box1.mMax[axis]);
+   }
+   return box;
+}
+
+// ================================================================================
+
+template<typename Function>
+struct ParallelForJob {
+   static void execute(void *data) {
+      ParallelForJob *job = (ParallelForJob*)data;
+      (*job->mFunction)(job->mChunk, job->mBegin, job->mEnd);
+   }
+   Function *mFunction;
+   uint32_t mChunk, mBegin, mEnd;
+};
+
+// calls function(chunk, chunkBegin, chunkEnd) for consecutive chunks of [begin, end) on the job
+// system and waits for all of them. the chunks don't depend on the number of workers, so
+// results that are combined per chunk are deterministic. runs serially without a JobSystem.
+template<typename Function>
+void parallelFor(JobSystem *jobSystem, uint32_t begin, uint32_t end, uint32_t chunkSize, Function function) {
+   uint32_t numberChunks = (end - begin + chunkSize - 1) / chunkSize;
+   if(jobSystem == nullptr || numberChunks <= 1) {
+      for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+         function(chunk, begin + chunk*chunkSize, std::min(end, begin + (chunk+1)*chunkSize));
+      }
+      return;
+   }
+   std::vector<ParallelForJob<Function>> jobs(numberChunks);
+   Job *fence = jobSystem->CreateEmptyJob();
+   for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+      jobs[chunk].mFunction = &function;
+      jobs[chunk].mChunk = chunk;
+      jobs[chunk].mBegin = begin + chunk*chunkSize;
+      jobs[chunk].mEnd = std::min(end, begin + (chunk+1)*chunkSize);
+      jobSystem->Run(jobSystem->CreateJobAsChild(ParallelForJob<Function>::execute, fence, &jobs[chunk]));
+   }
+   fence->Execute();             //the fence is never queued, this drops its own count so the last chunk finishes it
+   jobSystem->Wait(fence);
+   delete fence;
+}
+
 // ================================================================================
 
+// the hit functions only store the distance and what was hit, the point, normal, texture
+// coordinates and material are filled in by finalizeHit once the closest hit is known
 struct HitRecord {
    float time;
-   float u,v;
+   float u,v;                    //barycentric coordinates of a triangle until finalizeHit
    vector3f point;
    vector3f normal;
    Material *material;
+   Hitable *object;              //primitive or instance of the closest hit
+   Hitable *instanced;           //object hit inside that instance
+   uint32_t primitive;           //triangle of a mesh
+};
+
+// ================================================================================
+
+const int cPacketWidth = 8;                           //packets trace blocks of 8x8 primary rays
+const int cPacketSize = cPacketWidth*cPacketWidth;
+const int cPacketMinActive = 4;                       //subtrees hit by fewer rays are traced with single rays
+
+// coherent rays traced together, the bit masks select the rays of the packet. the ray data is
+// stored as structure of arrays, so the SIMD tests take four rays at once. all rays share their
+// direction signs, the same planes of a box are near for all of them and the interval bounds of
+// the origins and reciprocal directions form a frustum that culls boxes missed by the whole packet
+struct alignas(16) RayPacket {
+   // false if the rays don't share their direction signs, they have to be traced one by one then
+   bool init(Ray *rays, HitRecord *records, int numberRays, float timeMax) {
+      for(int i=1; i<numberRays; ++i) {
+         for(int a=0; a<3; ++a) {
+            if(rays[i].mSign[a] != rays[0].mSign[a])
+               return false;
+         }
+      }
+      mRays = rays;
+      mRecords = records;
+      mNumberRays = numberRays;
+      mHit = 0;
+      for(int a=0; a<3; ++a) {
+         mSign[a] = rays[0].mSign[a];
+         mOriginMin[a] = mInvDirectionMin[a] = FLT_MAX;
+         mOriginMax[a] = mInvDirectionMax[a] = -FLT_MAX;
+      }
+      // unused slots repeat the first ray and are never in a mask
+      for(int i=0; i<cPacketSize; ++i) {
+         const Ray &ray = rays[i < numberRays ? i : 0];
+         for(int a=0; a<3; ++a) {
+            mOrigin[a][i] = ray.mOrigin[a];
+            mDirection[a][i] = ray.mDirection[a];
+            mInvDirection[a][i] = ray.mInvDirection[a];
+            mOriginMin[a] = ffmin(mOriginMin[a], ray.mOrigin[a]);
+            mOriginMax[a] = ffmax(mOriginMax[a], ray.mOrigin[a]);
+            mInvDirectionMin[a] = ffmin(mInvDirectionMin[a], ray.mInvDirection[a]);
+            mInvDirectionMax[a] = ffmax(mInvDirectionMax[a], ray.mInvDirection[a]);
+         }
+         mTimeMax[i] = timeMax;
+         mNodesVisited[i] = 0;
+         mPrimitivesTested[i] = 0;
+      }
+      return true;
+   }
+   uint64_t allRays() const {
+      return mNumberRays == 64 ? ~uint64_t(0) : (uint64_t(1) << mNumberRays) - 1;
+   }
+
+   // the hit distances of the box planes are bounded by the products of the interval bounds
+   bool frustumMisses(const float *boxMin, const float *boxMax, float timeMin) const {
+      float tNear = timeMin;
+      float tFar = FLT_MAX;
+      for(int a=0; a<3; ++a) {
+         float nearPlane = mSign[a] ? boxMax[a] : boxMin[a];
+         float farPlane = mSign[a] ? boxMin[a] : boxMax[a];
+         float n0 = (nearPlane - mOriginMax[a]) * mInvDirectionMin[a];
+         float n1 = (nearPlane - mOriginMax[a]) * mInvDirectionMax[a];
+         float n2 = (nearPlane - mOriginMin[a]) * mInvDirectionMin[a];
+         float n3 = (nearPlane - mOriginMin[a]) * mInvDirectionMax[a];
+         float f0 = (farPlane - mOriginMax[a]) * mInvDirectionMin[a];
+         float f1 = (farPlane - mOriginMax[a]) * mInvDirectionMax[a];
+         float f2 = (farPlane - mOriginMin[a]) * mInvDirectionMin[a];
+         float f3 = (farPlane - mOriginMin[a]) * mInvDirectionMax[a];
+         tNear = ffmax(tNear, ffmin(ffmin(n0, n1), ffmin(n2, n3)));
+         tFar = ffmin(tFar, ffmax(ffmax(f0, f1), ffmax(f2, f3)));
+      }
+      return tNear >= tFar;
+   }
+
+   // slab test of the rays in the mask, returns the mask of the rays hitting the box
+   uint64_t intersect(const float *boxMin, const float *boxMax, float timeMin, uint64_t mask) const {
+      if(frustumMisses(boxMin, boxMax, timeMin))
+         return 0;
+      float nearPlane[3], farPlane[3];
+      for(int a=0; a<3; ++a) {
+         nearPlane[a] = mSign[a] ? boxMax[a] : boxMin[a];
+         farPlane[a] = mSign[a] ? boxMin[a] : boxMax[a];
+      }
+      uint64_t result = 0;
+      for(int first=0; first<cPacketSize; first+=4) {
+         if(((mask >> first) & 0xf) == 0)
+            continue;
+#ifdef USE_SSE
+         __m128 tNear = _mm_set1_ps(timeMin);
+         __m128 tFar = _mm_load_ps(mTimeMax+first);
+         for(int a=0; a<3; ++a) {
+            __m128 origin = _mm_load_ps(mOrigin[a]+first);
+            __m128 invDirection = _mm_load_ps(mInvDirection[a]+first);
+            tNear = _mm_max_ps(tNear, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearPlane[a]), origin), invDirection));
+            tFar = _mm_min_ps(tFar, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farPlane[a]), origin), invDirection));
+         }
+         result |= uint64_t(_mm_movemask_ps(_mm_cmplt_ps(tNear, tFar))) << first;
+#else
+         for(int i=first; i<first+4; ++i) {
+            float tNear = timeMin;
+            float tFar = mTimeMax[i];
+            for(int a=0; a<3; ++a) {
+               tNear = ffmax(tNear, (nearPlane[a] - mOrigin[a][i]) * mInvDirection[a][i]);
+               tFar = ffmin(tFar, (farPlane[a] - mOrigin[a][i]) * mInvDirection[a][i]);
+            }
+            if(tNear < tFar)
+               result |= uint64_t(1) << i;
+         }
+#endif
+      }
+      return result & mask;
+   }
+
+   static void count(uint64_t mask, uint32_t *counters, uint32_t amount) {
+      while(mask != 0) {
+         counters[countTrailingZeros64(mask)] += amount;
+         mask &= mask - 1;
+      }
+   }
+
+   float mOrigin[3][cPacketSize];
+   float mDirection[3][cPacketSize];
+   float mInvDirection[3][cPacketSize];
+   float mTimeMax[cPacketSize];              //closest hit so far
+   uint32_t mNodesVisited[cPacketSize];
+   uint32_t mPrimitivesTested[cPacketSize];
+   float mOriginMin[3], mOriginMax[3];
+   float mInvDirectionMin[3], mInvDirectionMax[3];
+   int mSign[3];
+   int mNumberRays;
+   uint64_t mHit;                            //rays with a hit in their record
+   Ray *mRays;
+   HitRecord *mRecords;
 };
 
 class Hitable {
 public:
+   virtual ~Hitable() {}
+   // closest hit in the interval, only sets record.time and what was hit
    virtual bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) = 0;
+   // fills in the rest of the record of a hit of this primitive, called once per ray for the
+   // closest hit. the acceleration structures are never the object of a record
+   virtual void finalizeHit(const Ray &ray, HitRecord &record) {}
+   // any hit query for visibility: stops at the first intersection in the interval and
+   // doesn't compute the hit point, normal or texture coordinates
+   virtual bool occluded(Ray &ray, float timeMin, float timeMax) = 0;
+   // closest hits of the rays in the mask, shortens their mTimeMax. hitables without a
+   // packet path trace the rays one by one
+   virtual void hitPacket(RayPacket &packet, uint64_t mask, float timeMin) {
+      while(mask != 0) {
+         int i = countTrailingZeros64(mask);
+         mask &= mask - 1;
+         tCurrentRay = RayCounters();
+         if(hit(packet.mRays[i], timeMin, packet.mTimeMax[i], packet.mRecords[i])) {
+            packet.mTimeMax[i] = packet.mRecords[i].time;
+            packet.mHit |= uint64_t(1) << i;
+         }
+         packet.mNodesVisited[i] += tCurrentRay.mNodesVisited;
+         packet.mPrimitivesTested[i] += tCurrentRay.mPrimitivesTested;
+      }
+   }
    virtual bool boundingBox(float t0, float t1, AABB &aabb) = 0;
 };
 
+// build time copy of a primitive with its bounds, centroid and index into the scene list.
+// computed once per build, the builders partition these instead of calling boundingBox
+struct PrimitiveRef {
+   AABB mBox;
+   vector3f mCentroid;
+   uint32_t mIndex;
+};
+
+void computePrimitiveRefs(Hitable **list, int size, float time0, float time1, JobSystem *jobSystem, std::vector<PrimitiveRef> &refs) {
+   refs.resize(size);
+   parallelFor(jobSystem, 0, size, 16384, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+      for(uint32_t i=begin; i<end; ++i) {
+         if(!list[i]->boundingBox(time0, time1, refs[i].mBox)) {
+            printf("no bounding box for primitive %u!\n", i);
+            exit(-1);
+         }
+         refs[i].mCentroid = refs[i].mBox.center();
+         refs[i].mIndex = i;
+      }
+   });
+}
+
 struct HitableList : public Hitable {
    HitableList(Hitable **list, int size) {
       mList = list;
@@ -165,19 +752,27 @@ struct HitableList : public Hitable {
       }
    }
    bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
-      HitRecord tempRecord;
       bool hitAnything = false;
-      double closestSoFar = timeMax;
+      float closestSoFar = timeMax;
+      tCurrentRay.mPrimitivesTested += mSize;
       for(int i=0; i<mSize; ++i) {
-         if(mList[i]->hit(ray, timeMin, closestSoFar, tempRecord)) {
+         if(mList[i]->hit(ray, timeMin, closestSoFar, record)) {
             hitAnything = true;
-            closestSoFar = tempRecord.time;
-            record = tempRecord;
+            closestSoFar = record.time;
          }
       }
       return hitAnything;
    }
 
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      for(int i=0; i<mSize; ++i) {
+         tCurrentRay.mPrimitivesTested += 1;
+         if(mList[i]->occluded(ray, timeMin, timeMax))
+            return true;
+      }
+      return false;
+   }
+
    bool boundingBox(float t0, float t1, AABB &aabb) {
       if(mSize < 1)
          return false;
@@ -197,90 +792,76 @@ struct HitableList : public Hitable {
       return true;
    }
 
+   int size() const { return mSize; }
+
 private:
    Hitable **mList;
    int mSize;
 };
 
-int boxXCompare(const void *a, const void *b) {
-   AABB boxLeft, boxRight;
-   Hitable *ah = *(Hitable**)a;
-   Hitable *bh = *(Hitable**)b;
-   if(!ah->boundingBox(0.0f, 0.0f, boxLeft) || !bh->boundingBox(0.0f, 0.0f, boxRight)) {
-      printf("no bounding box in x-compare!\n");
-      exit(-1);
-   }
-   if(boxLeft.mMin[0] - boxRight.mMin[0] < 0.0)
-      return -1;
-   else
-      return 1;
-}
-int boxYCompare(const void *a, const void *b) {
-   AABB boxLeft, boxRight;
-   Hitable *ah = *(Hitable**)a;
-   Hitable *bh = *(Hitable**)b;
-   if(!ah->boundingBox(0.0f, 0.0f, boxLeft) || !bh->boundingBox(0.0f, 0.0f, boxRight)) {
-      printf("no bounding box in x-compare!\n");
-      exit(-1);
-   }
-   if(boxLeft.mMin[1] - boxRight.mMin[1] < 0.0)
-      return -1;
-   else
-      return 1;
-}
-int boxZCompare(const void *a, const void *b) {
-   AABB boxLeft, boxRight;
-   Hitable *ah = *(Hitable**)a;
-   Hitable *bh = *(Hitable**)b;
-   if(!ah->boundingBox(0.0f, 0.0f, boxLeft) || !bh->boundingBox(0.0f, 0.0f, boxRight)) {
-      printf("no bounding box in x-compare!\n");
-      exit(-1);
-   }
-   if(boxLeft.mMin[2] - boxRight.mMin[2] < 0.0)
-      return -1;
-   else
-      return 1;
-}
-
 class BVHNode : public Hitable {
 public:
-   BVHNode() {}
-   BVHNode(Hitable **list, int size, float time0, float time1) {
+   BVHNode()
+      : mNumberPrimitiveChildren(0)
+   {}
+   BVHNode(Hitable *left, Hitable *right, const AABB &box)
+      : mLeft(left)
+      , mRight(right)
+      , mAABB(box)
+   {
+      mNumberPrimitiveChildren = (dynamic_cast<BVHNode*>(left) == nullptr) + (dynamic_cast<BVHNode*>(right) == nullptr);
+   }
+   // median split along a random axis, the references are sorted by the minimum of their boxes
+   BVHNode(Hitable **list, PrimitiveRef *refs, int size) {
+      mNumberPrimitiveChildren = size <= 2 ? 2 : 0;
       if(size > 1) {
          int axis = int(3*rnd.randomf());
-         if(axis == 0) {
-            qsort(list, size, sizeof(Hitable*), boxXCompare);
-         } else if(axis == 1) {
-            qsort(list, size, sizeof(Hitable*), boxYCompare);
-         } else {
-            qsort(list, size, sizeof(Hitable*), boxZCompare);
-         }         
+         std::sort(refs, refs+size, [axis](const PrimitiveRef &a, const PrimitiveRef &b) {
+            return a.mBox.mMin[axis] < b.mBox.mMin[axis];
+         });
       }
       if(size == 1) {
-         mLeft = mRight = list[0];
+         mLeft = mRight = list[refs[0].mIndex];
       } else if(size == 2) {
-         mLeft = list[0];
-         mRight = list[1];
+         mLeft = list[refs[0].mIndex];
+         mRight = list[refs[1].mIndex];
       } else {
-         mLeft = new BVHNode(list, size/2, time0, time1);
-         mRight = new BVHNode(list+size/2, size-size/2, time0, time1);
+         mLeft = new BVHNode(list, refs, size/2);
+         mRight = new BVHNode(list, refs+size/2, size-size/2);
       }
 
-      AABB boxLeft, boxRight;
-      if(!mLeft->boundingBox(time0, time1, boxLeft) || !mRight->boundingBox(time0, time1, boxRight)) {
-         printf("no bounding box in bvhnode constructor!\n");
-         exit(-1);
+      mAABB.reset();
+      for(int i=0; i<size; ++i) {
+         mAABB.extend(refs[i].mBox);
       }
-      mAABB = surroundingBox(boxLeft, boxRight);
    }
+   // deletes the inner nodes of the tree but leaves the primitives alone
    ~BVHNode() {
-      delete mLeft;
-      delete mRight;
+      if(dynamic_cast<BVHNode*>(mLeft) != nullptr)
+         delete mLeft;
+      if(mRight != mLeft && dynamic_cast<BVHNode*>(mRight) != nullptr)
+         delete mRight;
+   }
+
+   // updates the bounds bottom up after primitives moved
+   void refit(float time0, float time1) {
+      AABB boxLeft, boxRight;
+      Hitable *children[2] = { mLeft, mRight };
+      AABB *boxes[2] = { &boxLeft, &boxRight };
+      for(int c=0; c<2; ++c) {
+         BVHNode *node = dynamic_cast<BVHNode*>(children[c]);
+         if(node != nullptr)
+            node->refit(time0, time1);
+         children[c]->boundingBox(time0, time1, *boxes[c]);
+      }
+      mAABB = surroundingBox(boxLeft, boxRight);
    }
 
    bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      tCurrentRay.mNodesVisited += 1;
 #if 1
       if(mAABB.hit(ray, timeMin, timeMax)) {
+         tCurrentRay.mPrimitivesTested += mNumberPrimitiveChildren;
          if(mLeft->hit(ray, timeMin, timeMax, record)) {
             mRight->hit(ray, timeMin, record.time, record);
             return true;
@@ -314,6 +895,14 @@ public:
       return false;
    }
 
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      tCurrentRay.mNodesVisited += 1;
+      if(!mAABB.hit(ray, timeMin, timeMax))
+         return false;
+      tCurrentRay.mPrimitivesTested += mNumberPrimitiveChildren;
+      return mLeft->occluded(ray, timeMin, timeMax) || mRight->occluded(ray, timeMin, timeMax);
+   }
+
    bool boundingBox(float t0, float t1, AABB &aabb) {
       aabb = mAABB;
       return true;
@@ -322,294 +911,5175 @@ public:
    Hitable *mLeft;
    Hitable *mRight;
    AABB mAABB;
+   int mNumberPrimitiveChildren;       //tested primitives when the box is hit, for the statistics
 };
 
 // ================================================================================
 
-class Texture {
-public:
-   virtual vector3f getTexel(float u, float v, vector3f &point) = 0;
-};
+// flattened bvh, all nodes live in one array in depth first order. the left child of an
+// inner node directly follows its parent, the right child is referenced by index, unless
+// reorderNodes swapped them. leaves reference a range in the primitive index array. 32 bytes
+// per node, two per cache line.
 
-class ConstantTexture : public Texture {
-public:
-   ConstantTexture() {}
-   ConstantTexture(vector3f color)
-      : mColor(color)
-   {}
-   vector3f getTexel(float u, float v, vector3f &point) {
-      return mColor;
+struct alignas(32) LinearBVHNode {
+   // returns the distance where the ray enters the box in tEntry. the sign bits of the ray
+   // select the near and far plane per axis, so there are no branches and no swaps
+   bool hit(const Ray &ray, float tmin, float tmax, float &tEntry) const {
+      for(int a=0; a<3; ++a) {
+         float tNear = ((ray.mSign[a] ? mMax[a] : mMin[a]) - ray.mOrigin[a]) * ray.mInvDirection[a];
+         float tFar = ((ray.mSign[a] ? mMin[a] : mMax[a]) - ray.mOrigin[a]) * ray.mInvDirection[a];
+         tmin = ffmax(tNear, tmin);
+         tmax = ffmin(tFar, tmax);
+      }
+      tEntry = tmin;
+      return tmin < tmax;
    }
-
-   vector3f mColor;
-};
-
-class CheckerTexture : public Texture {
-public:
-   CheckerTexture() {}
-   CheckerTexture(Texture *t0, Texture *t1)
-      : mEven(t0)
-      , mOdd(t1)
-   {}
-   ~CheckerTexture() {
-      delete mEven;
-      delete mOdd;
+   void setBounds(const AABB &box) {
+      for(int a=0; a<3; ++a) {
+         mMin[a] = box.mMin[a];
+         mMax[a] = box.mMax[a];
+      }
    }
-   vector3f getTexel(float u, float v, vector3f &point) {
-      float sines = sin(10.0f*point[0])*sin(10.0f*point[1])*sin(10.0f*point[2]);
-      if(sines < 0.0f)
-         return mOdd->getTexel(u, v, point);
-      else
-         return mEven->getTexel(u, v, point);
+   AABB bounds() const {
+      return AABB(vector3f(mMin[0], mMin[1], mMin[2]), vector3f(mMax[0], mMax[1], mMax[2]));
    }
+   bool isLeaf() const { return mNumberPrimitives > 0; }
+   uint32_t leftChild(uint32_t index) const { return mSwapped ? mOffset : index + 1; }
+   uint32_t rightChild(uint32_t index) const { return mSwapped ? index + 1 : mOffset; }
 
-   Texture *mEven, *mOdd;   
+   float mMin[3];
+   float mMax[3];
+   uint32_t mOffset;             //leaf: first primitive index, inner node: index of the child that doesn't follow it
+   uint16_t mNumberPrimitives;   //0 for inner nodes
+   uint8_t mAxis;                //split axis of inner nodes
+   uint8_t mSwapped;             //the right child follows the node, the left one is at mOffset
 };
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+typedef std::vector<LinearBVHNode, AlignedAllocator<LinearBVHNode, 64>> LinearBVHNodeArray;
+
+const int cBVHStackSize = 64;
+const int cRefitJobDepth = 6;          //levels of the tree whose two subtrees are refit as jobs
 
 // ================================================================================
 
-vector3f randomOnUnitSphere() {
-   vector3f point;
-   float lengthSquared;
-   do {
-      point = 2.0f * vector3f(rnd.randomf(), rnd.randomf(), rnd.randomf()) - vector3f(1.0f, 1.0f, 1.0f);
-      lengthSquared = point.length_squared();
-   } while( (lengthSquared >= 1.0f) || (lengthSquared == 0.0f) );
-   return point;
-}
+// binned surface area heuristic builder
+// see "On fast Construction of SAH-based Bounding Volume Hierarchies" (Wald 2007)
+// primitive centroids are sorted into bins along each axis, the bin border with the lowest
+// estimated cost becomes the split plane. the tree is written as LinearBVHNodes.
 
-vector3f reflect(vector3f &vec, vector3f &normal) {
-   return vec - 2 * dot(vec, normal) * normal;
-}
+struct SAHSettings {
+   SAHSettings()
+      : mNumberBins(16)
+      , mMaxLeafSize(4)
+      , mTraversalCost(1.0f)
+      , mIntersectionCost(1.0f)
+      , mMaxDuplication(0.3f)
+      , mSpatialSplitOverlap(1e-5f)
+   {}
+   int mNumberBins;
+   int mMaxLeafSize;             //nodes with more primitives are always split
+   float mTraversalCost;
+   float mIntersectionCost;
+   float mMaxDuplication;        //SBVHBuilder: additional references allowed by spatial splits, relative to the primitive count
+   float mSpatialSplitOverlap;   //SBVHBuilder: spatial splits are tried when the object split children overlap by this fraction of the root area
+};
 
-bool refract(vector3f &vec, vector3f &normal, float niOverT, vector3f &refracted) {
-   vector3f uv = vec.normalize();
-   float dt = dot(uv, normal);
-   float discriminant = 1.0f - niOverT*niOverT*(1.0f-dt*dt);
-   if(discriminant > 0) {
-      refracted = niOverT * (uv - normal*dt) - normal*sqrt(discriminant);
-      return true;
-   } else {
-      return false;
+const int cLeafSizeHistogramSize = 9;  //leaves with 0 to 7 primitives, the last bucket counts all larger leaves
+
+// shape and quality of a built bvh. the walks of the different bvh types add their nodes,
+// finish() turns the area sums into ratios of the root area and evaluates the SAH cost
+struct BVHReport {
+   BVHReport() {
+      memset(this, 0, sizeof(BVHReport));
+      mType = "none";
    }
-}
 
-float schlick(float cosine, float niOverT) {
-   float r0 = (1.0f - niOverT) / (1.0f + niOverT);
-   r0 = r0*r0;
-   return r0 + (1.0f - r0)*pow((1.0f - cosine), 5.0f);
-}
+   void addInnerNode(int depth, const AABB &bounds, float overlapArea) {
+      mNumberInnerNodes += 1;
+      mMaxDepth = std::max(mMaxDepth, uint32_t(depth));
+      mInnerArea += bounds.surfaceArea();
+      mOverlapArea += overlapArea;
+   }
+   void addLeaf(int depth, const AABB &bounds, uint32_t numberPrimitives) {
+      mNumberLeaves += 1;
+      mMaxDepth = std::max(mMaxDepth, uint32_t(depth));
+      mLeafDepthSum += depth;
+      mNumberReferences += numberPrimitives;
+      mLeafSizes[std::min(numberPrimitives, uint32_t(cLeafSizeHistogramSize-1))] += 1;
+      mLeafArea += bounds.surfaceArea();
+      mLeafCostArea += numberPrimitives * bounds.surfaceArea();
+   }
+   void finish(const AABB &rootBounds, const SAHSettings &settings) {
+      double rootArea = rootBounds.surfaceArea();
+      if(rootArea <= 0.0)
+         return;
+      mSAHCost = float((settings.mTraversalCost * mInnerArea + settings.mIntersectionCost * mLeafCostArea) / rootArea);
+      mInnerArea /= rootArea;
+      mLeafArea /= rootArea;
+      mOverlapArea /= rootArea;
+      mLeafCostArea /= rootArea;
+   }
 
-class Material {
+   void print() const {
+      printf("bvh report (%s): %u nodes (%u inner, %u leaves), depth %u max, %.1f avg leaf\n", mType, mNumberInnerNodes + mNumberLeaves,
+         mNumberInnerNodes, mNumberLeaves, mMaxDepth, mNumberLeaves > 0 ? double(mLeafDepthSum) / mNumberLeaves : 0.0);
+      printf("   sah cost %.3f, surface area %.2f (inner %.2f, leaves %.2f), overlapping %.2f, relative to the root\n", mSAHCost,
+         mInnerArea + mLeafArea, mInnerArea, mLeafArea, mOverlapArea);
+      printf("   %.2f MB, %llu primitive references, leaf sizes:", mMemory / (1024.0*1024.0), (unsigned long long)mNumberReferences);
+      for(int i=0; i<cLeafSizeHistogramSize; ++i) {
+         printf(" %s%d:%u", i == cLeafSizeHistogramSize-1 ? ">=" : "", i, mLeafSizes[i]);
+      }
+      printf("\n");
+   }
+
+   void writeJSON(FILE *file) const {
+      fprintf(file, "{\n");
+      fprintf(file, "    \"type\": \"%s\",\n", mType);
+      fprintf(file, "    \"innerNodes\": %u,\n", mNumberInnerNodes);
+      fprintf(file, "    \"leaves\": %u,\n", mNumberLeaves);
+      fprintf(file, "    \"maxDepth\": %u,\n", mMaxDepth);
+      fprintf(file, "    \"averageLeafDepth\": %.3f,\n", mNumberLeaves > 0 ? double(mLeafDepthSum) / mNumberLeaves : 0.0);
+      fprintf(file, "    \"memory\": %llu,\n", (unsigned long long)mMemory);
+      fprintf(file, "    \"primitiveReferences\": %llu,\n", (unsigned long long)mNumberReferences);
+      fprintf(file, "    \"leafSizeHistogram\": [");
+      for(int i=0; i<cLeafSizeHistogramSize; ++i) {
+         fprintf(file, "%s%u", i > 0 ? ", " : "", mLeafSizes[i]);
+      }
+      fprintf(file, "],\n");
+      fprintf(file, "    \"sahCost\": %.6f,\n", mSAHCost);
+      fprintf(file, "    \"innerArea\": %.6f,\n", mInnerArea);
+      fprintf(file, "    \"leafArea\": %.6f,\n", mLeafArea);
+      fprintf(file, "    \"overlapArea\": %.6f\n", mOverlapArea);
+      fprintf(file, "  }");
+   }
+
+   const char *mType;
+   uint32_t mNumberInnerNodes;
+   uint32_t mNumberLeaves;
+   uint32_t mMaxDepth;
+   uint64_t mLeafDepthSum;
+   uint64_t mNumberReferences;         //primitives in all leaves, including duplicates
+   uint64_t mMemory;                   //bytes of the nodes and primitive indices
+   uint32_t mLeafSizes[cLeafSizeHistogramSize];
+   double mInnerArea;                  //surface area sums, relative to the root area after finish()
+   double mLeafArea;
+   double mOverlapArea;                //area of the intersections of sibling boxes
+   double mLeafCostArea;               //leaf areas weighted by their primitive counts
+   float mSAHCost;
+};
+
+const int cMaxSAHBins = 64;
+const uint32_t cParallelBuildThreshold = 4096;     //larger ranges are split on their own and their halves built as jobs
+const uint32_t cParallelBinningChunkSize = 16384;  //primitives per job when binning the top levels
+
+struct SAHBins {
+   void reset(int numberBins) {
+      for(int axis=0; axis<3; ++axis) {
+         for(int b=0; b<numberBins; ++b) {
+            mBoxes[axis][b].reset();
+            mCounts[axis][b] = 0;
+         }
+      }
+   }
+   void merge(const SAHBins &other, int numberBins) {
+      for(int axis=0; axis<3; ++axis) {
+         for(int b=0; b<numberBins; ++b) {
+            mBoxes[axis][b].extend(other.mBoxes[axis][b]);
+            mCounts[axis][b] += other.mCounts[axis][b];
+         }
+      }
+   }
+   AABB mBoxes[3][cMaxSAHBins];
+   uint32_t mCounts[3][cMaxSAHBins];
+};
+
+// sweeps the bin borders of all three axes, returns the lowest sum of child area times primitive
+// count. bestAxis is -1 if no border has primitives on both sides
+float findBestBinSplit(const SAHBins &bins, int numberBins, int count, const float *binScale, int &bestAxis, int &bestBin) {
+   bestAxis = -1;
+   bestBin = -1;
+   float bestCost = FLT_MAX;
+   float rightAreas[cMaxSAHBins];
+   for(int axis=0; axis<3 && count>1; ++axis) {
+      if(binScale[axis] == 0.0f)
+         continue;
+      AABB rightBox;
+      rightBox.reset();
+      for(int b=numberBins-1; b>0; --b) {
+         rightBox.extend(bins.mBoxes[axis][b]);
+         rightAreas[b] = rightBox.surfaceArea();
+      }
+      AABB leftBox;
+      leftBox.reset();
+      int leftCount = 0;
+      for(int b=0; b<numberBins-1; ++b) {
+         leftBox.extend(bins.mBoxes[axis][b]);
+         leftCount += bins.mCounts[axis][b];
+         int rightCount = count - leftCount;
+         if(leftCount == 0 || rightCount == 0)
+            continue;
+         float splitCost = leftBox.surfaceArea()*leftCount + rightAreas[b+1]*rightCount;
+         if(splitCost < bestCost) {
+            bestCost = splitCost;
+            bestAxis = axis;
+            bestBin = b;
+         }
+      }
+   }
+   return bestCost;
+}
+
+// with a JobSystem, ranges above cParallelBuildThreshold are split on the calling job and both
+// halves are built as child jobs, the binning of large ranges is spread over jobs as well.
+// every subtree job writes its own node array, the arrays are copied into depth first order
+// at the end. how the work is split up only depends on the primitive counts, so the tree is
+// the same for any number of workers.
+class SAHBuilder {
+public:
+   SAHBuilder(const SAHSettings &settings, JobSystem *jobSystem = nullptr)
+      : mSettings(settings)
+      , mJobSystem(jobSystem)
+      , mSAHCost(0.0f)
+   {
+      if(mSettings.mNumberBins > cMaxSAHBins)
+         mSettings.mNumberBins = cMaxSAHBins;
+   }
+
+   // reorders the references, indices receives the primitive order the leaves refer to
+   void build(std::vector<PrimitiveRef> &refs, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices) {
+      uint32_t size = refs.size();
+      mRefs = refs.data();
+      nodes.clear();
+      indices.clear();
+      mSAHCost = 0.0f;
+      if(size == 0)
+         return;
+
+      BuildTask root;
+      root.mBegin = 0;
+      root.mEnd = size;
+      root.mDepth = 0;
+      buildTask(&root);
+
+      // place the subtrees of all jobs in depth first order
+      nodes.resize(root.mNumberNodes);
+      std::vector<BuildTask*> serialTasks;
+      placeTask(&root, 0, nodes.data(), serialTasks);
+      parallelFor(mJobSystem, 0, serialTasks.size(), 16, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         for(uint32_t t=begin; t<end; ++t) {
+            copyTask(serialTasks[t], nodes.data());
+         }
+      });
+      deleteTask(&root);
+
+      indices.resize(size);
+      parallelFor(mJobSystem, 0, size, 65536, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         for(uint32_t i=begin; i<end; ++i) {
+            indices[i] = refs[i].mIndex;
+         }
+      });
+
+      float rootArea = nodes[0].bounds().surfaceArea();
+      mSAHCost = rootArea > 0.0f ? root.mCost / rootArea : 0.0f;
+   }
+
+   SAHSettings mSettings;
+   JobSystem *mJobSystem;
+   float mSAHCost;               //cost of the last build, relative to the root area
+
+private:
+   struct BuildTask {
+      uint32_t mBegin, mEnd;
+      int mDepth;
+      AABB mBounds;                    //root node of tasks that were split into child jobs
+      int mAxis;
+      LinearBVHNodeArray mNodes;       //whole subtree of tasks built serially
+      BuildTask *mChildren[2];
+      uint32_t mPosition;              //index of the subtree root in the final node array
+      uint32_t mNumberNodes;
+      float mCost;
+   };
+
+   inline int binIndex(const vector3f &centroid, int axis, const AABB &centroidBounds, const float *binScale) const {
+      int bin = int(binScale[axis] * (centroid[axis] - centroidBounds.mMin[axis]));
+      return bin < mSettings.mNumberBins ? bin : mSettings.mNumberBins-1;
+   }
+
+   void computeBounds(uint32_t begin, uint32_t end, bool parallel, AABB &bounds, AABB &centroidBounds) {
+      bounds.reset();
+      centroidBounds.reset();
+      if(!parallel) {
+         for(uint32_t i=begin; i<end; ++i) {
+            bounds.extend(mRefs[i].mBox);
+            centroidBounds.extend(mRefs[i].mCentroid);
+         }
+         return;
+      }
+      uint32_t numberChunks = (end - begin + cParallelBinningChunkSize - 1) / cParallelBinningChunkSize;
+      std::vector<AABB> chunkBounds(2*numberChunks);
+      parallelFor(mJobSystem, begin, end, cParallelBinningChunkSize, [&](uint32_t chunk, uint32_t chunkBegin, uint32_t chunkEnd) {
+         computeBounds(chunkBegin, chunkEnd, false, chunkBounds[2*chunk], chunkBounds[2*chunk+1]);
+      });
+      for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+         bounds.extend(chunkBounds[2*chunk]);
+         centroidBounds.extend(chunkBounds[2*chunk+1]);
+      }
+   }
+
+   void binPrimitives(uint32_t begin, uint32_t end, const AABB &centroidBounds, const float *binScale, SAHBins &bins) {
+      bins.reset(mSettings.mNumberBins);
+      for(uint32_t i=begin; i<end; ++i) {
+         const PrimitiveRef &ref = mRefs[i];
+         for(int axis=0; axis<3; ++axis) {
+            if(binScale[axis] == 0.0f)
+               continue;
+            int b = binIndex(ref.mCentroid, axis, centroidBounds, binScale);
+            bins.mBoxes[axis][b].extend(ref.mBox);
+            bins.mCounts[axis][b] += 1;
+         }
+      }
+   }
+
+   // decides between leaf and split for [begin, end) and partitions the primitive indices,
+   // returns false if the range should become a leaf
+   bool splitRange(uint32_t begin, uint32_t end, int depth, const AABB &bounds, const AABB &centroidBounds, bool parallel,
+                   uint32_t &mid, int &bestAxis) {
+      int count = end - begin;
+      float area = bounds.surfaceArea();
+      int numberBins = mSettings.mNumberBins;
+      float binScale[3];
+      for(int axis=0; axis<3; ++axis) {
+         float extent = centroidBounds.mMax[axis] - centroidBounds.mMin[axis];
+         binScale[axis] = extent > 0.0f ? numberBins / extent : 0.0f;
+      }
+
+      SAHBins bins;
+      if(parallel) {
+         uint32_t numberChunks = (end - begin + cParallelBinningChunkSize - 1) / cParallelBinningChunkSize;
+         std::vector<SAHBins> chunkBins(numberChunks);
+         parallelFor(mJobSystem, begin, end, cParallelBinningChunkSize, [&](uint32_t chunk, uint32_t chunkBegin, uint32_t chunkEnd) {
+            binPrimitives(chunkBegin, chunkEnd, centroidBounds, binScale, chunkBins[chunk]);
+         });
+         bins.reset(numberBins);
+         for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+            bins.merge(chunkBins[chunk], numberBins);
+         }
+      } else {
+         binPrimitives(begin, end, centroidBounds, binScale, bins);
+      }
+
+      int bestBin;
+      float bestCost = findBestBinSplit(bins, numberBins, count, binScale, bestAxis, bestBin);
+
+      if(count <= mSettings.mMaxLeafSize) {
+         float leafCost = mSettings.mIntersectionCost * count;
+         float splitCost = mSettings.mTraversalCost + mSettings.mIntersectionCost * bestCost / area;
+         if(bestAxis == -1 || area <= 0.0f || leafCost <= splitCost)
+            return false;
+      }
+
+      // binning can produce degenerated trees, fall back to median splits before the
+      // traversal stack could overflow
+      if(bestAxis == -1 || depth > cBVHStackSize/2) {
+         int axis = 0;
+         vector3f extent = bounds.mMax - bounds.mMin;
+         if(extent[1] > extent[axis]) axis = 1;
+         if(extent[2] > extent[axis]) axis = 2;
+         mid = (begin + end) / 2;
+         std::nth_element(mRefs+begin, mRefs+mid, mRefs+end, [axis](const PrimitiveRef &a, const PrimitiveRef &b) {
+            return a.mCentroid[axis] < b.mCentroid[axis];
+         });
+         bestAxis = axis;
+      } else {
+         PrimitiveRef *midPointer = std::partition(mRefs+begin, mRefs+end, [&](const PrimitiveRef &ref) {
+            return binIndex(ref.mCentroid, bestAxis, centroidBounds, binScale) <= bestBin;
+         });
+         mid = uint32_t(midPointer - mRefs);
+      }
+      return true;
+   }
+
+   uint32_t buildRecursive(uint32_t begin, uint32_t end, int depth, LinearBVHNodeArray &nodes, float &cost) {
+      AABB bounds, centroidBounds;
+      computeBounds(begin, end, false, bounds, centroidBounds);
+      float area = bounds.surfaceArea();
+
+      uint32_t nodeIndex = nodes.size();
+      nodes.push_back(LinearBVHNode());
+      nodes[nodeIndex].setBounds(bounds);
+
+      uint32_t mid;
+      int axis;
+      if(!splitRange(begin, end, depth, bounds, centroidBounds, false, mid, axis)) {
+         cost = mSettings.mIntersectionCost * (end - begin) * area;
+         nodes[nodeIndex].mOffset = begin;
+         nodes[nodeIndex].mNumberPrimitives = end - begin;
+         return nodeIndex;
+      }
+
+      float leftCost, rightCost;
+      buildRecursive(begin, mid, depth+1, nodes, leftCost);
+      uint32_t rightChild = buildRecursive(mid, end, depth+1, nodes, rightCost);
+      cost = leftCost + rightCost + mSettings.mTraversalCost * area;
+      nodes[nodeIndex].mOffset = rightChild;
+      nodes[nodeIndex].mNumberPrimitives = 0;
+      nodes[nodeIndex].mAxis = axis;
+      return nodeIndex;
+   }
+
+   void buildTask(BuildTask *task) {
+      task->mChildren[0] = task->mChildren[1] = nullptr;
+      if(mJobSystem != nullptr && task->mEnd - task->mBegin >= cParallelBuildThreshold) {
+         bool parallelBinning = task->mEnd - task->mBegin >= 2*cParallelBinningChunkSize;
+         AABB bounds, centroidBounds;
+         computeBounds(task->mBegin, task->mEnd, parallelBinning, bounds, centroidBounds);
+         uint32_t mid;
+         int axis;
+         if(splitRange(task->mBegin, task->mEnd, task->mDepth, bounds, centroidBounds, parallelBinning, mid, axis)) {
+            task->mBounds = bounds;
+            task->mAxis = axis;
+            uint32_t ranges[3] = { task->mBegin, mid, task->mEnd };
+            for(int c=0; c<2; ++c) {
+               task->mChildren[c] = new BuildTask();
+               task->mChildren[c]->mBegin = ranges[c];
+               task->mChildren[c]->mEnd = ranges[c+1];
+               task->mChildren[c]->mDepth = task->mDepth + 1;
+            }
+            parallelFor(mJobSystem, 0, 2, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+               buildTask(task->mChildren[chunk]);
+            });
+            task->mNumberNodes = 1 + task->mChildren[0]->mNumberNodes + task->mChildren[1]->mNumberNodes;
+            task->mCost = task->mChildren[0]->mCost + task->mChildren[1]->mCost + mSettings.mTraversalCost * bounds.surfaceArea();
+            return;
+         }
+      }
+      buildRecursive(task->mBegin, task->mEnd, task->mDepth, task->mNodes, task->mCost);
+      task->mNumberNodes = task->mNodes.size();
+   }
+
+   void placeTask(BuildTask *task, uint32_t position, LinearBVHNode *nodes, std::vector<BuildTask*> &serialTasks) {
+      task->mPosition = position;
+      if(task->mChildren[0] == nullptr) {
+         serialTasks.push_back(task);
+         return;
+      }
+      uint32_t rightPosition = position + 1 + task->mChildren[0]->mNumberNodes;
+      nodes[position] = LinearBVHNode();
+      nodes[position].setBounds(task->mBounds);
+      nodes[position].mOffset = rightPosition;
+      nodes[position].mAxis = task->mAxis;
+      placeTask(task->mChildren[0], position+1, nodes, serialTasks);
+      placeTask(task->mChildren[1], rightPosition, nodes, serialTasks);
+   }
+
+   void copyTask(BuildTask *task, LinearBVHNode *nodes) {
+      for(uint32_t i=0; i<task->mNumberNodes; ++i) {
+         LinearBVHNode node = task->mNodes[i];
+         if(!node.isLeaf())
+            node.mOffset += task->mPosition;
+         nodes[task->mPosition + i] = node;
+      }
+   }
+
+   void deleteTask(BuildTask *task) {
+      for(int c=0; c<2; ++c) {
+         if(task->mChildren[c] != nullptr) {
+            deleteTask(task->mChildren[c]);
+            delete task->mChildren[c];
+         }
+      }
+   }
+
+   PrimitiveRef *mRefs;
+};
+
+// evaluates the SAH cost of a BVHNode tree with the same cost model as the SAHBuilder,
+// so the median split and the binned builder can be compared
+float sahCostRecursive(Hitable *node, const SAHSettings &settings) {
+   AABB box;
+   node->boundingBox(0.0f, 0.0f, box);
+   BVHNode *bvhNode = dynamic_cast<BVHNode*>(node);
+   if(bvhNode != nullptr) {
+      return settings.mTraversalCost * box.surfaceArea()
+             + sahCostRecursive(bvhNode->mLeft, settings)
+             + sahCostRecursive(bvhNode->mRight, settings);
+   }
+   HitableList *list = dynamic_cast<HitableList*>(node);
+   int count = list != nullptr ? list->size() : 1;
+   return settings.mIntersectionCost * count * box.surfaceArea();
+}
+
+float computeSAHCost(Hitable *root, const SAHSettings &settings) {
+   AABB box;
+   if(!root->boundingBox(0.0f, 0.0f, box) || box.surfaceArea() <= 0.0f)
+      return 0.0f;
+   return sahCostRecursive(root, settings) / box.surfaceArea();
+}
+
+// every child that isn't a BVHNode is a leaf with one primitive
+void reportBVHNode(Hitable *node, int depth, BVHReport &report) {
+   AABB box;
+   node->boundingBox(0.0f, 0.0f, box);
+   BVHNode *bvhNode = dynamic_cast<BVHNode*>(node);
+   if(bvhNode == nullptr) {
+      report.addLeaf(depth, box, 1);
+      return;
+   }
+   AABB boxLeft, boxRight;
+   bvhNode->mLeft->boundingBox(0.0f, 0.0f, boxLeft);
+   bvhNode->mRight->boundingBox(0.0f, 0.0f, boxRight);
+   report.addInnerNode(depth, box, overlapBox(boxLeft, boxRight).surfaceArea());
+   report.mMemory += sizeof(BVHNode);
+   reportBVHNode(bvhNode->mLeft, depth+1, report);
+   if(bvhNode->mRight != bvhNode->mLeft)
+      reportBVHNode(bvhNode->mRight, depth+1, report);
+}
+
+// ================================================================================
+
+// linear bvh builder, see "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d
+// Trees" (Karras 2012). primitives are sorted by the morton codes of their centroids, every
+// node splits its range where the highest differing code bit changes. with one primitive per
+// leaf a range of n primitives always has 2n-1 nodes, so the depth first position of each node
+// is known up front and the hierarchy is written in a single (parallel) pass.
+// builds are much faster than with the SAHBuilder, the trees are worse to traverse.
+
+const uint32_t cRadixSortChunkSize = 65536;       //keys per job of the radix sort passes
+
+// spreads the lower 10 bits so there are two zero bits between each of them
+inline uint32_t expandBits10(uint32_t v) {
+   v &= 0x3ff;
+   v = (v | (v << 16)) & 0x030000ff;
+   v = (v | (v <<  8)) & 0x0300f00f;
+   v = (v | (v <<  4)) & 0x030c30c3;
+   v = (v | (v <<  2)) & 0x09249249;
+   return v;
+}
+
+// spreads the lower 21 bits so there are two zero bits between each of them
+inline uint64_t expandBits21(uint64_t v) {
+   v &= 0x1fffff;
+   v = (v | (v << 32)) & 0x001f00000000ffffull;
+   v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+   v = (v | (v <<  8)) & 0x100f00f00f00f00full;
+   v = (v | (v <<  4)) & 0x10c30c30c30c30c3ull;
+   v = (v | (v <<  2)) & 0x1249249249249249ull;
+   return v;
+}
+
+// x lands on bits 3k+2, y on 3k+1 and z on 3k, so code bit b splits along axis 2 - b%3
+inline uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+   return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+}
+inline uint64_t mortonCode(uint64_t x, uint64_t y, uint64_t z) {
+   return (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+}
+
+// least significant digit radix sort of keys with 8 bit digits, values are moved along.
+// every pass histograms chunks of keys as jobs, the chunk offsets follow from the prefix sums
+// and the chunks scatter their keys as jobs again. passes where all keys share a digit are skipped.
+template<typename Key>
+void radixSort(JobSystem *jobSystem, std::vector<Key> &keys, std::vector<uint32_t> &values, int numberBits) {
+   uint32_t size = keys.size();
+   uint32_t numberChunks = (size + cRadixSortChunkSize - 1) / cRadixSortChunkSize;
+   std::vector<Key> tempKeys(size);
+   std::vector<uint32_t> tempValues(size);
+   std::vector<uint32_t> offsets(256*numberChunks);
+   for(int shift=0; shift<numberBits; shift+=8) {
+      parallelFor(jobSystem, 0, size, cRadixSortChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         uint32_t *histogram = &offsets[256*chunk];
+         memset(histogram, 0, 256*sizeof(uint32_t));
+         for(uint32_t i=begin; i<end; ++i) {
+            histogram[(keys[i] >> shift) & 0xff] += 1;
+         }
+      });
+      uint32_t sum = 0;
+      bool singleDigit = false;
+      for(int digit=0; digit<256 && !singleDigit; ++digit) {
+         uint32_t digitCount = 0;
+         for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+            uint32_t count = offsets[256*chunk + digit];
+            offsets[256*chunk + digit] = sum;
+            sum += count;
+            digitCount += count;
+         }
+         singleDigit = digitCount == size;
+      }
+      if(singleDigit)
+         continue;
+      parallelFor(jobSystem, 0, size, cRadixSortChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         uint32_t *offset = &offsets[256*chunk];
+         for(uint32_t i=begin; i<end; ++i) {
+            uint32_t position = offset[(keys[i] >> shift) & 0xff]++;
+            tempKeys[position] = keys[i];
+            tempValues[position] = values[i];
+         }
+      });
+      keys.swap(tempKeys);
+      values.swap(tempValues);
+   }
+}
+
+class LBVHBuilder {
+public:
+   LBVHBuilder(int codeBits, JobSystem *jobSystem = nullptr)
+      : mCodeBits(codeBits > 30 ? 63 : 30)
+      , mJobSystem(jobSystem)
+   {}
+
+   // sorts the references by morton code, indices receives the primitive order the leaves refer to
+   void build(std::vector<PrimitiveRef> &refs, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices) {
+      if(mCodeBits == 63)
+         buildWithCodes<uint64_t>(refs, nodes, indices);
+      else
+         buildWithCodes<uint32_t>(refs, nodes, indices);
+   }
+
+   int mCodeBits;
+   JobSystem *mJobSystem;
+
+private:
+   template<typename Key>
+   void buildWithCodes(std::vector<PrimitiveRef> &refs, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices) {
+      uint32_t size = refs.size();
+      nodes.clear();
+      indices.clear();
+      if(size == 0)
+         return;
+
+      // quantize the centroids to the grid over their bounds
+      uint32_t numberChunks = (size + cRadixSortChunkSize - 1) / cRadixSortChunkSize;
+      std::vector<AABB> chunkBounds(numberChunks);
+      parallelFor(mJobSystem, 0, size, cRadixSortChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         chunkBounds[chunk].reset();
+         for(uint32_t i=begin; i<end; ++i) {
+            chunkBounds[chunk].extend(refs[i].mCentroid);
+         }
+      });
+      AABB centroidBounds;
+      centroidBounds.reset();
+      for(uint32_t chunk=0; chunk<numberChunks; ++chunk) {
+         centroidBounds.extend(chunkBounds[chunk]);
+      }
+      int axisBits = mCodeBits / 3;
+      float cells = float(1u << axisBits);
+      float scale[3];
+      for(int axis=0; axis<3; ++axis) {
+         float extent = centroidBounds.mMax[axis] - centroidBounds.mMin[axis];
+         scale[axis] = extent > 0.0f ? cells / extent : 0.0f;
+      }
+
+      std::vector<Key> keys(size);
+      std::vector<uint32_t> order(size);
+      parallelFor(mJobSystem, 0, size, cRadixSortChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         for(uint32_t i=begin; i<end; ++i) {
+            Key cell[3];
+            for(int axis=0; axis<3; ++axis) {
+               float x = (refs[i].mCentroid[axis] - centroidBounds.mMin[axis]) * scale[axis];
+               cell[axis] = Key(ffmin(x, cells - 1.0f));
+            }
+            keys[i] = mortonCode(cell[0], cell[1], cell[2]);
+            order[i] = i;
+         }
+      });
+      radixSort(mJobSystem, keys, order, mCodeBits);
+
+      std::vector<PrimitiveRef> sorted(size);
+      indices.resize(size);
+      parallelFor(mJobSystem, 0, size, cRadixSortChunkSize, [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+         for(uint32_t i=begin; i<end; ++i) {
+            sorted[i] = refs[order[i]];
+            indices[i] = sorted[i].mIndex;
+         }
+      });
+      refs.swap(sorted);
+
+      nodes.resize(2*size - 1);
+      emitNodes(keys.data(), refs.data(), nodes.data(), 0, size, 0, 0);
+   }
+
+   // writes the subtree over [begin, end) starting at nodes[position], returns its bounds
+   template<typename Key>
+   AABB emitNodes(const Key *keys, const PrimitiveRef *refs, LinearBVHNode *nodes, uint32_t begin, uint32_t end,
+                  uint32_t position, int depth) {
+      LinearBVHNode &node = nodes[position];
+      node = LinearBVHNode();
+      if(end - begin == 1) {
+         node.setBounds(refs[begin].mBox);
+         node.mOffset = begin;
+         node.mNumberPrimitives = 1;
+         return refs[begin].mBox;
+      }
+
+      // split at the first key with the highest differing bit set. equal codes and ranges
+      // that got too deep for the traversal stack are split in the middle
+      uint32_t mid = (begin + end) / 2;
+      int axis = -1;
+      Key difference = keys[begin] ^ keys[end-1];
+      if(difference != 0 && depth <= cBVHStackSize/2) {
+         int bit = 0;
+         while((difference >> bit) > 1) {
+            ++bit;
+         }
+         mid = uint32_t(std::partition_point(keys+begin, keys+end, [bit](Key key) {
+            return ((key >> bit) & 1) == 0;
+         }) - keys);
+         axis = 2 - bit%3;
+      }
+
+      uint32_t positions[2] = { position+1, position + 2*(mid-begin) };
+      uint32_t ranges[3] = { begin, mid, end };
+      AABB childBounds[2];
+      if(mJobSystem != nullptr && end - begin >= cParallelBuildThreshold) {
+         parallelFor(mJobSystem, 0, 2, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+            childBounds[chunk] = emitNodes(keys, refs, nodes, ranges[chunk], ranges[chunk+1], positions[chunk], depth+1);
+         });
+      } else {
+         for(int c=0; c<2; ++c) {
+            childBounds[c] = emitNodes(keys, refs, nodes, ranges[c], ranges[c+1], positions[c], depth+1);
+         }
+      }
+
+      AABB bounds = surroundingBox(childBounds[0], childBounds[1]);
+      if(axis == -1) {
+         axis = 0;
+         vector3f extent = bounds.mMax - bounds.mMin;
+         if(extent[1] > extent[axis]) axis = 1;
+         if(extent[2] > extent[axis]) axis = 2;
+      }
+      node.setBounds(bounds);
+      node.mOffset = positions[1];
+      node.mAxis = axis;
+      return bounds;
+   }
+};
+
+// ================================================================================
+
+// spatial split bvh, see "Spatial Splits in Bounding Volume Hierarchies" (Stich et al. 2009).
+// besides the binned object splits of the SAHBuilder, nodes whose object split children
+// overlap may be split by a plane that clips the references crossing it, the reference then
+// goes to both children with the part of its box on that side. large or thin primitives like
+// the ground sphere and the rects stop inflating every node they overlap this way.
+// only boxes are known of the primitives, so the clipped parts are the box/slab intersections.
+// the leaves can refer to a primitive more than once, LinearBVH uses mailboxing for that.
+class SBVHBuilder {
+public:
+   SBVHBuilder(const SAHSettings &settings)
+      : mSettings(settings)
+      , mNumberReferences(0)
+      , mNumberSpatialSplits(0)
+   {
+      if(mSettings.mNumberBins > cMaxSAHBins)
+         mSettings.mNumberBins = cMaxSAHBins;
+   }
+
+   // consumes the references, indices receives the primitive order the leaves refer to and
+   // may contain primitives several times
+   void build(std::vector<PrimitiveRef> &refs, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices) {
+      nodes.clear();
+      indices.clear();
+      mNumberReferences = refs.size();
+      mNumberSpatialSplits = 0;
+      if(refs.empty())
+         return;
+      mReferenceLimit = uint32_t(refs.size() * (1.0f + mSettings.mMaxDuplication));
+      AABB bounds;
+      bounds.reset();
+      for(size_t i=0; i<refs.size(); ++i) {
+         bounds.extend(refs[i].mBox);
+      }
+      mRootArea = bounds.surfaceArea();
+      buildRecursive(refs, 0, nodes, indices);
+   }
+
+   SAHSettings mSettings;
+   uint32_t mNumberReferences;   //primitive references in the leaves, including duplicates
+   uint32_t mNumberSpatialSplits;
+
+private:
+   struct SpatialSplit {
+      int mAxis;
+      float mPlane;
+      float mCost;
+      AABB mLeftBox, mRightBox;
+      uint32_t mLeftCount, mRightCount;
+   };
+
+   // bins the reference boxes into slabs of the node bounds, every reference is clipped to all
+   // slabs it crosses. planes that would exceed the duplication budget are skipped
+   void findSpatialSplit(const std::vector<PrimitiveRef> &refs, const AABB &bounds, SpatialSplit &split) {
+      int numberBins = mSettings.mNumberBins;
+      uint32_t count = refs.size();
+      split.mAxis = -1;
+      split.mCost = FLT_MAX;
+      for(int axis=0; axis<3; ++axis) {
+         float origin = bounds.mMin[axis];
+         float binWidth = (bounds.mMax[axis] - origin) / numberBins;
+         if(binWidth <= 0.0f)
+            continue;
+         AABB boxes[cMaxSAHBins];
+         uint32_t entering[cMaxSAHBins], exiting[cMaxSAHBins];
+         for(int b=0; b<numberBins; ++b) {
+            boxes[b].reset();
+            entering[b] = exiting[b] = 0;
+         }
+         for(uint32_t i=0; i<count; ++i) {
+            const AABB &box = refs[i].mBox;
+            int first = std::min(numberBins-1, std::max(0, int((box.mMin[axis] - origin) / binWidth)));
+            int last = std::min(numberBins-1, std::max(first, int((box.mMax[axis] - origin) / binWidth)));
+            for(int b=first; b<=last; ++b) {
+               AABB clipped = box;
+               clipped.mMin[axis] = ffmax(clipped.mMin[axis], origin + b*binWidth);
+               clipped.mMax[axis] = ffmin(clipped.mMax[axis], origin + (b+1)*binWidth);
+               boxes[b].extend(clipped);
+            }
+            entering[first] += 1;
+            exiting[last] += 1;
+         }
+
+         AABB rightBoxes[cMaxSAHBins];
+         AABB rightBox;
+         rightBox.reset();
+         for(int b=numberBins-1; b>0; --b) {
+            rightBox.extend(boxes[b]);
+            rightBoxes[b] = rightBox;
+         }
+         AABB leftBox;
+         leftBox.reset();
+         uint32_t leftCount = 0, rightCount = count;
+         for(int b=0; b<numberBins-1; ++b) {
+            leftBox.extend(boxes[b]);
+            leftCount += entering[b];
+            rightCount -= exiting[b];
+            uint32_t duplicates = leftCount + rightCount - count;
+            if(leftCount == 0 || rightCount == 0 || leftCount == count || rightCount == count ||
+               mNumberReferences + duplicates > mReferenceLimit)
+               continue;
+            float cost = leftBox.surfaceArea()*leftCount + rightBoxes[b+1].surfaceArea()*rightCount;
+            if(cost < split.mCost) {
+               split.mAxis = axis;
+               split.mPlane = origin + (b+1)*binWidth;
+               split.mCost = cost;
+               split.mLeftBox = leftBox;
+               split.mRightBox = rightBoxes[b+1];
+               split.mLeftCount = leftCount;
+               split.mRightCount = rightCount;
+            }
+         }
+      }
+   }
+
+   // distributes the references, the ones crossing the plane are either clipped into both
+   // children or moved entirely to one side if that is cheaper (reference unsplitting). a
+   // reference is only unsplit while the other side keeps at least one
+   void spatialPartition(std::vector<PrimitiveRef> &refs, SpatialSplit &split,
+                         std::vector<PrimitiveRef> &left, std::vector<PrimitiveRef> &right) {
+      int axis = split.mAxis;
+      for(size_t i=0; i<refs.size(); ++i) {
+         PrimitiveRef &ref = refs[i];
+         if(ref.mBox.mMax[axis] <= split.mPlane) {
+            left.push_back(ref);
+            continue;
+         }
+         if(ref.mBox.mMin[axis] >= split.mPlane) {
+            right.push_back(ref);
+            continue;
+         }
+         float leftArea = split.mLeftBox.surfaceArea();
+         float rightArea = split.mRightBox.surfaceArea();
+         float splitCost = leftArea*split.mLeftCount + rightArea*split.mRightCount;
+         float leftOnlyCost = surroundingBox(split.mLeftBox, ref.mBox).surfaceArea()*split.mLeftCount + rightArea*(split.mRightCount-1);
+         float rightOnlyCost = leftArea*(split.mLeftCount-1) + surroundingBox(split.mRightBox, ref.mBox).surfaceArea()*split.mRightCount;
+         if(split.mRightCount > 1 && leftOnlyCost < splitCost && (split.mLeftCount <= 1 || leftOnlyCost <= rightOnlyCost)) {
+            split.mLeftBox.extend(ref.mBox);
+            split.mRightCount -= 1;
+            left.push_back(ref);
+         } else if(split.mLeftCount > 1 && rightOnlyCost < splitCost) {
+            split.mRightBox.extend(ref.mBox);
+            split.mLeftCount -= 1;
+            right.push_back(ref);
+         } else {
+            PrimitiveRef leftRef = ref;
+            leftRef.mBox.mMax[axis] = split.mPlane;
+            leftRef.mCentroid = leftRef.mBox.center();
+            left.push_back(leftRef);
+            PrimitiveRef rightRef = ref;
+            rightRef.mBox.mMin[axis] = split.mPlane;
+            rightRef.mCentroid = rightRef.mBox.center();
+            right.push_back(rightRef);
+            mNumberReferences += 1;
+         }
+      }
+   }
+
+   uint32_t buildRecursive(std::vector<PrimitiveRef> &refs, int depth, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices) {
+      uint32_t count = refs.size();
+      AABB bounds, centroidBounds;
+      bounds.reset();
+      centroidBounds.reset();
+      for(uint32_t i=0; i<count; ++i) {
+         bounds.extend(refs[i].mBox);
+         centroidBounds.extend(refs[i].mCentroid);
+      }
+      float area = bounds.surfaceArea();
+
+      uint32_t nodeIndex = nodes.size();
+      nodes.push_back(LinearBVHNode());
+      nodes[nodeIndex].setBounds(bounds);
+
+      // object split over the centroid bins like the SAHBuilder
+      int numberBins = mSettings.mNumberBins;
+      float binScale[3];
+      for(int axis=0; axis<3; ++axis) {
+         float extent = centroidBounds.mMax[axis] - centroidBounds.mMin[axis];
+         binScale[axis] = extent > 0.0f ? numberBins / extent : 0.0f;
+      }
+      SAHBins bins;
+      bins.reset(numberBins);
+      for(uint32_t i=0; i<count; ++i) {
+         for(int axis=0; axis<3; ++axis) {
+            if(binScale[axis] == 0.0f)
+               continue;
+            int b = std::min(numberBins-1, int(binScale[axis] * (refs[i].mCentroid[axis] - centroidBounds.mMin[axis])));
+            bins.mBoxes[axis][b].extend(refs[i].mBox);
+            bins.mCounts[axis][b] += 1;
+         }
+      }
+      int objectAxis, objectBin;
+      float bestCost = findBestBinSplit(bins, numberBins, count, binScale, objectAxis, objectBin);
+
+      // spatial split if the object split children overlap noticeably
+      SpatialSplit spatial;
+      spatial.mAxis = -1;
+      if(count > 1 && mNumberReferences < mReferenceLimit) {
+         bool overlapping = objectAxis == -1;
+         if(!overlapping) {
+            AABB leftBox, rightBox;
+            leftBox.reset();
+            rightBox.reset();
+            for(int b=0; b<numberBins; ++b) {
+               (b <= objectBin ? leftBox : rightBox).extend(bins.mBoxes[objectAxis][b]);
+            }
+            overlapping = overlapBox(leftBox, rightBox).surfaceArea() > mSettings.mSpatialSplitOverlap * mRootArea;
+         }
+         if(overlapping) {
+            findSpatialSplit(refs, bounds, spatial);
+            if(spatial.mAxis != -1 && spatial.mCost < bestCost)
+               bestCost = spatial.mCost;
+            else
+               spatial.mAxis = -1;
+         }
+      }
+      bool hasSplit = objectAxis != -1 || spatial.mAxis != -1;
+
+      bool makeLeaf = count <= 1;
+      if(count > 1 && count <= uint32_t(mSettings.mMaxLeafSize)) {
+         float leafCost = mSettings.mIntersectionCost * count;
+         float splitCost = mSettings.mTraversalCost + mSettings.mIntersectionCost * bestCost / area;
+         makeLeaf = !hasSplit || area <= 0.0f || leafCost <= splitCost;
+      }
+      if(makeLeaf) {
+         nodes[nodeIndex].mOffset = indices.size();
+         nodes[nodeIndex].mNumberPrimitives = count;
+         for(uint32_t i=0; i<count; ++i) {
+            indices.push_back(refs[i].mIndex);
+         }
+         return nodeIndex;
+      }
+
+      std::vector<PrimitiveRef> left, right;
+      int axis = -1;
+      bool bounded = depth <= cBVHStackSize/2;
+      if(bounded && spatial.mAxis != -1) {
+         spatialPartition(refs, spatial, left, right);
+         if(!left.empty() && !right.empty()) {
+            axis = spatial.mAxis;
+            mNumberSpatialSplits += 1;
+         } else {
+            // the bins and the plane can disagree on boxes ending exactly on it, so all references
+            // may land on one side. nothing was clipped then, fall back to the object split
+            left.clear();
+            right.clear();
+         }
+      }
+      if(axis == -1 && bounded && objectAxis != -1) {
+         axis = objectAxis;
+         for(uint32_t i=0; i<count; ++i) {
+            int b = std::min(numberBins-1, int(binScale[axis] * (refs[i].mCentroid[axis] - centroidBounds.mMin[axis])));
+            (b <= objectBin ? left : right).push_back(refs[i]);
+         }
+      }
+      if(axis == -1) {
+         // median split, keeps the depth bounded like in the SAHBuilder
+         axis = 0;
+         vector3f extent = bounds.mMax - bounds.mMin;
+         if(extent[1] > extent[axis]) axis = 1;
+         if(extent[2] > extent[axis]) axis = 2;
+         uint32_t mid = count / 2;
+         std::nth_element(refs.begin(), refs.begin()+mid, refs.end(), [axis](const PrimitiveRef &a, const PrimitiveRef &b) {
+            return a.mCentroid[axis] < b.mCentroid[axis];
+         });
+         left.assign(refs.begin(), refs.begin()+mid);
+         right.assign(refs.begin()+mid, refs.end());
+      }
+      std::vector<PrimitiveRef>().swap(refs);
+
+      buildRecursive(left, depth+1, nodes, indices);
+      uint32_t rightChild = buildRecursive(right, depth+1, nodes, indices);
+      nodes[nodeIndex].mOffset = rightChild;
+      nodes[nodeIndex].mNumberPrimitives = 0;
+      nodes[nodeIndex].mAxis = axis;
+      return nodeIndex;
+   }
+
+   uint32_t mReferenceLimit;
+   float mRootArea;
+};
+
+// ================================================================================
+
+const int cMailboxSize = 8;
+
+// remembers the last primitives tested along a ray, so references that spatial splits put into
+// several leaves are only intersected once per ray
+struct Mailbox {
+   Mailbox()
+      : mNext(0)
+   {
+      for(int i=0; i<cMailboxSize; ++i) {
+         mPrimitives[i] = UINT32_MAX;
+      }
+   }
+   // returns true if the primitive was tested already, otherwise remembers it
+   bool contains(uint32_t primitive) {
+      for(int i=0; i<cMailboxSize; ++i) {
+         if(mPrimitives[i] == primitive)
+            return true;
+      }
+      mPrimitives[mNext] = primitive;
+      mNext = (mNext + 1) & (cMailboxSize - 1);
+      return false;
+   }
+   uint32_t mPrimitives[cMailboxSize];
+   int mNext;
+};
+
+// ================================================================================
+
+// type sorted geometry: the primitives the binary bvh references are copied into structure of
+// arrays per primitive type, in leaf order and with the primitives of every leaf grouped by
+// type. a leaf is then a few runs of (type, index range), usually one, and the traversal calls
+// the kernel of a run once instead of Hitable::hit per primitive. meshes, instances and moving
+// spheres have no arrays, their run calls the hitables one by one. the hitables stay the
+// owners, refit copies their data again and they still finalize the hits.
+
+// sphere batches: the spheres of a run are intersected cSphereBatchSize at a time, 8 lanes with
+// AVX2 or two passes of 4 with SSE, and a horizontal min picks the closest. the quadratic is
+// evaluated in the same order as Sphere::hit without fma, so both find the same hits
+
+const int cSphereBatchSize = 8;
+
+#ifdef USE_SSE
+// mask of the lanes whose ray hits the sphere in (timeMin, timeMax), their distances in t
+inline int sphereHitsSSE(const float *x, const float *y, const float *z, const float *radius, int count,
+                         const Ray &ray, float timeMin, float timeMax, __m128 &t) {
+   __m128 ocx = _mm_sub_ps(_mm_set1_ps(ray.mOrigin[0]), _mm_loadu_ps(x));
+   __m128 ocy = _mm_sub_ps(_mm_set1_ps(ray.mOrigin[1]), _mm_loadu_ps(y));
+   __m128 ocz = _mm_sub_ps(_mm_set1_ps(ray.mOrigin[2]), _mm_loadu_ps(z));
+   __m128 r = _mm_loadu_ps(radius);
+   __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(ray.mDirection[0])), _mm_mul_ps(ocy, _mm_set1_ps(ray.mDirection[1]))),
+                         _mm_mul_ps(ocz, _mm_set1_ps(ray.mDirection[2])));
+   __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+   __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+   __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+   __m128 minusB = _mm_sub_ps(_mm_setzero_ps(), b);
+   __m128 nearT = _mm_sub_ps(minusB, root);
+   __m128 farT = _mm_add_ps(minusB, root);
+   __m128 tMin = _mm_set1_ps(timeMin);
+   __m128 tMax = _mm_set1_ps(timeMax);
+   __m128 hitNear = _mm_and_ps(_mm_cmplt_ps(nearT, tMax), _mm_cmpgt_ps(nearT, tMin));
+   __m128 hitFar = _mm_and_ps(_mm_cmplt_ps(farT, tMax), _mm_cmpgt_ps(farT, tMin));
+   __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()), _mm_or_ps(hitNear, hitFar));
+   t = _mm_or_ps(_mm_and_ps(hitNear, nearT), _mm_andnot_ps(hitNear, farT));
+   return _mm_movemask_ps(hit) & ((1 << count) - 1);
+}
+
+// closest of up to 4 spheres, returns its lane or -1 and shortens timeMax
+inline int closestSphereSSE(const float *x, const float *y, const float *z, const float *radius, int count,
+                            const Ray &ray, float timeMin, float &timeMax) {
+   __m128 t;
+   int mask = sphereHitsSSE(x, y, z, radius, count, ray, timeMin, timeMax, t);
+   if(mask == 0)
+      return -1;
+   alignas(16) float times[4];
+   _mm_store_ps(times, t);
+   int closest = -1;
+   while(mask != 0) {
+      int lane = countTrailingZeros(mask);
+      mask &= mask - 1;
+      if(closest == -1 || times[lane] < times[closest])
+         closest = lane;
+   }
+   timeMax = times[closest];
+   return closest;
+}
+#endif
+
+#ifdef USE_AVX2
+TARGET_AVX2_NO_FMA inline int sphereHitsAVX2(const float *x, const float *y, const float *z, const float *radius, int count,
+                                             const Ray &ray, float timeMin, float timeMax, __m256 &t) {
+   __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin[0]), _mm256_loadu_ps(x));
+   __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin[1]), _mm256_loadu_ps(y));
+   __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.mOrigin[2]), _mm256_loadu_ps(z));
+   __m256 r = _mm256_loadu_ps(radius);
+   __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(ray.mDirection[0])),
+                                          _mm256_mul_ps(ocy, _mm256_set1_ps(ray.mDirection[1]))),
+                            _mm256_mul_ps(ocz, _mm256_set1_ps(ray.mDirection[2])));
+   __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                            _mm256_mul_ps(r, r));
+   __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+   __m256 root = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+   __m256 minusB = _mm256_sub_ps(_mm256_setzero_ps(), b);
+   __m256 nearT = _mm256_sub_ps(minusB, root);
+   __m256 farT = _mm256_add_ps(minusB, root);
+   __m256 tMin = _mm256_set1_ps(timeMin);
+   __m256 tMax = _mm256_set1_ps(timeMax);
+   __m256 hitNear = _mm256_and_ps(_mm256_cmp_ps(nearT, tMax, _CMP_LT_OQ), _mm256_cmp_ps(nearT, tMin, _CMP_GT_OQ));
+   __m256 hitFar = _mm256_and_ps(_mm256_cmp_ps(farT, tMax, _CMP_LT_OQ), _mm256_cmp_ps(farT, tMin, _CMP_GT_OQ));
+   __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_or_ps(hitNear, hitFar));
+   t = _mm256_blendv_ps(farT, nearT, hitNear);
+   return _mm256_movemask_ps(hit) & ((1 << count) - 1);
+}
+
+// closest of up to 8 spheres. the horizontal min of the hit distances is spread to all lanes,
+// the lowest lane holding it wins like the first of equal hits in Sphere order
+TARGET_AVX2_NO_FMA inline int closestSphereAVX2(const float *x, const float *y, const float *z, const float *radius, int count,
+                                                const Ray &ray, float timeMin, float &timeMax) {
+   __m256 t;
+   int mask = sphereHitsAVX2(x, y, z, radius, count, ray, timeMin, timeMax, t);
+   if(mask == 0)
+      return -1;
+   __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)),
+                                                         _mm256_setzero_si256()));
+   t = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t, valid);
+   __m256 minimum = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+   minimum = _mm256_min_ps(minimum, _mm256_shuffle_ps(minimum, minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+   minimum = _mm256_min_ps(minimum, _mm256_shuffle_ps(minimum, minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+   int closest = countTrailingZeros(_mm256_movemask_ps(_mm256_cmp_ps(t, minimum, _CMP_EQ_OQ)) & mask);
+   timeMax = _mm_cvtss_f32(_mm256_castps256_ps128(minimum));
+   return closest;
+}
+#endif
+
+enum PrimitiveType { PRIMITIVE_SPHERE, PRIMITIVE_XYRECT, PRIMITIVE_HITABLE, NUMBER_PRIMITIVE_TYPES };
+
+struct GeometryArrays {
+   void build(Hitable **list, const LinearBVHNode *nodes, size_t numberNodes, const uint32_t *indices, size_t numberIndices);
+   void update();
+   bool empty() const { return mSlotType.empty(); }
+   size_t memory() const {
+      size_t size = mSlotType.size()*(sizeof(uint8_t) + sizeof(uint32_t));
+      for(int type=0; type<NUMBER_PRIMITIVE_TYPES; ++type) {
+         size += mObjects[type].size()*(sizeof(Hitable*) + sizeof(uint32_t));
+      }
+      return size + mSphereRadius.size()*4*sizeof(float) + mRectK.size()*5*sizeof(float);
+   }
+
+   // closest hit among the primitives of a leaf, shortens timeMax. the mailbox is only
+   // passed for bvhs with duplicate references
+   bool hitLeaf(const LinearBVHNode &node, Ray &ray, float timeMin, float &timeMax, HitRecord &record, Mailbox *mailbox,
+                uint32_t &primitivesTested) const {
+      bool hitAnything = false;
+      uint32_t end = node.mOffset + node.mNumberPrimitives;
+      for(uint32_t slot=node.mOffset; slot<end; ) {
+         uint8_t type = mSlotType[slot];
+         uint32_t first = mSlotIndex[slot];
+         uint32_t count = 1;
+         while(slot+count < end && mSlotType[slot+count] == type) {
+            ++count;
+         }
+         slot += count;
+         if(type == PRIMITIVE_SPHERE)
+            hitAnything |= hitSpheres(first, first+count, ray, timeMin, timeMax, record, mailbox, primitivesTested);
+         else if(type == PRIMITIVE_XYRECT)
+            hitAnything |= hitRects(first, first+count, ray, timeMin, timeMax, record, mailbox, primitivesTested);
+         else
+            hitAnything |= hitHitables(first, first+count, ray, timeMin, timeMax, record, mailbox, primitivesTested);
+      }
+      return hitAnything;
+   }
+
+   bool occludedLeaf(const LinearBVHNode &node, Ray &ray, float timeMin, float timeMax, uint32_t &primitivesTested) const {
+      uint32_t end = node.mOffset + node.mNumberPrimitives;
+      for(uint32_t slot=node.mOffset; slot<end; ) {
+         uint8_t type = mSlotType[slot];
+         uint32_t first = mSlotIndex[slot];
+         uint32_t count = 1;
+         while(slot+count < end && mSlotType[slot+count] == type) {
+            ++count;
+         }
+         slot += count;
+         bool occluded;
+         if(type == PRIMITIVE_SPHERE)
+            occluded = occludedSpheres(first, first+count, ray, timeMin, timeMax, primitivesTested);
+         else if(type == PRIMITIVE_XYRECT)
+            occluded = occludedRects(first, first+count, ray, timeMin, timeMax, primitivesTested);
+         else
+            occluded = occludedHitables(first, first+count, ray, timeMin, timeMax, primitivesTested);
+         if(occluded)
+            return true;
+      }
+      return false;
+   }
+
+   // the same tests as Sphere::hit and XYRect::hit on the arrays
+   bool hitSpheres(uint32_t begin, uint32_t end, const Ray &ray, float timeMin, float &timeMax, HitRecord &record,
+                   Mailbox *mailbox, uint32_t &primitivesTested) const {
+#ifdef USE_SSE
+      if(cSphereBatches && mailbox == nullptr)
+         return hitSphereBatches(begin, end, ray, timeMin, timeMax, record, primitivesTested);
+#endif
+      const std::vector<uint32_t> &ids = mIds[PRIMITIVE_SPHERE];
+      uint32_t closest = UINT32_MAX;
+      for(uint32_t i=begin; i<end; ++i) {
+         if(mailbox != nullptr && mailbox->contains(ids[i]))
+            continue;
+         primitivesTested += 1;
+         float ocx = ray.mOrigin[0] - mSphereX[i];
+         float ocy = ray.mOrigin[1] - mSphereY[i];
+         float ocz = ray.mOrigin[2] - mSphereZ[i];
+         float b = ocx*ray.mDirection[0] + ocy*ray.mDirection[1] + ocz*ray.mDirection[2];
+         float c = ocx*ocx + ocy*ocy + ocz*ocz - mSphereRadius[i]*mSphereRadius[i];
+         float discriminant = b*b - c;
+         if(discriminant <= 0)
+            continue;
+         float root = sqrt(discriminant);
+         float t = -b - root;
+         if(!(t < timeMax && t > timeMin))
+            t = -b + root;
+         if(t < timeMax && t > timeMin) {
+            timeMax = t;
+            closest = i;
+         }
+      }
+      if(closest == UINT32_MAX)
+         return false;
+      record.time = timeMax;
+      record.object = mObjects[PRIMITIVE_SPHERE][closest];
+      return true;
+   }
+#ifdef USE_SSE
+   // the arrays are padded, so the last batch may read past the run
+   bool hitSphereBatches(uint32_t begin, uint32_t end, const Ray &ray, float timeMin, float &timeMax, HitRecord &record,
+                         uint32_t &primitivesTested) const {
+      uint32_t closest = UINT32_MAX;
+      primitivesTested += end - begin;
+#ifdef USE_AVX2
+      if(gUseAVX2) {
+         for(uint32_t first=begin; first<end; first+=cSphereBatchSize) {
+            int lane = closestSphereAVX2(&mSphereX[first], &mSphereY[first], &mSphereZ[first], &mSphereRadius[first],
+                                         std::min(end - first, uint32_t(cSphereBatchSize)), ray, timeMin, timeMax);
+            if(lane >= 0)
+               closest = first + lane;
+         }
+      } else
+#endif
+      {
+         for(uint32_t first=begin; first<end; first+=4) {
+            int lane = closestSphereSSE(&mSphereX[first], &mSphereY[first], &mSphereZ[first], &mSphereRadius[first],
+                                        std::min(end - first, 4u), ray, timeMin, timeMax);
+            if(lane >= 0)
+               closest = first + lane;
+         }
+      }
+      if(closest == UINT32_MAX)
+         return false;
+      record.time = timeMax;
+      record.object = mObjects[PRIMITIVE_SPHERE][closest];
+      return true;
+   }
+#endif
+   bool hitRects(uint32_t begin, uint32_t end, const Ray &ray, float timeMin, float &timeMax, HitRecord &record,
+                 Mailbox *mailbox, uint32_t &primitivesTested) const {
+      const std::vector<uint32_t> &ids = mIds[PRIMITIVE_XYRECT];
+      uint32_t closest = UINT32_MAX;
+      for(uint32_t i=begin; i<end; ++i) {
+         if(mailbox != nullptr && mailbox->contains(ids[i]))
+            continue;
+         primitivesTested += 1;
+         float t = (mRectK[i] - ray.mOrigin[2]) * ray.mInvDirection[2];
+         if(t < timeMin || t > timeMax)
+            continue;
+         float x = ray.mOrigin[0] + t * ray.mDirection[0];
+         float y = ray.mOrigin[1] + t * ray.mDirection[1];
+         if(x < mRectX0[i] || x > mRectX1[i] || y < mRectY0[i] || y > mRectY1[i])
+            continue;
+         timeMax = t;
+         closest = i;
+      }
+      if(closest == UINT32_MAX)
+         return false;
+      record.time = timeMax;
+      record.object = mObjects[PRIMITIVE_XYRECT][closest];
+      return true;
+   }
+   bool hitHitables(uint32_t begin, uint32_t end, Ray &ray, float timeMin, float &timeMax, HitRecord &record,
+                    Mailbox *mailbox, uint32_t &primitivesTested) const {
+      bool hitAnything = false;
+      for(uint32_t i=begin; i<end; ++i) {
+         if(mailbox != nullptr && mailbox->contains(mIds[PRIMITIVE_HITABLE][i]))
+            continue;
+         primitivesTested += 1;
+         if(mObjects[PRIMITIVE_HITABLE][i]->hit(ray, timeMin, timeMax, record)) {
+            hitAnything = true;
+            timeMax = record.time;
+         }
+      }
+      return hitAnything;
+   }
+
+   bool occludedSpheres(uint32_t begin, uint32_t end, const Ray &ray, float timeMin, float timeMax, uint32_t &primitivesTested) const {
+#ifdef USE_SSE
+      if(cSphereBatches) {
+         int batchSize = 4;
+#ifdef USE_AVX2
+         batchSize = gUseAVX2 ? cSphereBatchSize : 4;
+#endif
+         for(uint32_t first=begin; first<end; first+=batchSize) {
+            int count = std::min(end - first, uint32_t(batchSize));
+            primitivesTested += count;
+            int mask;
+#ifdef USE_AVX2
+            __m256 t8;
+            if(gUseAVX2)
+               mask = sphereHitsAVX2(&mSphereX[first], &mSphereY[first], &mSphereZ[first], &mSphereRadius[first], count, ray,
+                                     timeMin, timeMax, t8);
+            else
+#endif
+            {
+               __m128 t4;
+               mask = sphereHitsSSE(&mSphereX[first], &mSphereY[first], &mSphereZ[first], &mSphereRadius[first], count, ray,
+                                    timeMin, timeMax, t4);
+            }
+            if(mask != 0)
+               return true;
+         }
+         return false;
+      }
+#endif
+      for(uint32_t i=begin; i<end; ++i) {
+         primitivesTested += 1;
+         float ocx = ray.mOrigin[0] - mSphereX[i];
+         float ocy = ray.mOrigin[1] - mSphereY[i];
+         float ocz = ray.mOrigin[2] - mSphereZ[i];
+         float b = ocx*ray.mDirection[0] + ocy*ray.mDirection[1] + ocz*ray.mDirection[2];
+         float c = ocx*ocx + ocy*ocy + ocz*ocz - mSphereRadius[i]*mSphereRadius[i];
+         float discriminant = b*b - c;
+         if(discriminant <= 0)
+            continue;
+         float root = sqrt(discriminant);
+         float near = -b - root;
+         float far = -b + root;
+         if((near < timeMax && near > timeMin) || (far < timeMax && far > timeMin))
+            return true;
+      }
+      return false;
+   }
+   bool occludedRects(uint32_t begin, uint32_t end, const Ray &ray, float timeMin, float timeMax, uint32_t &primitivesTested) const {
+      for(uint32_t i=begin; i<end; ++i) {
+         primitivesTested += 1;
+         float t = (mRectK[i] - ray.mOrigin[2]) * ray.mInvDirection[2];
+         if(t < timeMin || t > timeMax)
+            continue;
+         float x = ray.mOrigin[0] + t * ray.mDirection[0];
+         float y = ray.mOrigin[1] + t * ray.mDirection[1];
+         if(x >= mRectX0[i] && x <= mRectX1[i] && y >= mRectY0[i] && y <= mRectY1[i])
+            return true;
+      }
+      return false;
+   }
+   bool occludedHitables(uint32_t begin, uint32_t end, Ray &ray, float timeMin, float timeMax, uint32_t &primitivesTested) const {
+      for(uint32_t i=begin; i<end; ++i) {
+         primitivesTested += 1;
+         if(mObjects[PRIMITIVE_HITABLE][i]->occluded(ray, timeMin, timeMax))
+            return true;
+      }
+      return false;
+   }
+
+   std::vector<uint8_t> mSlotType;                          //per slot of the bvh indices
+   std::vector<uint32_t> mSlotIndex;                        //index in the arrays of the type
+   std::vector<Hitable*> mObjects[NUMBER_PRIMITIVE_TYPES];  //the hitables, they finalize the hits
+   std::vector<uint32_t> mIds[NUMBER_PRIMITIVE_TYPES];      //scene list indices for the mailbox
+   std::vector<float> mSphereX, mSphereY, mSphereZ, mSphereRadius;
+   std::vector<float> mRectX0, mRectX1, mRectY0, mRectY1, mRectK;
+};
+
+// ================================================================================
+
+const int cTreeletSize = 4096 / sizeof(LinearBVHNode);   //nodes of a treelet, one page
+
+// rearranges the nodes of a binary bvh for locality after the build. the traversals read one
+// child right after its parent, so the nodes are laid out in chains that continue with the
+// child of larger surface area, the one more rays visit. the other child starts a chain of
+// its own later on. depth first emits the chains in depth first order. treelet fills one page
+// at a time with the chains of the largest candidates reachable from the root of the treelet,
+// once the page is full the candidates left over become the roots of the following treelets
+void reorderNodes(LinearBVHNodeArray &nodes, int layout) {
+   if(layout == LAYOUT_BUILD || nodes.empty())
+      return;
+   size_t numberNodes = nodes.size();
+   std::vector<uint32_t> order;
+   order.reserve(numberNodes);
+   auto splitChildren = [&nodes](uint32_t index, uint32_t &adjacent, uint32_t &other) {
+      adjacent = nodes[index].leftChild(index);
+      other = nodes[index].rightChild(index);
+      if(nodes[other].bounds().surfaceArea() > nodes[adjacent].bounds().surfaceArea())
+         std::swap(adjacent, other);
+   };
+
+   if(layout == LAYOUT_DEPTH_FIRST) {
+      std::vector<uint32_t> stack(1, 0);
+      while(!stack.empty()) {
+         uint32_t index = stack.back();
+         stack.pop_back();
+         while(true) {
+            order.push_back(index);
+            if(nodes[index].isLeaf())
+               break;
+            uint32_t adjacent, other;
+            splitChildren(index, adjacent, other);
+            stack.push_back(other);
+            index = adjacent;
+         }
+      }
+   } else {
+      typedef std::pair<float, uint32_t> Candidate;
+      std::deque<uint32_t> roots(1, 0);
+      while(!roots.empty()) {
+         std::priority_queue<Candidate> candidates;
+         candidates.push(Candidate(nodes[roots.front()].bounds().surfaceArea(), roots.front()));
+         roots.pop_front();
+         size_t treeletEnd = order.size() + cTreeletSize;
+         bool chainCut = false;
+         uint32_t next = 0;
+         while(!candidates.empty() && order.size() < treeletEnd) {
+            uint32_t index = candidates.top().second;
+            candidates.pop();
+            while(true) {
+               order.push_back(index);
+               if(nodes[index].isLeaf())
+                  break;
+               uint32_t adjacent, other;
+               splitChildren(index, adjacent, other);
+               candidates.push(Candidate(nodes[other].bounds().surfaceArea(), other));
+               if(order.size() >= treeletEnd) {
+                  chainCut = true;
+                  next = adjacent;
+                  break;
+               }
+               index = adjacent;
+            }
+         }
+         while(!candidates.empty()) {
+            roots.push_front(candidates.top().second);
+            candidates.pop();
+         }
+         // a chain cut at the end of the page still has to continue right after it
+         if(chainCut)
+            roots.push_front(next);
+      }
+   }
+
+   std::vector<uint32_t> position(numberNodes);
+   for(uint32_t i=0; i<numberNodes; ++i) {
+      position[order[i]] = i;
+   }
+   LinearBVHNodeArray reordered(numberNodes);
+   for(uint32_t i=0; i<numberNodes; ++i) {
+      const LinearBVHNode &node = nodes[order[i]];
+      reordered[i] = node;
+      if(!node.isLeaf()) {
+         uint32_t left = position[node.leftChild(order[i])];
+         uint32_t right = position[node.rightChild(order[i])];
+         reordered[i].mSwapped = right == i + 1;
+         reordered[i].mOffset = right == i + 1 ? left : right;
+      }
+   }
+   nodes.swap(reordered);
+}
+
+// ================================================================================
+
+class LinearBVH : public Hitable {
+public:
+   // takes over the nodes and primitive indices written by a builder
+   LinearBVH(Hitable **list, LinearBVHNodeArray &nodes, std::vector<uint32_t> &indices)
+      : mList(list)
+      , mFile(nullptr)
+      , mShutterOpen(0.0f)
+      , mInvShutterTime(0.0f)
+   {
+      mNodes.swap(nodes);
+      mIndices.swap(indices);
+      // every primitive is referenced, more indices than primitives means duplicates
+      uint32_t numberPrimitives = mIndices.empty() ? 0 : *std::max_element(mIndices.begin(), mIndices.end()) + 1;
+      mHasDuplicates = mIndices.size() > numberPrimitives;
+   }
+   // traces directly from the nodes and indices in a mapped cache file, takes over the file
+   LinearBVH(Hitable **list, MappedFile *file, LinearBVHNode *nodes, size_t numberNodes, uint32_t *indices, size_t numberIndices,
+             bool hasDuplicates)
+      : mList(list)
+      , mHasDuplicates(hasDuplicates)
+      , mFile(file)
+      , mShutterOpen(0.0f)
+      , mInvShutterTime(0.0f)
+   {
+      mNodes.map(nodes, numberNodes);
+      mIndices.map(indices, numberIndices);
+   }
+   ~LinearBVH() {
+      delete mFile;
+   }
+
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      if(mNodes.empty())
+         return false;
+      if(cOrderedTraversal)
+         return hitOrdered(ray, timeMin, timeMax, record);
+      bool hitAnything = false;
+      uint32_t stack[cBVHStackSize];
+      int stackSize = 0;
+      uint32_t current = 0;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      float tEntry;
+      Mailbox mailbox;
+      while(true) {
+         const LinearBVHNode &node = mNodes[current];
+         nodesVisited += 1;
+         if(hitNode(current, ray, timeMin, timeMax, tEntry)) {
+            if(node.isLeaf() && !mGeometry.empty()) {
+               hitAnything |= mGeometry.hitLeaf(node, ray, timeMin, timeMax, record, mHasDuplicates ? &mailbox : nullptr,
+                                                primitivesTested);
+            } else if(node.isLeaf()) {
+               for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives; ++i) {
+                  if(mHasDuplicates && mailbox.contains(mIndices[i]))
+                     continue;
+                  primitivesTested += 1;
+                  if(mList[mIndices[i]]->hit(ray, timeMin, timeMax, record)) {
+                     hitAnything = true;
+                     timeMax = record.time;
+                  }
+               }
+            } else {
+               stack[stackSize++] = node.mOffset;
+               current = current + 1;
+               continue;
+            }
+         }
+         if(stackSize == 0)
+            break;
+         current = stack[--stackSize];
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return hitAnything;
+   }
+
+   // front to back traversal: the child on the near side of the split plane is visited
+   // first, the far child is pushed together with its entry distance and skipped when a
+   // closer hit has been found in the meantime. packets finishing a subtree with single rays
+   // pass the mailbox of the ray along
+   bool hitOrdered(Ray &ray, float timeMin, float timeMax, HitRecord &record, uint32_t root = 0, Mailbox *rayMailbox = nullptr) {
+      struct StackEntry {
+         uint32_t mNode;
+         float mEntry;
+      } stack[cBVHStackSize];
+      int stackSize = 0;
+      bool hitAnything = false;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      uint32_t current = root;
+      float tEntry, tEntrySecond;
+      Mailbox ownMailbox;
+      Mailbox &mailbox = rayMailbox != nullptr ? *rayMailbox : ownMailbox;
+      // consecutive node fetches from different cache lines and pages, to compare node layouts
+      uint32_t cacheLines = 0, pages = 0;
+      uint32_t lastLine = ~0u, lastPage = ~0u;
+      auto fetch = [&](uint32_t index) {
+         uint32_t line = index * sizeof(LinearBVHNode) / 64;
+         cacheLines += line != lastLine;
+         pages += line / (4096/64) != lastPage;
+         lastLine = line;
+         lastPage = line / (4096/64);
+      };
+      fetch(root);
+      if(!hitNode(root, ray, timeMin, timeMax, tEntry)) {
+         tCurrentRay.mNodesVisited += 1;
+         tCurrentRay.mCacheLines += 1;
+         tCurrentRay.mPages += 1;
+         return false;
+      }
+      nodesVisited = 1;
+      while(true) {
+         const LinearBVHNode &node = mNodes[current];
+         if(node.isLeaf() && !mGeometry.empty()) {
+            hitAnything |= mGeometry.hitLeaf(node, ray, timeMin, timeMax, record, mHasDuplicates ? &mailbox : nullptr,
+                                             primitivesTested);
+         } else if(node.isLeaf()) {
+            for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives; ++i) {
+               if(mHasDuplicates && mailbox.contains(mIndices[i]))
+                  continue;
+               primitivesTested += 1;
+               if(mList[mIndices[i]]->hit(ray, timeMin, timeMax, record)) {
+                  hitAnything = true;
+                  timeMax = record.time;
+               }
+            }
+         } else {
+            uint32_t first = current + 1;
+            uint32_t second = node.mOffset;
+            if(ray.mSign[node.mAxis] != node.mSwapped)
+               std::swap(first, second);
+            fetch(first);
+            fetch(second);
+            bool hitFirst = hitNode(first, ray, timeMin, timeMax, tEntry);
+            bool hitSecond = hitNode(second, ray, timeMin, timeMax, tEntrySecond);
+            nodesVisited += 2;
+            if(hitFirst) {
+               if(hitSecond) {
+                  stack[stackSize].mNode = second;
+                  stack[stackSize].mEntry = tEntrySecond;
+                  ++stackSize;
+               }
+               current = first;
+               continue;
+            } else if(hitSecond) {
+               current = second;
+               continue;
+            }
+         }
+         while(stackSize > 0 && stack[stackSize-1].mEntry >= timeMax) {
+            --stackSize;
+         }
+         if(stackSize == 0)
+            break;
+         current = stack[--stackSize].mNode;
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      tCurrentRay.mCacheLines += cacheLines;
+      tCurrentRay.mPages += pages;
+      return hitAnything;
+   }
+
+   // front to back like hitOrdered, with the rays of the packet that hit the node. once fewer
+   // than cPacketMinActive rays are left, they finish the subtree one by one. with type sorted
+   // geometry the leaves are intersected per ray like in hitOrdered, so the sphere runs use the
+   // SIMD batches; otherwise every primitive takes the rays of the packet at once
+   void hitPacket(RayPacket &packet, uint64_t mask, float timeMin) {
+      if(mNodes.empty())
+         return;
+      // the rays of a packet sample different times, every one needs its own node boxes
+      if(!mEndBounds.empty()) {
+         Hitable::hitPacket(packet, mask, timeMin);
+         return;
+      }
+      struct StackEntry {
+         uint32_t mNode;
+         uint64_t mMask;
+      } stack[cBVHStackSize];
+      int stackSize = 0;
+      uint32_t current = 0;
+      Mailbox mailboxes[cPacketSize];      //per ray, only used when spatial splits duplicated primitives
+      while(true) {
+         const LinearBVHNode &node = mNodes[current];
+         RayPacket::count(mask, packet.mNodesVisited, 1);
+         mask = packet.intersect(node.mMin, node.mMax, timeMin, mask);
+         if(mask != 0 && countBits64(mask) < cPacketMinActive) {
+            while(mask != 0) {
+               int i = countTrailingZeros64(mask);
+               mask &= mask - 1;
+               tCurrentRay = RayCounters();
+               if(hitOrdered(packet.mRays[i], timeMin, packet.mTimeMax[i], packet.mRecords[i], current,
+                             mHasDuplicates ? &mailboxes[i] : nullptr)) {
+                  packet.mTimeMax[i] = packet.mRecords[i].time;
+                  packet.mHit |= uint64_t(1) << i;
+               }
+               packet.mNodesVisited[i] += tCurrentRay.mNodesVisited;
+               packet.mPrimitivesTested[i] += tCurrentRay.mPrimitivesTested;
+            }
+         } else if(mask != 0 && node.isLeaf() && !mGeometry.empty()) {
+            uint64_t rays = mask;
+            while(rays != 0) {
+               int i = countTrailingZeros64(rays);
+               rays &= rays - 1;
+               tCurrentRay = RayCounters();
+               uint32_t primitivesTested = 0;
+               if(mGeometry.hitLeaf(node, packet.mRays[i], timeMin, packet.mTimeMax[i], packet.mRecords[i],
+                                    mHasDuplicates ? &mailboxes[i] : nullptr, primitivesTested))
+                  packet.mHit |= uint64_t(1) << i;
+               packet.mNodesVisited[i] += tCurrentRay.mNodesVisited;
+               packet.mPrimitivesTested[i] += tCurrentRay.mPrimitivesTested + primitivesTested;
+            }
+         } else if(mask != 0 && node.isLeaf()) {
+            for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives; ++i) {
+               uint64_t primitiveMask = mask;
+               if(mHasDuplicates) {
+                  for(uint64_t rays=mask; rays!=0; rays&=rays-1) {
+                     int ray = countTrailingZeros64(rays);
+                     if(mailboxes[ray].contains(mIndices[i]))
+                        primitiveMask &= ~(uint64_t(1) << ray);
+                  }
+               }
+               RayPacket::count(primitiveMask, packet.mPrimitivesTested, 1);
+               mList[mIndices[i]]->hitPacket(packet, primitiveMask, timeMin);
+            }
+         } else if(mask != 0) {
+            uint32_t first = current + 1;
+            uint32_t second = node.mOffset;
+            if(packet.mSign[node.mAxis] != node.mSwapped)
+               std::swap(first, second);
+            stack[stackSize].mNode = second;
+            stack[stackSize].mMask = mask;
+            ++stackSize;
+            current = first;
+            continue;
+         }
+         if(stackSize == 0)
+            break;
+         --stackSize;
+         current = stack[stackSize].mNode;
+         mask = stack[stackSize].mMask;
+      }
+   }
+
+   // any hit needs no order and no mailbox, a primitive referenced twice is only tested again
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      if(mNodes.empty())
+         return false;
+      uint32_t stack[cBVHStackSize];
+      int stackSize = 0;
+      uint32_t current = 0;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      bool occluded = false;
+      float tEntry;
+      while(true) {
+         const LinearBVHNode &node = mNodes[current];
+         nodesVisited += 1;
+         if(hitNode(current, ray, timeMin, timeMax, tEntry)) {
+            if(!node.isLeaf()) {
+               stack[stackSize++] = node.mOffset;
+               current = current + 1;
+               continue;
+            }
+            if(!mGeometry.empty()) {
+               occluded = mGeometry.occludedLeaf(node, ray, timeMin, timeMax, primitivesTested);
+            } else {
+               for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives && !occluded; ++i) {
+                  primitivesTested += 1;
+                  occluded = mList[mIndices[i]]->occluded(ray, timeMin, timeMax);
+               }
+            }
+         }
+         if(occluded || stackSize == 0)
+            break;
+         current = stack[--stackSize];
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return occluded;
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      if(mNodes.empty())
+         return false;
+      aabb = mNodes[0].bounds();
+      return true;
+   }
+
+   float sahCost(const SAHSettings &settings) const {
+      if(mNodes.empty() || mNodes[0].bounds().surfaceArea() <= 0.0f)
+         return 0.0f;
+      float cost = 0.0f;
+      for(size_t i=0; i<mNodes.size(); ++i) {
+         float area = mNodes[i].bounds().surfaceArea();
+         if(mNodes[i].isLeaf())
+            cost += settings.mIntersectionCost * mNodes[i].mNumberPrimitives * area;
+         else
+            cost += settings.mTraversalCost * area;
+      }
+      return cost / mNodes[0].bounds().surfaceArea();
+   }
+
+   void report(const SAHSettings &settings, BVHReport &report) const {
+      report.mType = "bvh2";
+      report.mMemory = mNodes.size()*sizeof(LinearBVHNode) + mIndices.size()*sizeof(uint32_t) + mGeometry.memory();
+      if(mNodes.empty())
+         return;
+      reportNode(0, 0, report);
+      report.finish(mNodes[0].bounds(), settings);
+   }
+
+   // updates the node bounds bottom up from the current primitive bounds, the subtrees of the
+   // top cRefitJobDepth levels are refit as jobs. the topology stays the same, so the tree
+   // gets worse the further primitives move away from where they were at build time
+   void refit(float time0, float time1, JobSystem *jobSystem) {
+      if(!mNodes.empty())
+         refitNode(0, 0, time0, time1, jobSystem);
+      mGeometry.update();
+   }
+
+   // refits the nodes to the primitive bounds at shutter open and keeps the bounds at shutter
+   // close next to them. the traversals interpolate both by the time of the ray, which stays
+   // tight for linear motion where the union over the interval would cover the whole path
+   void refitMotion(float time0, float time1, JobSystem *jobSystem) {
+      if(mNodes.empty())
+         return;
+      refitNode(0, 0, time1, time1, jobSystem);
+      mEndBounds.resize(mNodes.size());
+      for(size_t i=0; i<mNodes.size(); ++i) {
+         mEndBounds[i] = mNodes[i].bounds();
+      }
+      refitNode(0, 0, time0, time0, jobSystem);
+      mGeometry.update();
+      mShutterOpen = time0;
+      mInvShutterTime = time1 > time0 ? 1.0f / (time1 - time0) : 0.0f;
+   }
+   bool hasMotion() const { return !mEndBounds.empty(); }
+
+   // copies the primitives into the type sorted arrays the leaves are intersected with
+   void sortGeometry() {
+      mGeometry.build(mList, mNodes.data(), mNodes.size(), mIndices.data(), mIndices.size());
+   }
+
+   Hitable **mList;
+   MappableArray<LinearBVHNode, LinearBVHNodeArray> mNodes;
+   MappableArray<uint32_t> mIndices;
+   bool mHasDuplicates;          //spatial splits referenced primitives in several leaves, use mailboxing
+   MappedFile *mFile;            //cache file the nodes and indices are mapped from, if any
+   std::vector<AABB> mEndBounds; //node bounds at shutter close after refitMotion, the nodes hold the ones at shutter open
+   float mShutterOpen;
+   float mInvShutterTime;
+   GeometryArrays mGeometry;     //empty unless sortGeometry was called
+
+private:
+   bool hitNode(uint32_t index, const Ray &ray, float tmin, float tmax, float &tEntry) const {
+      const LinearBVHNode &node = mNodes[index];
+      if(mEndBounds.empty())
+         return node.hit(ray, tmin, tmax, tEntry);
+      float s = ffmin(1.0f, ffmax(0.0f, (ray.mTime - mShutterOpen) * mInvShutterTime));
+      const float *endMin = &mEndBounds[index].mMin[0];
+      const float *endMax = &mEndBounds[index].mMax[0];
+      for(int a=0; a<3; ++a) {
+         float boxMin = node.mMin[a] + s * (endMin[a] - node.mMin[a]);
+         float boxMax = node.mMax[a] + s * (endMax[a] - node.mMax[a]);
+         float tNear = ((ray.mSign[a] ? boxMax : boxMin) - ray.mOrigin[a]) * ray.mInvDirection[a];
+         float tFar = ((ray.mSign[a] ? boxMin : boxMax) - ray.mOrigin[a]) * ray.mInvDirection[a];
+         tmin = ffmax(tNear, tmin);
+         tmax = ffmin(tFar, tmax);
+      }
+      tEntry = tmin;
+      return tmin < tmax;
+   }
+
+   void reportNode(uint32_t index, int depth, BVHReport &report) const {
+      const LinearBVHNode &node = mNodes[index];
+      if(node.isLeaf()) {
+         report.addLeaf(depth, node.bounds(), node.mNumberPrimitives);
+         return;
+      }
+      report.addInnerNode(depth, node.bounds(), overlapBox(mNodes[index+1].bounds(), mNodes[node.mOffset].bounds()).surfaceArea());
+      reportNode(index+1, depth+1, report);
+      reportNode(node.mOffset, depth+1, report);
+   }
+
+   AABB refitNode(uint32_t index, int depth, float time0, float time1, JobSystem *jobSystem) {
+      LinearBVHNode &node = mNodes[index];
+      AABB bounds;
+      bounds.reset();
+      if(node.isLeaf()) {
+         for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives; ++i) {
+            AABB box;
+            mList[mIndices[i]]->boundingBox(time0, time1, box);
+            bounds.extend(box);
+         }
+      } else {
+         uint32_t children[2] = { index+1, node.mOffset };
+         AABB childBounds[2];
+         if(jobSystem != nullptr && depth < cRefitJobDepth) {
+            parallelFor(jobSystem, 0, 2, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+               childBounds[chunk] = refitNode(children[chunk], depth+1, time0, time1, jobSystem);
+            });
+         } else {
+            for(int c=0; c<2; ++c) {
+               childBounds[c] = refitNode(children[c], depth+1, time0, time1, jobSystem);
+            }
+         }
+         bounds = surroundingBox(childBounds[0], childBounds[1]);
+      }
+      node.setBounds(bounds);
+      return bounds;
+   }
+};
+
+// ================================================================================
+
+// array files hold a header and arrays written the way they are laid out in memory, so readers
+// map the file and use its pages without deserializing. they are little endian, every array
+// starts on a cArrayFileAlignment boundary and the header begins with a magic and a version.
+
+const uint64_t cArrayFileAlignment = 64;
+
+struct ArrayFileHeader {
+   char mMagic[8];
+   uint32_t mVersion;
+};
+
+inline bool isLittleEndian() {
+   uint32_t one = 1;
+   uint8_t firstByte;
+   memcpy(&firstByte, &one, 1);
+   return firstByte == 1;
+}
+
+inline uint64_t alignArrayFileOffset(uint64_t offset) {
+   return (offset + cArrayFileAlignment - 1) & ~(cArrayFileAlignment - 1);
+}
+
+inline void initArrayFileHeader(ArrayFileHeader &header, const char *magic, uint32_t version) {
+   memcpy(header.mMagic, magic, sizeof(header.mMagic));
+   header.mVersion = version;
+}
+
+// places the arrays behind the header in order
+void layoutArrayFile(uint64_t headerSize, const uint64_t *sizes, int numberArrays, uint64_t *offsets) {
+   uint64_t offset = headerSize;
+   for(int a=0; a<numberArrays; ++a) {
+      offsets[a] = alignArrayFileOffset(offset);
+      offset = offsets[a] + sizes[a];
+   }
+}
+
+// the header starts with an ArrayFileHeader. writes to a temporary file first, so readers never
+// map a partially written file
+bool writeArrayFile(const char *filename, const void *header, uint64_t headerSize, const char *const *arrays,
+                    const uint64_t *offsets, const uint64_t *sizes, int numberArrays) {
+   if(!isLittleEndian())
+      return false;
+   char temporaryFilename[256];
+   snprintf(temporaryFilename, sizeof(temporaryFilename), "%s.tmp", filename);
+   FILE *file = fopen(temporaryFilename, "wb");
+   if(file == nullptr)
+      return false;
+   const char padding[cArrayFileAlignment] = {};
+   bool written = fwrite(header, headerSize, 1, file) == 1;
+   uint64_t offset = headerSize;
+   for(int a=0; a<numberArrays && written; ++a) {
+      written = fwrite(padding, 1, offsets[a] - offset, file) == offsets[a] - offset
+         && fwrite(arrays[a], 1, sizes[a], file) == sizes[a];
+      offset = offsets[a] + sizes[a];
+   }
+   written = fclose(file) == 0 && written;
+   remove(filename);
+   if(!written || rename(temporaryFilename, filename) != 0) {
+      remove(temporaryFilename);
+      return false;
+   }
+   return true;
+}
+
+// returns nullptr if the file can't be mapped or is too small for the header
+MappedFile *mapArrayFile(const char *filename, uint64_t headerSize) {
+   if(!isLittleEndian())
+      return nullptr;
+   MappedFile *file = new MappedFile();
+   if(!file->open(filename) || file->mSize < headerSize) {
+      delete file;
+      return nullptr;
+   }
+   return file;
+}
+
+// checks magic and version and that the arrays are aligned, in order and inside the file
+bool validArrayFile(const MappedFile &file, const char *magic, uint32_t version, uint64_t headerSize,
+                    const uint64_t *offsets, const uint64_t *sizes, int numberArrays) {
+   const ArrayFileHeader &header = *(const ArrayFileHeader*)file.mData;
+   if(memcmp(header.mMagic, magic, sizeof(header.mMagic)) != 0 || header.mVersion != version)
+      return false;
+   uint64_t end = headerSize;
+   for(int a=0; a<numberArrays; ++a) {
+      if(offsets[a] % cArrayFileAlignment != 0 || offsets[a] < end || offsets[a] > file.mSize || sizes[a] > file.mSize - offsets[a])
+         return false;
+      end = offsets[a] + sizes[a];
+   }
+   return true;
+}
+
+// ================================================================================
+
+// bvh cache: the nodes and indices of a LinearBVH are kept in an array file, so later runs map
+// it and trace from its pages. the header records the node size of the writer, and the file
+// name and the header carry a hash of the primitive bounds and builder settings, so a changed
+// scene never picks up a stale tree.
+
+const char cBVHCacheMagic[8] = { 'L', 'Y', 'R', 'B', 'V', 'H', 'C', '\0' };
+const uint32_t cBVHCacheVersion = 1;
+
+struct BVHCacheHeader {
+   ArrayFileHeader mFile;
+   uint32_t mNodeSize;           //sizeof(LinearBVHNode) of the writer
+   uint64_t mSceneHash;
+   uint64_t mNumberNodes;
+   uint64_t mNumberIndices;
+   uint64_t mNodesOffset;        //file offsets of the arrays
+   uint64_t mIndicesOffset;
+   uint32_t mHasDuplicates;
+   uint32_t mPad;
+};
+
+static_assert(sizeof(BVHCacheHeader) == 64, "BVHCacheHeader should be 64 bytes");
+
+// fnv-1a over 32 bit words
+inline uint64_t hashWords(uint64_t hash, const void *data, size_t size) {
+   const uint8_t *bytes = (const uint8_t*)data;
+   for(size_t i=0; i+4<=size; i+=4) {
+      uint32_t word;
+      memcpy(&word, bytes+i, 4);
+      hash = (hash ^ word) * 0x100000001b3ull;
+   }
+   return hash;
+}
+
+// identifies the tree a builder makes of the primitives: their bounds and the build settings
+uint64_t hashScene(const std::vector<PrimitiveRef> &refs, int builder, const SAHSettings &settings, int mortonCodeBits, int layout) {
+   uint64_t hash = 0xcbf29ce484222325ull;
+   uint32_t values[5] = { cBVHCacheVersion, uint32_t(builder), uint32_t(mortonCodeBits), uint32_t(layout), uint32_t(refs.size()) };
+   hash = hashWords(hash, values, sizeof(values));
+   hash = hashWords(hash, &settings, sizeof(settings));
+   for(size_t i=0; i<refs.size(); ++i) {
+      hash = hashWords(hash, &refs[i].mBox, sizeof(AABB));
+   }
+   return hash;
+}
+
+bool saveBVHCache(const char *filename, uint64_t sceneHash, const LinearBVH &bvh) {
+   BVHCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   initArrayFileHeader(header.mFile, cBVHCacheMagic, cBVHCacheVersion);
+   header.mNodeSize = sizeof(LinearBVHNode);
+   header.mSceneHash = sceneHash;
+   header.mNumberNodes = bvh.mNodes.size();
+   header.mNumberIndices = bvh.mIndices.size();
+   header.mHasDuplicates = bvh.mHasDuplicates ? 1 : 0;
+   const char *arrays[2] = { (const char*)bvh.mNodes.data(), (const char*)bvh.mIndices.data() };
+   uint64_t sizes[2] = { header.mNumberNodes*sizeof(LinearBVHNode), header.mNumberIndices*sizeof(uint32_t) };
+   uint64_t offsets[2];
+   layoutArrayFile(sizeof(header), sizes, 2, offsets);
+   header.mNodesOffset = offsets[0];
+   header.mIndicesOffset = offsets[1];
+   return writeArrayFile(filename, &header, sizeof(header), arrays, offsets, sizes, 2);
+}
+
+// the nodes and indices are traced as they are, so the tree has to be well formed: every node
+// but the root is the child of exactly one inner node and the leaves refer to primitives of the list
+bool validBVHCache(const LinearBVHNode *nodes, uint32_t numberNodes, const uint32_t *indices, uint32_t numberIndices, int size) {
+   if(numberNodes == 0)
+      return size == 0;
+   std::vector<uint8_t> parents(numberNodes, 0);
+   for(uint32_t i=0; i<numberNodes; ++i) {
+      const LinearBVHNode &node = nodes[i];
+      if(node.isLeaf()) {
+         if(uint64_t(node.mOffset) + node.mNumberPrimitives > numberIndices)
+            return false;
+         continue;
+      }
+      uint32_t children[2] = { node.leftChild(i), node.rightChild(i) };
+      for(int c=0; c<2; ++c) {
+         if(children[c] == 0 || children[c] >= numberNodes || parents[children[c]]++ != 0)
+            return false;
+      }
+   }
+   for(uint32_t i=0; i<numberIndices; ++i) {
+      if(indices[i] >= uint32_t(size))
+         return false;
+   }
+   return true;
+}
+
+// returns nullptr if there is no cache for this scene, it was written by an incompatible version
+// or its tree is damaged
+LinearBVH *loadBVHCache(const char *filename, uint64_t sceneHash, Hitable **list, int size) {
+   MappedFile *file = mapArrayFile(filename, sizeof(BVHCacheHeader));
+   if(file == nullptr)
+      return nullptr;
+   char *data = (char*)file->mData;
+   const BVHCacheHeader &header = *(const BVHCacheHeader*)data;
+   uint64_t offsets[2] = { header.mNodesOffset, header.mIndicesOffset };
+   uint64_t sizes[2] = { header.mNumberNodes*sizeof(LinearBVHNode), header.mNumberIndices*sizeof(uint32_t) };
+   bool valid = header.mNodeSize == sizeof(LinearBVHNode)
+      && header.mSceneHash == sceneHash
+      && header.mNumberNodes <= UINT32_MAX && header.mNumberIndices <= UINT32_MAX
+      && header.mNumberNodes <= file->mSize && header.mNumberIndices <= file->mSize
+      && validArrayFile(*file, cBVHCacheMagic, cBVHCacheVersion, sizeof(header), offsets, sizes, 2);
+   if(!valid) {
+      delete file;
+      return nullptr;
+   }
+   if(!validBVHCache((const LinearBVHNode*)(data + header.mNodesOffset), uint32_t(header.mNumberNodes),
+                     (const uint32_t*)(data + header.mIndicesOffset), uint32_t(header.mNumberIndices), size)) {
+      printf("bvh cache %s is damaged, rebuilding\n", filename);
+      delete file;
+      return nullptr;
+   }
+   return new LinearBVH(list, file, (LinearBVHNode*)(data + header.mNodesOffset), header.mNumberNodes,
+                        (uint32_t*)(data + header.mIndicesOffset), header.mNumberIndices, header.mHasDuplicates != 0);
+}
+
+// ================================================================================
+
+// multi branching bvh, collapsed from the binary LinearBVH. every node stores the bounds of
+// its N children as structure of arrays so one SIMD slab test covers all of them: SSE for
+// N=4, AVX2 for N=8 (two SSE tests when the cpu has no AVX2).
+
+template<int N>
+struct alignas(64) WideBVHNode {
+   AABB childBounds(int i) const {
+      return AABB(vector3f(mMinX[i], mMinY[i], mMinZ[i]), vector3f(mMaxX[i], mMaxY[i], mMaxZ[i]));
+   }
+   void setBounds(const AABB *bounds, int numberChildren) {
+      for(int i=0; i<numberChildren; ++i) {
+         mMinX[i] = bounds[i].mMin[0];
+         mMinY[i] = bounds[i].mMin[1];
+         mMinZ[i] = bounds[i].mMin[2];
+         mMaxX[i] = bounds[i].mMax[0];
+         mMaxY[i] = bounds[i].mMax[1];
+         mMaxZ[i] = bounds[i].mMax[2];
+      }
+   }
+
+   float mMinX[N], mMinY[N], mMinZ[N];
+   float mMaxX[N], mMaxY[N], mMaxZ[N];
+   uint32_t mChild[N];                 //inner child: node index, leaf: first primitive index
+   uint16_t mNumberPrimitives[N];      //0 for inner children
+   uint8_t mNumberChildren;
+};
+
+// compressed wide node, half the size of WideBVHNode (64 bytes for N=4, 128 for N=8). the child
+// bounds are 8 bit steps of a per axis power of two scale from the minimum corner of the node.
+// minimums are rounded down and maximums up, so the decoded boxes always contain the exact ones.
+// the products of the steps and the scale are exact, the box test folds the frame into the ray
+const int cQuantizedSteps = 255;
+
+template<int N>
+struct alignas(64) QuantizedWideBVHNode {
+   float scale(int axis) const {
+      return ldexpf(1.0f, mExponent[axis]);
+   }
+   AABB childBounds(int i) const {
+      const uint8_t *minimum[3] = { mMinX, mMinY, mMinZ };
+      const uint8_t *maximum[3] = { mMaxX, mMaxY, mMaxZ };
+      AABB box;
+      for(int axis=0; axis<3; ++axis) {
+         box.mMin[axis] = mOrigin[axis] + float(minimum[axis][i]) * scale(axis);
+         box.mMax[axis] = mOrigin[axis] + float(maximum[axis][i]) * scale(axis);
+      }
+      return box;
+   }
+   void setBounds(const AABB *bounds, int numberChildren) {
+      AABB nodeBounds;
+      nodeBounds.reset();
+      for(int i=0; i<numberChildren; ++i) {
+         nodeBounds.extend(bounds[i]);
+      }
+      uint8_t *minimum[3] = { mMinX, mMinY, mMinZ };
+      uint8_t *maximum[3] = { mMaxX, mMaxY, mMaxZ };
+      for(int axis=0; axis<3; ++axis) {
+         float origin = nodeBounds.mMin[axis];
+         int exponent;
+         frexpf((nodeBounds.mMax[axis] - origin) / cQuantizedSteps, &exponent);
+         exponent = std::max(exponent, -126);
+         while(exponent < 127 && origin + cQuantizedSteps * ldexpf(1.0f, exponent) < nodeBounds.mMax[axis])
+            ++exponent;
+         mOrigin[axis] = origin;
+         mExponent[axis] = int8_t(exponent);
+         float step = scale(axis);
+         for(int i=0; i<numberChildren; ++i) {
+            int low = std::max(0, std::min(cQuantizedSteps, int(floorf((bounds[i].mMin[axis] - origin) / step))));
+            while(low > 0 && origin + float(low) * step > bounds[i].mMin[axis])
+               --low;
+            int high = std::max(0, std::min(cQuantizedSteps, int(ceilf((bounds[i].mMax[axis] - origin) / step))));
+            while(high < cQuantizedSteps && origin + float(high) * step < bounds[i].mMax[axis])
+               ++high;
+            minimum[axis][i] = uint8_t(low);
+            maximum[axis][i] = uint8_t(high);
+         }
+      }
+   }
+
+   float mOrigin[3];
+   int8_t mExponent[3];
+   uint8_t mNumberChildren;
+   uint8_t mMinX[N], mMinY[N], mMinZ[N];
+   uint8_t mMaxX[N], mMaxY[N], mMaxZ[N];
+   uint32_t mChild[N];                 //inner child: node index, leaf: first primitive index
+   uint16_t mNumberPrimitives[N];      //0 for inner children
+};
+
+// the ray in the frame of a quantized node, the slab distance of step q on an axis is q*mScale + mOffset
+struct QuantizedRay {
+   template<int N>
+   QuantizedRay(const QuantizedWideBVHNode<N> &node, const float *origin, const float *invDirection) {
+      for(int axis=0; axis<3; ++axis) {
+         mScale[axis] = node.scale(axis) * invDirection[axis];
+         mOffset[axis] = (node.mOrigin[axis] - origin[axis]) * invDirection[axis];
+      }
+   }
+   float mScale[3];
+   float mOffset[3];
+};
+
+// slab test against N children, returns a bit mask of the children hit and their entry distances
+template<int N>
+inline int intersectChildrenScalar(const WideBVHNode<N> &node, int first, const float *origin, const float *invDirection,
+                                   float tmin, float tmax, float *tEntry) {
+   int mask = 0;
+   for(int i=first; i<first+4 && i<N; ++i) {
+      float t0x = (node.mMinX[i] - origin[0]) * invDirection[0];
+      float t1x = (node.mMaxX[i] - origin[0]) * invDirection[0];
+      float t0y = (node.mMinY[i] - origin[1]) * invDirection[1];
+      float t1y = (node.mMaxY[i] - origin[1]) * invDirection[1];
+      float t0z = (node.mMinZ[i] - origin[2]) * invDirection[2];
+      float t1z = (node.mMaxZ[i] - origin[2]) * invDirection[2];
+      float tNear = ffmax(ffmax(ffmin(t0x, t1x), ffmin(t0y, t1y)), ffmax(ffmin(t0z, t1z), tmin));
+      float tFar = ffmin(ffmin(ffmax(t0x, t1x), ffmax(t0y, t1y)), ffmin(ffmax(t0z, t1z), tmax));
+      tEntry[i] = tNear;
+      if(tNear < tFar)
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+#ifdef USE_SSE
+template<int N>
+inline int intersectChildrenSSE(const WideBVHNode<N> &node, int first, const float *origin, const float *invDirection,
+                                float tmin, float tmax, float *tEntry) {
+   __m128 ox = _mm_set1_ps(origin[0]);
+   __m128 oy = _mm_set1_ps(origin[1]);
+   __m128 oz = _mm_set1_ps(origin[2]);
+   __m128 idx = _mm_set1_ps(invDirection[0]);
+   __m128 idy = _mm_set1_ps(invDirection[1]);
+   __m128 idz = _mm_set1_ps(invDirection[2]);
+   __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinX+first), ox), idx);
+   __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxX+first), ox), idx);
+   __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinY+first), oy), idy);
+   __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxY+first), oy), idy);
+   __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMinZ+first), oz), idz);
+   __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.mMaxZ+first), oz), idz);
+   __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                             _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin)));
+   __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                            _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+   _mm_storeu_ps(tEntry+first, tNear);
+   return _mm_movemask_ps(_mm_cmplt_ps(tNear, tFar)) << first;
+}
+#endif
+
+#ifdef USE_AVX2
+TARGET_AVX2 int intersectChildrenAVX2(const WideBVHNode<8> &node, const float *origin, const float *invDirection,
+                                      float tmin, float tmax, float *tEntry) {
+   __m256 ox = _mm256_set1_ps(origin[0]);
+   __m256 oy = _mm256_set1_ps(origin[1]);
+   __m256 oz = _mm256_set1_ps(origin[2]);
+   __m256 idx = _mm256_set1_ps(invDirection[0]);
+   __m256 idy = _mm256_set1_ps(invDirection[1]);
+   __m256 idz = _mm256_set1_ps(invDirection[2]);
+   __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMinX), ox), idx);
+   __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMaxX), ox), idx);
+   __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMinY), oy), idy);
+   __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMaxY), oy), idy);
+   __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMinZ), oz), idz);
+   __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.mMaxZ), oz), idz);
+   __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+                                _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(tmin)));
+   __m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+                               _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tmax)));
+   _mm256_storeu_ps(tEntry, tNear);
+   return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LT_OQ));
+}
+#endif
+
+template<int N>
+inline int intersectChildrenScalar(const QuantizedWideBVHNode<N> &node, int first, const QuantizedRay &ray,
+                                   float tmin, float tmax, float *tEntry) {
+   int mask = 0;
+   for(int i=first; i<first+4 && i<N; ++i) {
+      float t0x = float(node.mMinX[i]) * ray.mScale[0] + ray.mOffset[0];
+      float t1x = float(node.mMaxX[i]) * ray.mScale[0] + ray.mOffset[0];
+      float t0y = float(node.mMinY[i]) * ray.mScale[1] + ray.mOffset[1];
+      float t1y = float(node.mMaxY[i]) * ray.mScale[1] + ray.mOffset[1];
+      float t0z = float(node.mMinZ[i]) * ray.mScale[2] + ray.mOffset[2];
+      float t1z = float(node.mMaxZ[i]) * ray.mScale[2] + ray.mOffset[2];
+      float tNear = ffmax(ffmax(ffmin(t0x, t1x), ffmin(t0y, t1y)), ffmax(ffmin(t0z, t1z), tmin));
+      float tFar = ffmin(ffmin(ffmax(t0x, t1x), ffmax(t0y, t1y)), ffmin(ffmax(t0z, t1z), tmax));
+      tEntry[i] = tNear;
+      if(tNear < tFar)
+         mask |= 1 << i;
+   }
+   return mask;
+}
+
+#ifdef USE_SSE
+// widens 4 quantized steps to floats
+inline __m128 loadSteps(const uint8_t *steps) {
+   int32_t bytes;
+   memcpy(&bytes, steps, sizeof(bytes));
+   __m128i zero = _mm_setzero_si128();
+   return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+}
+
+template<int N>
+inline int intersectChildrenSSE(const QuantizedWideBVHNode<N> &node, int first, const QuantizedRay &ray,
+                                float tmin, float tmax, float *tEntry) {
+   __m128 sx = _mm_set1_ps(ray.mScale[0]);
+   __m128 sy = _mm_set1_ps(ray.mScale[1]);
+   __m128 sz = _mm_set1_ps(ray.mScale[2]);
+   __m128 ox = _mm_set1_ps(ray.mOffset[0]);
+   __m128 oy = _mm_set1_ps(ray.mOffset[1]);
+   __m128 oz = _mm_set1_ps(ray.mOffset[2]);
+   __m128 t0x = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMinX+first), sx), ox);
+   __m128 t1x = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMaxX+first), sx), ox);
+   __m128 t0y = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMinY+first), sy), oy);
+   __m128 t1y = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMaxY+first), sy), oy);
+   __m128 t0z = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMinZ+first), sz), oz);
+   __m128 t1z = _mm_add_ps(_mm_mul_ps(loadSteps(node.mMaxZ+first), sz), oz);
+   __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                             _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin)));
+   __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                            _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+   _mm_storeu_ps(tEntry+first, tNear);
+   return _mm_movemask_ps(_mm_cmplt_ps(tNear, tFar)) << first;
+}
+#endif
+
+#ifdef USE_AVX2
+TARGET_AVX2 inline __m256 loadSteps8(const uint8_t *steps) {
+   return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)steps)));
+}
+
+TARGET_AVX2 int intersectChildrenAVX2(const QuantizedWideBVHNode<8> &node, const QuantizedRay &ray,
+                                      float tmin, float tmax, float *tEntry) {
+   __m256 sx = _mm256_set1_ps(ray.mScale[0]);
+   __m256 sy = _mm256_set1_ps(ray.mScale[1]);
+   __m256 sz = _mm256_set1_ps(ray.mScale[2]);
+   __m256 ox = _mm256_set1_ps(ray.mOffset[0]);
+   __m256 oy = _mm256_set1_ps(ray.mOffset[1]);
+   __m256 oz = _mm256_set1_ps(ray.mOffset[2]);
+   __m256 t0x = _mm256_fmadd_ps(loadSteps8(node.mMinX), sx, ox);
+   __m256 t1x = _mm256_fmadd_ps(loadSteps8(node.mMaxX), sx, ox);
+   __m256 t0y = _mm256_fmadd_ps(loadSteps8(node.mMinY), sy, oy);
+   __m256 t1y = _mm256_fmadd_ps(loadSteps8(node.mMaxY), sy, oy);
+   __m256 t0z = _mm256_fmadd_ps(loadSteps8(node.mMinZ), sz, oz);
+   __m256 t1z = _mm256_fmadd_ps(loadSteps8(node.mMaxZ), sz, oz);
+   __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+                                _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(tmin)));
+   __m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+                               _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tmax)));
+   _mm256_storeu_ps(tEntry, tNear);
+   return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LT_OQ));
+}
+#endif
+
+template<int N>
+inline int intersectChildrenHalves(const WideBVHNode<N> &node, const float *origin, const float *invDirection,
+                                   float tmin, float tmax, float *tEntry) {
+   int mask = 0;
+   for(int first=0; first<N; first+=4) {
+#ifdef USE_SSE
+      mask |= intersectChildrenSSE(node, first, origin, invDirection, tmin, tmax, tEntry);
+#else
+      mask |= intersectChildrenScalar(node, first, origin, invDirection, tmin, tmax, tEntry);
+#endif
+   }
+   return mask;
+}
+
+inline int intersectChildren(const WideBVHNode<4> &node, const float *origin, const float *invDirection,
+                             float tmin, float tmax, float *tEntry) {
+   return intersectChildrenHalves(node, origin, invDirection, tmin, tmax, tEntry);
+}
+
+inline int intersectChildren(const WideBVHNode<8> &node, const float *origin, const float *invDirection,
+                             float tmin, float tmax, float *tEntry) {
+#ifdef USE_AVX2
+   if(gUseAVX2)
+      return intersectChildrenAVX2(node, origin, invDirection, tmin, tmax, tEntry);
+#endif
+   return intersectChildrenHalves(node, origin, invDirection, tmin, tmax, tEntry);
+}
+
+template<int N>
+inline int intersectChildrenHalves(const QuantizedWideBVHNode<N> &node, const QuantizedRay &ray,
+                                   float tmin, float tmax, float *tEntry) {
+   int mask = 0;
+   for(int first=0; first<N; first+=4) {
+#ifdef USE_SSE
+      mask |= intersectChildrenSSE(node, first, ray, tmin, tmax, tEntry);
+#else
+      mask |= intersectChildrenScalar(node, first, ray, tmin, tmax, tEntry);
+#endif
+   }
+   return mask;
+}
+
+inline int intersectChildren(const QuantizedWideBVHNode<4> &node, const float *origin, const float *invDirection,
+                             float tmin, float tmax, float *tEntry) {
+   return intersectChildrenHalves(node, QuantizedRay(node, origin, invDirection), tmin, tmax, tEntry);
+}
+
+inline int intersectChildren(const QuantizedWideBVHNode<8> &node, const float *origin, const float *invDirection,
+                             float tmin, float tmax, float *tEntry) {
+   QuantizedRay ray(node, origin, invDirection);
+#ifdef USE_AVX2
+   if(gUseAVX2)
+      return intersectChildrenAVX2(node, ray, tmin, tmax, tEntry);
+#endif
+   return intersectChildrenHalves(node, ray, tmin, tmax, tEntry);
+}
+
+template<int N, bool Quantized = false>
+class WideBVH : public Hitable {
+public:
+   typedef typename std::conditional<Quantized, QuantizedWideBVHNode<N>, WideBVHNode<N>>::type Node;
+
+   WideBVH(const LinearBVH &bvh)
+      : mList(bvh.mList)
+      , mIndices(bvh.mIndices.begin(), bvh.mIndices.end())
+      , mHasDuplicates(bvh.mHasDuplicates)
+   {
+      if(!bvh.mNodes.empty())
+         collapse(bvh.mNodes, 0);
+   }
+
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      if(mNodes.empty())
+         return false;
+      float origin[3], invDirection[3];
+      for(int a=0; a<3; ++a) {
+         origin[a] = ray.mOrigin[a];
+         invDirection[a] = ray.mInvDirection[a];
+      }
+      struct StackEntry {
+         uint32_t mIndex;
+         uint32_t mNumberPrimitives;
+         float mEntry;
+      } stack[cBVHStackSize*N];
+      stack[0].mIndex = 0;
+      stack[0].mNumberPrimitives = 0;
+      stack[0].mEntry = timeMin;
+      int stackSize = 1;
+      bool hitAnything = false;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      alignas(32) float tEntry[N];
+      Mailbox mailbox;
+      while(stackSize > 0) {
+         StackEntry entry = stack[--stackSize];
+         if(entry.mEntry >= timeMax)
+            continue;
+         if(entry.mNumberPrimitives > 0) {
+            for(uint32_t i=entry.mIndex; i<entry.mIndex+entry.mNumberPrimitives; ++i) {
+               if(mHasDuplicates && mailbox.contains(mIndices[i]))
+                  continue;
+               primitivesTested += 1;
+               if(mList[mIndices[i]]->hit(ray, timeMin, timeMax, record)) {
+                  hitAnything = true;
+                  timeMax = record.time;
+               }
+            }
+            continue;
+         }
+         const Node &node = mNodes[entry.mIndex];
+         nodesVisited += 1;
+         int mask = intersectChildren(node, origin, invDirection, timeMin, timeMax, tEntry);
+         mask &= (1 << node.mNumberChildren) - 1;
+         // push far to near, so the nearest child is popped first
+         int first = stackSize;
+         while(mask != 0) {
+            int i = countTrailingZeros(mask);
+            mask &= mask - 1;
+            int position = stackSize++;
+            while(position > first && stack[position-1].mEntry < tEntry[i]) {
+               stack[position] = stack[position-1];
+               --position;
+            }
+            stack[position].mIndex = node.mChild[i];
+            stack[position].mNumberPrimitives = node.mNumberPrimitives[i];
+            stack[position].mEntry = tEntry[i];
+         }
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return hitAnything;
+   }
+
+   // like hit, without sorting the children by distance
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      if(mNodes.empty())
+         return false;
+      float origin[3], invDirection[3];
+      for(int a=0; a<3; ++a) {
+         origin[a] = ray.mOrigin[a];
+         invDirection[a] = ray.mInvDirection[a];
+      }
+      struct StackEntry {
+         uint32_t mIndex;
+         uint32_t mNumberPrimitives;
+      } stack[cBVHStackSize*N];
+      stack[0].mIndex = 0;
+      stack[0].mNumberPrimitives = 0;
+      int stackSize = 1;
+      bool occluded = false;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      alignas(32) float tEntry[N];
+      while(stackSize > 0 && !occluded) {
+         StackEntry entry = stack[--stackSize];
+         if(entry.mNumberPrimitives > 0) {
+            for(uint32_t i=entry.mIndex; i<entry.mIndex+entry.mNumberPrimitives && !occluded; ++i) {
+               primitivesTested += 1;
+               occluded = mList[mIndices[i]]->occluded(ray, timeMin, timeMax);
+            }
+            continue;
+         }
+         const Node &node = mNodes[entry.mIndex];
+         nodesVisited += 1;
+         int mask = intersectChildren(node, origin, invDirection, timeMin, timeMax, tEntry);
+         mask &= (1 << node.mNumberChildren) - 1;
+         while(mask != 0) {
+            int i = countTrailingZeros(mask);
+            mask &= mask - 1;
+            stack[stackSize].mIndex = node.mChild[i];
+            stack[stackSize].mNumberPrimitives = node.mNumberPrimitives[i];
+            ++stackSize;
+         }
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return occluded;
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      if(mNodes.empty())
+         return false;
+      aabb.reset();
+      const Node &root = mNodes[0];
+      for(int i=0; i<root.mNumberChildren; ++i) {
+         aabb.extend(root.childBounds(i));
+      }
+      return true;
+   }
+
+   // same cost model as LinearBVH::sahCost, with one traversal step per wide node
+   float sahCost(const SAHSettings &settings) const {
+      if(mNodes.empty())
+         return 0.0f;
+      AABB rootBounds;
+      rootBounds.reset();
+      for(int i=0; i<mNodes[0].mNumberChildren; ++i) {
+         rootBounds.extend(mNodes[0].childBounds(i));
+      }
+      if(rootBounds.surfaceArea() <= 0.0f)
+         return 0.0f;
+      float cost = settings.mTraversalCost * rootBounds.surfaceArea();
+      for(size_t n=0; n<mNodes.size(); ++n) {
+         const Node &node = mNodes[n];
+         for(int i=0; i<node.mNumberChildren; ++i) {
+            float area = node.childBounds(i).surfaceArea();
+            if(node.mNumberPrimitives[i] > 0)
+               cost += settings.mIntersectionCost * node.mNumberPrimitives[i] * area;
+            else
+               cost += settings.mTraversalCost * area;
+         }
+      }
+      return cost / rootBounds.surfaceArea();
+   }
+
+   void report(const SAHSettings &settings, BVHReport &report) const {
+      report.mType = Quantized ? (N == 4 ? "bvh4 quantized" : "bvh8 quantized") : (N == 4 ? "bvh4" : "bvh8");
+      report.mMemory = mNodes.size()*sizeof(Node) + mIndices.size()*sizeof(uint32_t);
+      if(mNodes.empty())
+         return;
+      AABB rootBounds = reportNode(0, 0, report);
+      report.finish(rootBounds, settings);
+   }
+
+   // updates the child bounds bottom up from the current primitive bounds, like LinearBVH::refit
+   void refit(float time0, float time1, JobSystem *jobSystem) {
+      if(!mNodes.empty())
+         refitNode(0, 0, time0, time1, jobSystem);
+   }
+
+   Hitable **mList;
+   std::vector<Node, AlignedAllocator<Node, 64>> mNodes;
+   std::vector<uint32_t> mIndices;
+   bool mHasDuplicates;
+
+private:
+   // the overlap of a wide node sums up all pairs of its children
+   AABB reportNode(uint32_t index, int depth, BVHReport &report) const {
+      const Node &node = mNodes[index];
+      AABB bounds;
+      bounds.reset();
+      float overlapArea = 0.0f;
+      for(int i=0; i<node.mNumberChildren; ++i) {
+         AABB box = node.childBounds(i);
+         bounds.extend(box);
+         for(int j=i+1; j<node.mNumberChildren; ++j) {
+            overlapArea += overlapBox(box, node.childBounds(j)).surfaceArea();
+         }
+         if(node.mNumberPrimitives[i] > 0)
+            report.addLeaf(depth+1, box, node.mNumberPrimitives[i]);
+         else
+            reportNode(node.mChild[i], depth+1, report);
+      }
+      report.addInnerNode(depth, bounds, overlapArea);
+      return bounds;
+   }
+
+   AABB refitChild(uint32_t index, int i, int depth, float time0, float time1, JobSystem *jobSystem) {
+      const Node &node = mNodes[index];
+      AABB bounds;
+      bounds.reset();
+      if(node.mNumberPrimitives[i] > 0) {
+         for(uint32_t p=node.mChild[i]; p<node.mChild[i]+node.mNumberPrimitives[i]; ++p) {
+            AABB box;
+            mList[mIndices[p]]->boundingBox(time0, time1, box);
+            bounds.extend(box);
+         }
+      } else {
+         bounds = refitNode(node.mChild[i], depth+1, time0, time1, jobSystem);
+      }
+      return bounds;
+   }
+
+   AABB refitNode(uint32_t index, int depth, float time0, float time1, JobSystem *jobSystem) {
+      int numberChildren = mNodes[index].mNumberChildren;
+      AABB bounds[N];
+      for(int i=0; i<N; ++i) {
+         bounds[i].reset();
+      }
+      if(jobSystem != nullptr && depth < cRefitJobDepth/2) {
+         parallelFor(jobSystem, 0, numberChildren, 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+            bounds[chunk] = refitChild(index, chunk, depth, time0, time1, jobSystem);
+         });
+      } else {
+         for(int i=0; i<numberChildren; ++i) {
+            bounds[i] = refitChild(index, i, depth, time0, time1, jobSystem);
+         }
+      }
+      mNodes[index].setBounds(bounds, numberChildren);
+      for(int i=1; i<numberChildren; ++i) {
+         bounds[0].extend(bounds[i]);
+      }
+      return bounds[0];
+   }
+
+   // pulls up to N binary nodes into one wide node by opening the inner child with the largest area
+   uint32_t collapse(const MappableArray<LinearBVHNode, LinearBVHNodeArray> &binary, uint32_t binaryIndex) {
+      uint32_t children[N];
+      int numberChildren = 0;
+      if(binary[binaryIndex].isLeaf()) {
+         children[numberChildren++] = binaryIndex;
+      } else {
+         children[numberChildren++] = binaryIndex + 1;
+         children[numberChildren++] = binary[binaryIndex].mOffset;
+         while(numberChildren < N) {
+            int best = -1;
+            float bestArea = -1.0f;
+            for(int i=0; i<numberChildren; ++i) {
+               float area = binary[children[i]].bounds().surfaceArea();
+               if(!binary[children[i]].isLeaf() && area > bestArea) {
+                  best = i;
+                  bestArea = area;
+               }
+            }
+            if(best == -1)
+               break;
+            uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children[numberChildren++] = binary[opened].mOffset;
+         }
+      }
+
+      uint32_t nodeIndex = mNodes.size();
+      mNodes.push_back(Node());
+      mNodes[nodeIndex].mNumberChildren = numberChildren;
+      AABB bounds[N];
+      for(int i=0; i<numberChildren; ++i) {
+         const LinearBVHNode &child = binary[children[i]];
+         uint32_t childIndex = child.isLeaf() ? child.mOffset : collapse(binary, children[i]);
+         Node &node = mNodes[nodeIndex];
+         bounds[i] = child.bounds();
+         node.mChild[i] = childIndex;
+         node.mNumberPrimitives[i] = child.mNumberPrimitives;
+      }
+      mNodes[nodeIndex].setBounds(bounds, numberChildren);
+      return nodeIndex;
+   }
+};
+
+// ================================================================================
+
+// uniform grid, see "A Fast Voxel Traversal Algorithm for Ray Tracing" (Amanatides, Woo 1987).
+// the cells hold the indices of the primitives whose bounds overlap them, rays walk the cells
+// they pass front to back and stop after the first cell containing the closest hit. a few huge
+// primitives like a ground sphere would stretch the grid until the rest of the scene falls into
+// a handful of cells, so primitives with a large share of the summed surface areas are kept
+// out of the grid and tested by every ray
+
+const float cGridDensity = 4.0f;          //cells per primitive
+const int cGridMaxResolution = 256;       //cells along an axis
+const float cGridLargePrimitive = 0.1f;   //share of the summed primitive areas above which a primitive stays out of the grid
+
+class UniformGrid : public Hitable {
+public:
+   UniformGrid(Hitable **list, const std::vector<PrimitiveRef> &refs)
+      : mList(list)
+   {
+      double totalArea = 0.0;
+      for(size_t i=0; i<refs.size(); ++i) {
+         totalArea += refs[i].mBox.surfaceArea();
+      }
+      mBounds.reset();
+      mWorldBounds.reset();
+      std::vector<const PrimitiveRef*> gridRefs;
+      gridRefs.reserve(refs.size());
+      for(size_t i=0; i<refs.size(); ++i) {
+         mWorldBounds.extend(refs[i].mBox);
+         if(refs[i].mBox.surfaceArea() > cGridLargePrimitive * totalArea) {
+            mLarge.push_back(refs[i].mIndex);
+         } else {
+            mBounds.extend(refs[i].mBox);
+            gridRefs.push_back(&refs[i]);
+         }
+      }
+      if(gridRefs.empty()) {
+         mBounds = AABB(vector3f(0.0f, 0.0f, 0.0f), vector3f(0.0f, 0.0f, 0.0f));
+         for(int axis=0; axis<3; ++axis) {
+            mResolution[axis] = 0;
+         }
+         return;
+      }
+
+      // cube shaped cells, cGridDensity of them per primitive
+      vector3f extent = mBounds.mMax - mBounds.mMin;
+      float volume = std::max(extent[0], 1e-6f) * std::max(extent[1], 1e-6f) * std::max(extent[2], 1e-6f);
+      float cellsPerUnit = cbrtf(cGridDensity * gridRefs.size() / volume);
+      for(int axis=0; axis<3; ++axis) {
+         mResolution[axis] = std::max(1, std::min(cGridMaxResolution, int(extent[axis] * cellsPerUnit)));
+         mCellSize[axis] = extent[axis] / mResolution[axis];
+         mInvCellSize[axis] = mCellSize[axis] > 0.0f ? 1.0f / mCellSize[axis] : 0.0f;
+      }
+
+      // counts the references of every cell, turns the counts into offsets and fills them in
+      mCellStart.assign(size_t(mResolution[0]) * mResolution[1] * mResolution[2] + 1, 0);
+      for(int pass=0; pass<2; ++pass) {
+         for(size_t i=0; i<gridRefs.size(); ++i) {
+            int cellMin[3], cellMax[3];
+            for(int axis=0; axis<3; ++axis) {
+               cellMin[axis] = cell(gridRefs[i]->mBox.mMin[axis], axis);
+               cellMax[axis] = cell(gridRefs[i]->mBox.mMax[axis], axis);
+            }
+            for(int z=cellMin[2]; z<=cellMax[2]; ++z) {
+               for(int y=cellMin[1]; y<=cellMax[1]; ++y) {
+                  for(int x=cellMin[0]; x<=cellMax[0]; ++x) {
+                     uint32_t index = cellIndex(x, y, z);
+                     if(pass == 0)
+                        mCellStart[index+1] += 1;
+                     else
+                        mIndices[mCellStart[index]++] = gridRefs[i]->mIndex;
+                  }
+               }
+            }
+         }
+         if(pass == 0) {
+            for(size_t c=1; c<mCellStart.size(); ++c) {
+               mCellStart[c] += mCellStart[c-1];
+            }
+            mIndices.resize(mCellStart.back());
+         } else {
+            // filling moved every start to the start of the next cell
+            for(size_t c=mCellStart.size()-1; c>0; --c) {
+               mCellStart[c] = mCellStart[c-1];
+            }
+            mCellStart[0] = 0;
+         }
+      }
+   }
+
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      bool hitAnything = false;
+      uint32_t primitivesTested = mLarge.size();
+      for(size_t i=0; i<mLarge.size(); ++i) {
+         if(mList[mLarge[i]]->hit(ray, timeMin, timeMax, record)) {
+            hitAnything = true;
+            timeMax = record.time;
+         }
+      }
+      Walk walk;
+      uint32_t cellsVisited = 0;
+      if(startWalk(ray, timeMin, timeMax, walk)) {
+         Mailbox mailbox;
+         while(true) {
+            cellsVisited += 1;
+            uint32_t index = cellIndex(walk.mCell[0], walk.mCell[1], walk.mCell[2]);
+            for(uint32_t i=mCellStart[index]; i<mCellStart[index+1]; ++i) {
+               if(mailbox.contains(mIndices[i]))
+                  continue;
+               primitivesTested += 1;
+               if(mList[mIndices[i]]->hit(ray, timeMin, timeMax, record)) {
+                  hitAnything = true;
+                  timeMax = record.time;
+               }
+            }
+            // a hit inside this cell is closer than anything in the following ones
+            if(!walk.step(ffmin(timeMax, walk.mExit)))
+               break;
+         }
+      }
+      tCurrentRay.mNodesVisited += cellsVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return hitAnything;
+   }
+
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      bool occluded = false;
+      uint32_t primitivesTested = 0;
+      for(size_t i=0; i<mLarge.size() && !occluded; ++i) {
+         primitivesTested += 1;
+         occluded = mList[mLarge[i]]->occluded(ray, timeMin, timeMax);
+      }
+      Walk walk;
+      uint32_t cellsVisited = 0;
+      if(!occluded && startWalk(ray, timeMin, timeMax, walk)) {
+         Mailbox mailbox;
+         while(!occluded) {
+            cellsVisited += 1;
+            uint32_t index = cellIndex(walk.mCell[0], walk.mCell[1], walk.mCell[2]);
+            for(uint32_t i=mCellStart[index]; i<mCellStart[index+1] && !occluded; ++i) {
+               if(mailbox.contains(mIndices[i]))
+                  continue;
+               primitivesTested += 1;
+               occluded = mList[mIndices[i]]->occluded(ray, timeMin, timeMax);
+            }
+            if(!walk.step(walk.mExit))
+               break;
+         }
+      }
+      tCurrentRay.mNodesVisited += cellsVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return occluded;
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      if(mLarge.empty() && mCellStart.empty())
+         return false;
+      aabb = mWorldBounds;
+      return true;
+   }
+
+   // every cell is a leaf, the primitives outside the grid a leaf spanning the whole scene
+   void report(const SAHSettings &settings, BVHReport &report) const {
+      report.mType = "grid";
+      report.mMemory = (mCellStart.size() + mIndices.size() + mLarge.size()) * sizeof(uint32_t);
+      if(!mLarge.empty())
+         report.addLeaf(0, mWorldBounds, mLarge.size());
+      for(int z=0; z<mResolution[2]; ++z) {
+         for(int y=0; y<mResolution[1]; ++y) {
+            for(int x=0; x<mResolution[0]; ++x) {
+               uint32_t index = cellIndex(x, y, z);
+               vector3f cellMin = mBounds.mMin + vector3f(x*mCellSize[0], y*mCellSize[1], z*mCellSize[2]);
+               AABB box(cellMin, cellMin + vector3f(mCellSize[0], mCellSize[1], mCellSize[2]));
+               report.addLeaf(1, box, mCellStart[index+1] - mCellStart[index]);
+            }
+         }
+      }
+      report.finish(mWorldBounds, settings);
+   }
+
+   float sahCost(const SAHSettings &settings) const {
+      BVHReport gridReport;
+      report(settings, gridReport);
+      return gridReport.mSAHCost;
+   }
+
+   int mResolution[3];
+   std::vector<uint32_t> mCellStart;      //first index of every cell, one more entry for the end of the last cell
+   std::vector<uint32_t> mIndices;
+   std::vector<uint32_t> mLarge;          //primitives kept out of the grid
+
+private:
+   // position of a ray in the grid: the current cell, the distances at which the ray crosses
+   // into the next cell along each axis and how far apart these crossings are
+   struct Walk {
+      int mCell[3];
+      int mStep[3];
+      int mEnd[3];
+      float mNext[3];
+      float mDelta[3];
+      float mExit;
+      // moves on to the next cell, false once the ray left the grid or got beyond timeMax
+      bool step(float timeMax) {
+         int axis = mNext[0] < mNext[1] ? (mNext[0] < mNext[2] ? 0 : 2) : (mNext[1] < mNext[2] ? 1 : 2);
+         if(mNext[axis] >= timeMax)
+            return false;
+         mCell[axis] += mStep[axis];
+         if(mCell[axis] == mEnd[axis])
+            return false;
+         mNext[axis] += mDelta[axis];
+         return true;
+      }
+   };
+
+   int cell(float position, int axis) const {
+      int index = int((position - mBounds.mMin[axis]) * mInvCellSize[axis]);
+      return std::max(0, std::min(mResolution[axis]-1, index));
+   }
+   uint32_t cellIndex(int x, int y, int z) const {
+      return (uint32_t(z) * mResolution[1] + y) * mResolution[0] + x;
+   }
+
+   bool startWalk(Ray &ray, float timeMin, float timeMax, Walk &walk) const {
+      if(mCellStart.empty())
+         return false;
+      float tEnter = timeMin, tExit = timeMax;
+      for(int axis=0; axis<3; ++axis) {
+         float t0 = (mBounds.mMin[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         float t1 = (mBounds.mMax[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         tEnter = ffmax(ffmin(t0, t1), tEnter);
+         tExit = ffmin(ffmax(t0, t1), tExit);
+      }
+      if(tEnter > tExit)
+         return false;
+      walk.mExit = tExit;
+      for(int axis=0; axis<3; ++axis) {
+         walk.mCell[axis] = cell(ray.mOrigin[axis] + tEnter*ray.mDirection[axis], axis);
+         walk.mDelta[axis] = mCellSize[axis] * fabs(ray.mInvDirection[axis]);
+         if(ray.mSign[axis] == 0) {
+            walk.mStep[axis] = 1;
+            walk.mEnd[axis] = mResolution[axis];
+            walk.mNext[axis] = (mBounds.mMin[axis] + (walk.mCell[axis]+1)*mCellSize[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         } else {
+            walk.mStep[axis] = -1;
+            walk.mEnd[axis] = -1;
+            walk.mNext[axis] = (mBounds.mMin[axis] + walk.mCell[axis]*mCellSize[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         }
+      }
+      return true;
+   }
+
+   Hitable **mList;
+   AABB mBounds;                          //of the grid
+   AABB mWorldBounds;                     //of the grid and the primitives outside
+   float mCellSize[3];
+   float mInvCellSize[3];
+};
+
+// ================================================================================
+
+// kd-tree with SAH splits, see "On building fast kd-Trees for Ray Tracing, and on doing that in
+// O(N log N)" (Wald, Havran 2006), built the simpler O(N log^2 N) way of sorting the bounds
+// edges of every node. primitives straddling a split plane are referenced on both sides, the
+// traversals use a mailbox to test them once
+
+const float cKdTreeEmptyBonus = 0.5f;     //cost reduction for splits that cut off empty space
+const int cKdTreeMaxBadRefines = 3;       //splits costing more than a leaf that are tolerated on the way down
+
+// inner nodes store the split position and the index of the child above it, the child below
+// follows its parent. leaves store the offset and number of their primitive indices
+struct KdTreeNode {
+   union {
+      float mSplit;
+      uint32_t mOffset;
+   };
+   uint32_t mFlags;              //low 2 bits: split axis or 3 for leaves, above them the above child or the number of primitives
+
+   bool isLeaf() const { return (mFlags & 3) == 3; }
+   int axis() const { return mFlags & 3; }
+   uint32_t aboveChild() const { return mFlags >> 2; }
+   uint32_t numberPrimitives() const { return mFlags >> 2; }
+};
+
+class KdTreeBuilder {
+public:
+   KdTreeBuilder(const SAHSettings &settings)
+      : mSettings(settings)
+      , mRefs(nullptr)
+   {}
+
+   void build(const std::vector<PrimitiveRef> &refs, const AABB &bounds, std::vector<KdTreeNode> &nodes, std::vector<uint32_t> &indices) {
+      mRefs = refs.data();
+      mNodes = &nodes;
+      mIndices = &indices;
+      nodes.clear();
+      indices.clear();
+      std::vector<uint32_t> primitives(refs.size());
+      for(size_t i=0; i<refs.size(); ++i) {
+         primitives[i] = i;
+      }
+      int maxDepth = int(8.0f + 1.3f * log2f(std::max(size_t(1), refs.size())) + 0.5f);
+      buildNode(primitives, bounds, std::min(maxDepth, cBVHStackSize-1), 0);
+   }
+
+private:
+   struct Edge {
+      float mPosition;
+      uint32_t mPrimitive;
+      bool mEnd;
+      // starts before ends at the same position, so touching boxes aren't counted on both sides
+      bool operator<(const Edge &other) const {
+         return mPosition < other.mPosition || (mPosition == other.mPosition && !mEnd && other.mEnd);
+      }
+   };
+
+   void buildNode(std::vector<uint32_t> &primitives, const AABB &bounds, int depth, int badRefines) {
+      uint32_t nodeIndex = mNodes->size();
+      mNodes->push_back(KdTreeNode());
+      uint32_t count = primitives.size();
+      float leafCost = mSettings.mIntersectionCost * count;
+
+      int bestAxis = -1;
+      float bestSplit = 0.0f;
+      float bestCost = FLT_MAX;
+      float area = bounds.surfaceArea();
+      if(count > 1 && depth > 0 && area > 0.0f) {
+         vector3f extent = bounds.mMax - bounds.mMin;
+         std::vector<Edge> edges(2*count);
+         for(int axis=0; axis<3; ++axis) {
+            for(uint32_t i=0; i<count; ++i) {
+               const AABB &box = mRefs[primitives[i]].mBox;
+               edges[2*i].mPosition = box.mMin[axis];
+               edges[2*i].mPrimitive = primitives[i];
+               edges[2*i].mEnd = false;
+               edges[2*i+1].mPosition = box.mMax[axis];
+               edges[2*i+1].mPrimitive = primitives[i];
+               edges[2*i+1].mEnd = true;
+            }
+            std::sort(edges.begin(), edges.end());
+
+            // sweeps the plane through the edges, primitives ending at it are only above before it
+            // moves on and primitives starting at it only count below after it
+            int other0 = (axis + 1) % 3, other1 = (axis + 2) % 3;
+            uint32_t below = 0, above = count;
+            for(uint32_t e=0; e<2*count; ++e) {
+               if(edges[e].mEnd)
+                  above -= 1;
+               float split = edges[e].mPosition;
+               if(split > bounds.mMin[axis] && split < bounds.mMax[axis]) {
+                  float areaBelow = 2.0f * (extent[other0]*extent[other1] + (split - bounds.mMin[axis])*(extent[other0] + extent[other1]));
+                  float areaAbove = 2.0f * (extent[other0]*extent[other1] + (bounds.mMax[axis] - split)*(extent[other0] + extent[other1]));
+                  float bonus = below == 0 || above == 0 ? cKdTreeEmptyBonus : 0.0f;
+                  float cost = mSettings.mTraversalCost + mSettings.mIntersectionCost * (1.0f - bonus) *
+                     (areaBelow * below + areaAbove * above) / area;
+                  if(cost < bestCost) {
+                     bestCost = cost;
+                     bestAxis = axis;
+                     bestSplit = split;
+                  }
+               }
+               if(!edges[e].mEnd)
+                  below += 1;
+            }
+         }
+      }
+      if(bestCost > leafCost)
+         badRefines += 1;
+      if(bestAxis == -1 || badRefines > cKdTreeMaxBadRefines || (bestCost > 4.0f * leafCost && count < 16)) {
+         KdTreeNode &leaf = (*mNodes)[nodeIndex];
+         leaf.mOffset = mIndices->size();
+         leaf.mFlags = (count << 2) | 3;
+         mIndices->insert(mIndices->end(), primitives.begin(), primitives.end());
+         return;
+      }
+
+      // flat boxes lying in the split plane go below
+      std::vector<uint32_t> belowPrimitives, abovePrimitives;
+      for(uint32_t i=0; i<count; ++i) {
+         const AABB &box = mRefs[primitives[i]].mBox;
+         if(box.mMin[bestAxis] < bestSplit || box.mMax[bestAxis] <= bestSplit)
+            belowPrimitives.push_back(primitives[i]);
+         if(box.mMax[bestAxis] > bestSplit)
+            abovePrimitives.push_back(primitives[i]);
+      }
+      std::vector<uint32_t>().swap(primitives);
+
+      AABB boundsBelow = bounds, boundsAbove = bounds;
+      boundsBelow.mMax[bestAxis] = bestSplit;
+      boundsAbove.mMin[bestAxis] = bestSplit;
+      (*mNodes)[nodeIndex].mSplit = bestSplit;
+      buildNode(belowPrimitives, boundsBelow, depth-1, badRefines);
+      (*mNodes)[nodeIndex].mFlags = (uint32_t(mNodes->size()) << 2) | bestAxis;
+      buildNode(abovePrimitives, boundsAbove, depth-1, badRefines);
+   }
+
+   SAHSettings mSettings;
+   const PrimitiveRef *mRefs;
+   std::vector<KdTreeNode> *mNodes;
+   std::vector<uint32_t> *mIndices;
+};
+
+class KdTree : public Hitable {
+public:
+   KdTree(Hitable **list, const std::vector<PrimitiveRef> &refs, const SAHSettings &settings)
+      : mList(list)
+   {
+      mBounds.reset();
+      for(size_t i=0; i<refs.size(); ++i) {
+         mBounds.extend(refs[i].mBox);
+      }
+      KdTreeBuilder builder(settings);
+      builder.build(refs, mBounds, mNodes, mIndices);
+      // the builder numbers the refs, the leaves reference the scene list
+      for(size_t i=0; i<mIndices.size(); ++i) {
+         mIndices[i] = refs[mIndices[i]].mIndex;
+      }
+   }
+
+   // front to back: the child on the ray origin's side of the split is visited first, the far
+   // one is pushed with the interval of the ray inside it. once the closest hit lies before
+   // the interval of the next node on the stack, the remaining nodes are all further away
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      struct StackEntry {
+         uint32_t mNode;
+         float mMin, mMax;
+      } stack[cBVHStackSize];
+      int stackSize = 0;
+      float tMin, tMax;
+      if(!clip(ray, timeMin, timeMax, tMin, tMax))
+         return false;
+      bool hitAnything = false;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      uint32_t current = 0;
+      Mailbox mailbox;
+      while(true) {
+         if(timeMax < tMin)
+            break;
+         const KdTreeNode &node = mNodes[current];
+         nodesVisited += 1;
+         if(!node.isLeaf()) {
+            uint32_t first, second;
+            float tPlane = childOrder(ray, node, current, first, second);
+            if(tPlane > tMax || tPlane <= 0.0f) {
+               current = first;
+            } else if(tPlane < tMin) {
+               current = second;
+            } else {
+               stack[stackSize].mNode = second;
+               stack[stackSize].mMin = tPlane;
+               stack[stackSize].mMax = tMax;
+               ++stackSize;
+               current = first;
+               tMax = tPlane;
+            }
+            continue;
+         }
+         for(uint32_t i=node.mOffset; i<node.mOffset+node.numberPrimitives(); ++i) {
+            if(mailbox.contains(mIndices[i]))
+               continue;
+            primitivesTested += 1;
+            if(mList[mIndices[i]]->hit(ray, timeMin, timeMax, record)) {
+               hitAnything = true;
+               timeMax = record.time;
+            }
+         }
+         if(stackSize == 0)
+            break;
+         --stackSize;
+         current = stack[stackSize].mNode;
+         tMin = stack[stackSize].mMin;
+         tMax = stack[stackSize].mMax;
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return hitAnything;
+   }
+
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      struct StackEntry {
+         uint32_t mNode;
+         float mMin, mMax;
+      } stack[cBVHStackSize];
+      int stackSize = 0;
+      float tMin, tMax;
+      if(!clip(ray, timeMin, timeMax, tMin, tMax))
+         return false;
+      bool occluded = false;
+      uint32_t nodesVisited = 0;
+      uint32_t primitivesTested = 0;
+      uint32_t current = 0;
+      Mailbox mailbox;
+      while(true) {
+         const KdTreeNode &node = mNodes[current];
+         nodesVisited += 1;
+         if(!node.isLeaf()) {
+            uint32_t first, second;
+            float tPlane = childOrder(ray, node, current, first, second);
+            if(tPlane > tMax || tPlane <= 0.0f) {
+               current = first;
+            } else if(tPlane < tMin) {
+               current = second;
+            } else {
+               stack[stackSize].mNode = second;
+               stack[stackSize].mMin = tPlane;
+               stack[stackSize].mMax = tMax;
+               ++stackSize;
+               current = first;
+               tMax = tPlane;
+            }
+            continue;
+         }
+         for(uint32_t i=node.mOffset; i<node.mOffset+node.numberPrimitives() && !occluded; ++i) {
+            if(mailbox.contains(mIndices[i]))
+               continue;
+            primitivesTested += 1;
+            occluded = mList[mIndices[i]]->occluded(ray, timeMin, timeMax);
+         }
+         if(occluded || stackSize == 0)
+            break;
+         --stackSize;
+         current = stack[stackSize].mNode;
+         tMin = stack[stackSize].mMin;
+         tMax = stack[stackSize].mMax;
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += primitivesTested;
+      return occluded;
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      if(mNodes.empty())
+         return false;
+      aabb = mBounds;
+      return true;
+   }
+
+   void report(const SAHSettings &settings, BVHReport &report) const {
+      report.mType = "kdtree";
+      report.mMemory = mNodes.size()*sizeof(KdTreeNode) + mIndices.size()*sizeof(uint32_t);
+      if(mNodes.empty())
+         return;
+      reportNode(0, 0, mBounds, report);
+      report.finish(mBounds, settings);
+   }
+
+   float sahCost(const SAHSettings &settings) const {
+      BVHReport treeReport;
+      report(settings, treeReport);
+      return treeReport.mSAHCost;
+   }
+
+   std::vector<KdTreeNode> mNodes;
+   std::vector<uint32_t> mIndices;
+
+private:
+   bool clip(Ray &ray, float timeMin, float timeMax, float &tMin, float &tMax) const {
+      if(mNodes.empty())
+         return false;
+      tMin = timeMin;
+      tMax = timeMax;
+      for(int axis=0; axis<3; ++axis) {
+         float t0 = (mBounds.mMin[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         float t1 = (mBounds.mMax[axis] - ray.mOrigin[axis]) * ray.mInvDirection[axis];
+         tMin = ffmax(ffmin(t0, t1), tMin);
+         tMax = ffmin(ffmax(t0, t1), tMax);
+      }
+      return tMin <= tMax;
+   }
+
+   // returns the distance to the split plane, first is the child on the side of the ray origin
+   float childOrder(Ray &ray, const KdTreeNode &node, uint32_t index, uint32_t &first, uint32_t &second) const {
+      int axis = node.axis();
+      float offset = node.mSplit - ray.mOrigin[axis];
+      bool belowFirst = offset > 0.0f || (offset == 0.0f && ray.mSign[axis] == 1);
+      first = belowFirst ? index + 1 : node.aboveChild();
+      second = belowFirst ? node.aboveChild() : index + 1;
+      return offset * ray.mInvDirection[axis];
+   }
+
+   void reportNode(uint32_t index, int depth, const AABB &bounds, BVHReport &report) const {
+      const KdTreeNode &node = mNodes[index];
+      if(node.isLeaf()) {
+         report.addLeaf(depth, bounds, node.numberPrimitives());
+         return;
+      }
+      report.addInnerNode(depth, bounds, 0.0f);
+      AABB boundsBelow = bounds, boundsAbove = bounds;
+      boundsBelow.mMax[node.axis()] = node.mSplit;
+      boundsAbove.mMin[node.axis()] = node.mSplit;
+      reportNode(index+1, depth+1, boundsBelow, report);
+      reportNode(node.aboveChild(), depth+1, boundsAbove, report);
+   }
+
+   Hitable **mList;
+   AABB mBounds;
+};
+
+// ================================================================================
+
+class Texture {
+public:
+   virtual ~Texture() {}
+   virtual vector3f getTexel(float u, float v, vector3f &point) = 0;
+};
+
+class ConstantTexture : public Texture {
+public:
+   ConstantTexture() {}
+   ConstantTexture(vector3f color)
+      : mColor(color)
+   {}
+   vector3f getTexel(float u, float v, vector3f &point) {
+      return mColor;
+   }
+
+   vector3f mColor;
+};
+
+class CheckerTexture : public Texture {
+public:
+   CheckerTexture() {}
+   CheckerTexture(Texture *t0, Texture *t1)
+      : mEven(t0)
+      , mOdd(t1)
+   {}
+   ~CheckerTexture() {
+      delete mEven;
+      delete mOdd;
+   }
+   vector3f getTexel(float u, float v, vector3f &point) {
+      float sines = sin(10.0f*point[0])*sin(10.0f*point[1])*sin(10.0f*point[2]);
+      if(sines < 0.0f)
+         return mOdd->getTexel(u, v, point);
+      else
+         return mEven->getTexel(u, v, point);
+   }
+
+   Texture *mEven, *mOdd;   
+};
+
+// ================================================================================
+
+vector3f randomOnUnitSphere() {
+   vector3f point;
+   float lengthSquared;
+   do {
+      point = 2.0f * vector3f(rnd.randomf(), rnd.randomf(), rnd.randomf()) - vector3f(1.0f, 1.0f, 1.0f);
+      lengthSquared = point.length_squared();
+   } while( (lengthSquared >= 1.0f) || (lengthSquared == 0.0f) );
+   return point;
+}
+
+vector3f reflect(vector3f &vec, vector3f &normal) {
+   return vec - 2 * dot(vec, normal) * normal;
+}
+
+bool refract(vector3f &vec, vector3f &normal, float niOverT, vector3f &refracted) {
+   vector3f uv = vec.normalize();
+   float dt = dot(uv, normal);
+   float discriminant = 1.0f - niOverT*niOverT*(1.0f-dt*dt);
+   if(discriminant > 0) {
+      refracted = niOverT * (uv - normal*dt) - normal*sqrt(discriminant);
+      return true;
+   } else {
+      return false;
+   }
+}
+
+float schlick(float cosine, float niOverT) {
+   float r0 = (1.0f - niOverT) / (1.0f + niOverT);
+   r0 = r0*r0;
+   return r0 + (1.0f - r0)*pow((1.0f - cosine), 5.0f);
+}
+
+class Material {
 public:
+   virtual ~Material() {}
    virtual bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) = 0;
    virtual vector3f emitted(float u, float v, vector3f &point) {
       return vector3f(0.0f, 0.0f, 0.0f);
    }
 };
 
-class Lambertian : public Material {
-public:
-   Lambertian(Texture *albedo)
-      : mAlbedo(albedo)
-   {}
-   ~Lambertian() {
-      delete mAlbedo;
+class Lambertian : public Material {
+public:
+   Lambertian(Texture *albedo)
+      : mAlbedo(albedo)
+   {}
+   ~Lambertian() {
+      delete mAlbedo;
+   }
+   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
+      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
+      vector3f target = record.point + normal + randomOnUnitSphere();
+      scattered = Ray(record.point + cEpsilon*normal, target-record.point, rayIn.mTime);
+      attenuation = mAlbedo->getTexel(0.0f, 0.0f, record.point);
+      return true;
+   }
+   Texture *mAlbedo;
+};
+
+class Metal : public Material {
+public:
+   Metal(vector3f color, float fuzziness)
+      : mAlbedo(color)
+   {
+      if(fuzziness < 1)             //don't make it too big to be inside the object
+         mFuzziness = fuzziness;
+      else
+         mFuzziness = 1;
+   }
+   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
+      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
+      vector3f reflected = reflect(rayIn.mDirection, normal);
+      scattered = Ray(record.point + cEpsilon*normal, reflected + mFuzziness*randomOnUnitSphere(), rayIn.mTime);
+      attenuation = mAlbedo;
+      return (dot(scattered.mDirection, normal) > 0);
+   }
+   vector3f mAlbedo;
+   float mFuzziness;
+};
+
+class Dielectric : public Material {
+public:
+   Dielectric(float refIndex)
+      : mRefIndex(refIndex)
+   {}
+   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
+      vector3f outwardNormal;
+      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
+      vector3f reflected = reflect(rayIn.mDirection, normal);
+      float niOverT;
+      attenuation = vector3f(1.0f, 1.0f, 1.0f);
+      vector3f refracted;
+      float reflectProb;
+      float cosine;
+      if(dot(rayIn.mDirection, record.normal) > 0) {
+         outwardNormal = -record.normal;
+         niOverT = mRefIndex;
+         cosine = mRefIndex * dot(rayIn.mDirection, record.normal);
+      } else {
+         outwardNormal = record.normal;
+         niOverT = 1.0f / mRefIndex;
+         cosine = -dot(rayIn.mDirection, record.normal);
+      }
+
+      if(refract(rayIn.mDirection, outwardNormal, niOverT, refracted)) {
+         reflectProb = schlick(cosine, niOverT);
+      } else {
+         reflectProb = 1.0f;
+      }
+
+      if(rnd.randomf() < reflectProb) {
+         scattered = Ray(record.point + cEpsilon*normal, reflected, rayIn.mTime);
+      } else {
+         scattered = Ray(record.point - cEpsilon*normal, refracted, rayIn.mTime);
+      }
+      return true;
+   }
+
+   float mRefIndex;
+};
+
+class DiffuseLight : public Material {
+public:
+   DiffuseLight(Texture *tex)
+      : mEmit(tex)
+   {}
+   ~DiffuseLight() {
+      delete mEmit;
+   }
+
+   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
+      return false;
+   }
+   vector3f emitted(float u, float v, vector3f &point) {
+      return mEmit->getTexel(u, v, point);
+   }
+
+   Texture *mEmit;
+};
+
+// ================================================================================
+
+class Sphere : public Hitable {
+public:
+   Sphere(vector3f center, float radius, Material *material)
+      : mCenter(center)
+      , mRadius(radius)
+      , mMaterial(material)
+   {}
+   ~Sphere() {
+      delete mMaterial;
+   }
+   void getSphereUV(vector3f p, float &u, float &v) {
+      float phi = atan2(p[2], p[0]);
+      float theta = asin(p[1]);
+      u = 1.0f - (phi+M_PI) / (2*M_PI);
+      v = (theta+M_PI/2.0f) / M_PI;
+   }
+   // ray directions are normalized, so the quadratic term a=dot(d,d) is 1
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      vector3f oc = ray.mOrigin - mCenter;
+      float b = dot(oc, ray.mDirection);
+      float c = dot(oc, oc) - mRadius*mRadius;
+      float discriminant = b*b - c;
+      if(discriminant > 0) {
+         float root = sqrt(discriminant);
+         float temp = -b - root;
+         if(temp < timeMax && temp > timeMin) {
+            setHit(temp, record);
+            return true;
+         }
+         temp = -b + root;
+         if(temp < timeMax && temp > timeMin) {
+            setHit(temp, record);
+            return true;
+         }
+      }
+      return false;
+   }
+   void setHit(float time, HitRecord &record) {
+      record.time = time;
+      record.object = this;
+   }
+   void finalizeHit(const Ray &ray, HitRecord &record) {
+      setRecord(ray, record.time, record, mCenter);
+   }
+   void setRecord(const Ray &ray, float time, HitRecord &record, const vector3f &center) {
+      record.point = ray.pointAtParameter(time);
+      record.normal = (record.point - center) / mRadius;
+      getSphereUV((record.point - center) / mRadius, record.u, record.v);
+      record.material = mMaterial;
+   }
+
+   // the quadratic for four rays at once
+   void hitPacket(RayPacket &packet, uint64_t mask, float timeMin) {
+#ifdef USE_SSE
+      for(int first=0; first<cPacketSize; first+=4) {
+         if(((mask >> first) & 0xf) == 0)
+            continue;
+         __m128 ocx = _mm_sub_ps(_mm_load_ps(packet.mOrigin[0]+first), _mm_set1_ps(mCenter[0]));
+         __m128 ocy = _mm_sub_ps(_mm_load_ps(packet.mOrigin[1]+first), _mm_set1_ps(mCenter[1]));
+         __m128 ocz = _mm_sub_ps(_mm_load_ps(packet.mOrigin[2]+first), _mm_set1_ps(mCenter[2]));
+         __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_load_ps(packet.mDirection[0]+first)),
+                                          _mm_mul_ps(ocy, _mm_load_ps(packet.mDirection[1]+first))),
+                               _mm_mul_ps(ocz, _mm_load_ps(packet.mDirection[2]+first)));
+         __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                               _mm_set1_ps(mRadius*mRadius));
+         __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+         __m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+         __m128 tMin = _mm_set1_ps(timeMin);
+         __m128 tMax = _mm_load_ps(packet.mTimeMax+first);
+         __m128 nearT = _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
+         __m128 farT = _mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
+         __m128 hitNear = _mm_and_ps(_mm_cmplt_ps(nearT, tMax), _mm_cmpgt_ps(nearT, tMin));
+         __m128 hitFar = _mm_and_ps(_mm_cmplt_ps(farT, tMax), _mm_cmpgt_ps(farT, tMin));
+         __m128 hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()), _mm_or_ps(hitNear, hitFar));
+         int hits = _mm_movemask_ps(hit) & int((mask >> first) & 0xf);
+         if(hits == 0)
+            continue;
+         alignas(16) float times[4];
+         _mm_store_ps(times, _mm_or_ps(_mm_and_ps(hitNear, nearT), _mm_andnot_ps(hitNear, farT)));
+         while(hits != 0) {
+            int lane = countTrailingZeros(hits);
+            hits &= hits - 1;
+            int i = first + lane;
+            setHit(times[lane], packet.mRecords[i]);
+            packet.mTimeMax[i] = times[lane];
+            packet.mHit |= uint64_t(1) << i;
+         }
+      }
+#else
+      Hitable::hitPacket(packet, mask, timeMin);
+#endif
+   }
+
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      vector3f oc = ray.mOrigin - mCenter;
+      float b = dot(oc, ray.mDirection);
+      float c = dot(oc, oc) - mRadius*mRadius;
+      float discriminant = b*b - c;
+      if(discriminant <= 0)
+         return false;
+      float root = sqrt(discriminant);
+      float near = -b - root;
+      float far = -b + root;
+      return (near < timeMax && near > timeMin) || (far < timeMax && far > timeMin);
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      float radius = fabs(mRadius);       //negative radius is used for hollow spheres
+      aabb = AABB(mCenter - vector3f(radius, radius, radius), mCenter + vector3f(radius, radius, radius));
+      return true;
+   }
+
+   float radius() const { return mRadius; }
+   const vector3f &center() const { return mCenter; }
+   void move(const vector3f &offset) { mCenter += offset; }
+
+protected:
+   vector3f mCenter;
+   float mRadius;
+   Material *mMaterial;
+};
+
+// sphere moving linearly from its center at time0 to center1 at time1, intersected where it
+// is at the time of the ray. move() shifts the whole path
+class MovingSphere : public Sphere {
+public:
+   MovingSphere(vector3f center0, vector3f center1, float time0, float time1, float radius, Material *material)
+      : Sphere(center0, radius, material)
+      , mMotion(center1 - center0)
+      , mTime0(time0)
+      , mInvDuration(time1 > time0 ? 1.0f / (time1 - time0) : 0.0f)
+   {}
+   vector3f center(float time) const {
+      return mCenter + ((time - mTime0) * mInvDuration) * mMotion;
+   }
+
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      vector3f centerNow = center(ray.mTime);
+      vector3f oc = ray.mOrigin - centerNow;
+      float b = dot(oc, ray.mDirection);
+      float c = dot(oc, oc) - mRadius*mRadius;
+      float discriminant = b*b - c;
+      if(discriminant > 0) {
+         float root = sqrt(discriminant);
+         float temp = -b - root;
+         if(temp < timeMax && temp > timeMin) {
+            setHit(temp, record);
+            return true;
+         }
+         temp = -b + root;
+         if(temp < timeMax && temp > timeMin) {
+            setHit(temp, record);
+            return true;
+         }
+      }
+      return false;
+   }
+   void finalizeHit(const Ray &ray, HitRecord &record) {
+      setRecord(ray, record.time, record, center(ray.mTime));
+   }
+   // the rays of a packet sample different times
+   void hitPacket(RayPacket &packet, uint64_t mask, float timeMin) {
+      Hitable::hitPacket(packet, mask, timeMin);
+   }
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      vector3f oc = ray.mOrigin - center(ray.mTime);
+      float b = dot(oc, ray.mDirection);
+      float c = dot(oc, oc) - mRadius*mRadius;
+      float discriminant = b*b - c;
+      if(discriminant <= 0)
+         return false;
+      float root = sqrt(discriminant);
+      float near = -b - root;
+      float far = -b + root;
+      return (near < timeMax && near > timeMin) || (far < timeMax && far > timeMin);
+   }
+   // the boxes at both ends of the interval, their union for a time span
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      float radius = fabs(mRadius);
+      vector3f extent(radius, radius, radius);
+      AABB box0(center(t0) - extent, center(t0) + extent);
+      AABB box1(center(t1) - extent, center(t1) + extent);
+      aabb = surroundingBox(box0, box1);
+      return true;
+   }
+
+private:
+   vector3f mMotion;             //center1 - center0
+   float mTime0;
+   float mInvDuration;
+};
+
+class XYRect : public Hitable {
+public:
+   XYRect() {}
+   XYRect(float x0, float x1, float y0, float y1, float k, Material *material, bool flipNormal = false)
+      : mX0(x0)
+      , mX1(x1)
+      , mY0(y0)
+      , mY1(y1)
+      , mK(k)
+      , mMaterial(material)
+      , mFlipNormal(flipNormal)
+   {}
+   ~XYRect() {
+      delete mMaterial;
+   }
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      float t = (mK - ray.mOrigin[2]) * ray.mInvDirection[2];
+      if(t < timeMin || t > timeMax)
+         return false;
+      float x = ray.mOrigin[0] + t * ray.mDirection[0];
+      float y = ray.mOrigin[1] + t * ray.mDirection[1];
+      if(x < mX0 || x > mX1 || y < mY0 || y > mY1)
+         return false;
+      record.time = t;
+      record.object = this;
+      return true;
+   }
+   void finalizeHit(const Ray &ray, HitRecord &record) {
+      record.point = ray.pointAtParameter(record.time);
+      record.u = (record.point[0] - mX0) / (mX1-mX0);
+      record.v = (record.point[1] - mY0) / (mY1-mY0);
+      record.material = mMaterial;
+      if(mFlipNormal)
+         record.normal = vector3f(0.0f, 0.0f, -1.0f);
+      else
+         record.normal = vector3f(0.0f, 0.0f, 1.0f);
+   }
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      float t = (mK - ray.mOrigin[2]) * ray.mInvDirection[2];
+      if(t < timeMin || t > timeMax)
+         return false;
+      float x = ray.mOrigin[0] + t * ray.mDirection[0];
+      float y = ray.mOrigin[1] + t * ray.mDirection[1];
+      return x >= mX0 && x <= mX1 && y >= mY0 && y <= mY1;
+   }
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      aabb = AABB(vector3f(mX0, mY0, mK-0.0001f), vector3f(mX1, mY1, mK+0.0001f));
+      return true;
+   }
+
+   Material *mMaterial;
+   float mX0, mX1, mY0, mY1, mK;
+   bool mFlipNormal;
+};
+
+// ================================================================================
+
+inline PrimitiveType primitiveType(Hitable *object) {
+   // moving spheres are intersected where they are at the time of the ray
+   if(dynamic_cast<MovingSphere*>(object) != nullptr)
+      return PRIMITIVE_HITABLE;
+   if(dynamic_cast<Sphere*>(object) != nullptr)
+      return PRIMITIVE_SPHERE;
+   if(dynamic_cast<XYRect*>(object) != nullptr)
+      return PRIMITIVE_XYRECT;
+   return PRIMITIVE_HITABLE;
+}
+
+// the leaves are visited in node order, so the arrays follow the layout of the nodes
+void GeometryArrays::build(Hitable **list, const LinearBVHNode *nodes, size_t numberNodes, const uint32_t *indices,
+                           size_t numberIndices) {
+   *this = GeometryArrays();
+   mSlotType.resize(numberIndices);
+   mSlotIndex.resize(numberIndices);
+   for(size_t n=0; n<numberNodes; ++n) {
+      const LinearBVHNode &node = nodes[n];
+      if(!node.isLeaf())
+         continue;
+      uint32_t slot = node.mOffset;
+      for(int type=0; type<NUMBER_PRIMITIVE_TYPES; ++type) {
+         for(uint32_t i=node.mOffset; i<node.mOffset+node.mNumberPrimitives; ++i) {
+            Hitable *object = list[indices[i]];
+            if(primitiveType(object) != type)
+               continue;
+            mSlotType[slot] = type;
+            mSlotIndex[slot] = mObjects[type].size();
+            mObjects[type].push_back(object);
+            mIds[type].push_back(indices[i]);
+            ++slot;
+         }
+      }
    }
-   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
-      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
-      vector3f target = record.point + normal + randomOnUnitSphere();
-      scattered = Ray(record.point + cEpsilon*normal, target-record.point);
-      attenuation = mAlbedo->getTexel(0.0f, 0.0f, record.point);
-      return true;
+   // padded for the reads of the last sphere batch
+   size_t numberSpheres = mObjects[PRIMITIVE_SPHERE].size() + cSphereBatchSize - 1;
+   mSphereX.resize(numberSpheres);
+   mSphereY.resize(numberSpheres);
+   mSphereZ.resize(numberSpheres);
+   mSphereRadius.resize(numberSpheres);
+   size_t numberRects = mObjects[PRIMITIVE_XYRECT].size();
+   mRectX0.resize(numberRects);
+   mRectX1.resize(numberRects);
+   mRectY0.resize(numberRects);
+   mRectY1.resize(numberRects);
+   mRectK.resize(numberRects);
+   update();
+}
+
+void GeometryArrays::update() {
+   for(size_t i=0; i<mObjects[PRIMITIVE_SPHERE].size(); ++i) {
+      const Sphere *sphere = (const Sphere*)mObjects[PRIMITIVE_SPHERE][i];
+      mSphereX[i] = sphere->center()[0];
+      mSphereY[i] = sphere->center()[1];
+      mSphereZ[i] = sphere->center()[2];
+      mSphereRadius[i] = sphere->radius();
    }
-   Texture *mAlbedo;
+   for(size_t i=0; i<mRectK.size(); ++i) {
+      const XYRect *rect = (const XYRect*)mObjects[PRIMITIVE_XYRECT][i];
+      mRectX0[i] = rect->mX0;
+      mRectX1[i] = rect->mX1;
+      mRectY0[i] = rect->mY0;
+      mRectY1[i] = rect->mY1;
+      mRectK[i] = rect->mK;
+   }
+}
+
+// ================================================================================
+
+// indexed triangle meshes. the triangles aren't hitables of their own, the mesh builds a bvh
+// over their indices and stores the triangles of every leaf as packs of cTrianglePackSize in
+// SoA layout, so a pack is intersected in one SSE pass and a full leaf of two packs in one
+// AVX2 pass. the intersection is the watertight one of "Watertight Ray/Triangle Intersection"
+// (Woo, Benthin, Wald 2013): the ray is sheared to run along +z from the origin and the
+// triangles are tested with 2D edge functions, which give the same values for both triangles
+// of a shared edge, so no ray slips through between them
+
+const int cTrianglePackSize = 4;
+const int cMeshLeafSize = 2*cTrianglePackSize;     //triangles per leaf, at most two packs
+
+// the shear transform of a ray, kz is the axis of the largest direction component
+struct WatertightRay {
+   WatertightRay(const Ray &ray) {
+      int kz = fabs(ray.mDirection[0]) > fabs(ray.mDirection[1]) ? 0 : 1;
+      if(fabs(ray.mDirection[2]) > fabs(ray.mDirection[kz]))
+         kz = 2;
+      int kx = (kz + 1) % 3;
+      int ky = (kx + 1) % 3;
+      if(ray.mDirection[kz] < 0.0f)          //keeps the winding and so the sign of the edge functions
+         std::swap(kx, ky);
+      mAxis[0] = kx;
+      mAxis[1] = ky;
+      mAxis[2] = kz;
+      mShear[0] = ray.mDirection[kx] / ray.mDirection[kz];
+      mShear[1] = ray.mDirection[ky] / ray.mDirection[kz];
+      mShear[2] = 1.0f / ray.mDirection[kz];
+      for(int a=0; a<3; ++a) {
+         mOrigin[a] = ray.mOrigin[mAxis[a]];
+      }
+   }
+   int mAxis[3];
+   float mShear[3];
+   float mOrigin[3];             //in the order of mAxis
 };
 
-class Metal : public Material {
+// padding triangles have all corners at the origin, their edge functions are zero and miss.
+// the leaves mask them out anyway
+struct alignas(16) TrianglePack {
+   float mVertex[3][3][cTrianglePackSize];   //corner, axis, triangle
+   uint32_t mTriangle[cTrianglePackSize];    //index into the mesh, UINT32_MAX for padding
+};
+
+// returns the mask of the triangles hit in (tmin, tmax), their distances and the barycentric
+// coordinates of the second and third corner
+inline int intersectTrianglesScalar(const TrianglePack &pack, const WatertightRay &ray, float tmin, float tmax,
+                                    float *t, float *u, float *v) {
+   int kx = ray.mAxis[0], ky = ray.mAxis[1], kz = ray.mAxis[2];
+   int mask = 0;
+   for(int i=0; i<cTrianglePackSize; ++i) {
+      float x[3], y[3], z[3];
+      for(int c=0; c<3; ++c) {
+         float az = pack.mVertex[c][kz][i] - ray.mOrigin[2];
+         x[c] = pack.mVertex[c][kx][i] - ray.mOrigin[0] - ray.mShear[0] * az;
+         y[c] = pack.mVertex[c][ky][i] - ray.mOrigin[1] - ray.mShear[1] * az;
+         z[c] = ray.mShear[2] * az;
+      }
+      float e0 = x[2]*y[1] - y[2]*x[1];
+      float e1 = x[0]*y[2] - y[0]*x[2];
+      float e2 = x[1]*y[0] - y[1]*x[0];
+      if((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f))
+         continue;
+      float det = e0 + e1 + e2;
+      if(det == 0.0f)
+         continue;
+      float time = (e0*z[0] + e1*z[1] + e2*z[2]) / det;
+      if(time <= tmin || time >= tmax)
+         continue;
+      t[i] = time;
+      u[i] = e1 / det;
+      v[i] = e2 / det;
+      mask |= 1 << i;
+   }
+   return mask;
+}
+
+#ifdef USE_SSE
+inline int intersectTrianglesSSE(const TrianglePack &pack, const WatertightRay &ray, float tmin, float tmax,
+                                 float *t, float *u, float *v) {
+   int kx = ray.mAxis[0], ky = ray.mAxis[1], kz = ray.mAxis[2];
+   __m128 ox = _mm_set1_ps(ray.mOrigin[0]);
+   __m128 oy = _mm_set1_ps(ray.mOrigin[1]);
+   __m128 oz = _mm_set1_ps(ray.mOrigin[2]);
+   __m128 sx = _mm_set1_ps(ray.mShear[0]);
+   __m128 sy = _mm_set1_ps(ray.mShear[1]);
+   __m128 sz = _mm_set1_ps(ray.mShear[2]);
+   __m128 x[3], y[3], z[3];
+   for(int c=0; c<3; ++c) {
+      __m128 az = _mm_sub_ps(_mm_load_ps(pack.mVertex[c][kz]), oz);
+      x[c] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack.mVertex[c][kx]), ox), _mm_mul_ps(sx, az));
+      y[c] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(pack.mVertex[c][ky]), oy), _mm_mul_ps(sy, az));
+      z[c] = _mm_mul_ps(sz, az);
+   }
+   __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+   __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+   __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+   __m128 zero = _mm_setzero_ps();
+   __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+   __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+   __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+   __m128 time = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])), _mm_mul_ps(e2, z[2])), det);
+   __m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+   valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(time, _mm_set1_ps(tmin)), _mm_cmplt_ps(time, _mm_set1_ps(tmax))));
+   int mask = _mm_movemask_ps(valid);
+   if(mask != 0) {
+      __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+      _mm_storeu_ps(t, time);
+      _mm_storeu_ps(u, _mm_mul_ps(e1, invDet));
+      _mm_storeu_ps(v, _mm_mul_ps(e2, invDet));
+   }
+   return mask;
+}
+#endif
+
+#ifdef USE_AVX2
+TARGET_AVX2_NO_FMA inline __m256 loadPacks(const TrianglePack *packs, int corner, int axis) {
+   return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(packs[0].mVertex[corner][axis])),
+                               _mm_load_ps(packs[1].mVertex[corner][axis]), 1);
+}
+
+// both packs of a full leaf in one pass. compiled without fma: a contracted edge function of a
+// shared edge doesn't round to the negated value of its neighbour's anymore, and rays could
+// slip through between the triangles
+TARGET_AVX2_NO_FMA int intersectTrianglesAVX2(const TrianglePack *packs, const WatertightRay &ray, float tmin, float tmax,
+                                       float *t, float *u, float *v) {
+   int kx = ray.mAxis[0], ky = ray.mAxis[1], kz = ray.mAxis[2];
+   __m256 ox = _mm256_set1_ps(ray.mOrigin[0]);
+   __m256 oy = _mm256_set1_ps(ray.mOrigin[1]);
+   __m256 oz = _mm256_set1_ps(ray.mOrigin[2]);
+   __m256 sx = _mm256_set1_ps(ray.mShear[0]);
+   __m256 sy = _mm256_set1_ps(ray.mShear[1]);
+   __m256 sz = _mm256_set1_ps(ray.mShear[2]);
+   __m256 x[3], y[3], z[3];
+   for(int c=0; c<3; ++c) {
+      __m256 az = _mm256_sub_ps(loadPacks(packs, c, kz), oz);
+      x[c] = _mm256_sub_ps(_mm256_sub_ps(loadPacks(packs, c, kx), ox), _mm256_mul_ps(sx, az));
+      y[c] = _mm256_sub_ps(_mm256_sub_ps(loadPacks(packs, c, ky), oy), _mm256_mul_ps(sy, az));
+      z[c] = _mm256_mul_ps(sz, az);
+   }
+   __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+   __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+   __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+   __m256 zero = _mm256_setzero_ps();
+   __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ), _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+                                  _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+   __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ), _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+                                  _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+   __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+   __m256 time = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, z[0]), _mm256_mul_ps(e1, z[1])),
+                                             _mm256_mul_ps(e2, z[2])), det);
+   __m256 valid = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+   valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(time, _mm256_set1_ps(tmin), _CMP_GT_OQ),
+                                              _mm256_cmp_ps(time, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+   int mask = _mm256_movemask_ps(valid);
+   if(mask != 0) {
+      __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+      _mm256_storeu_ps(t, time);
+      _mm256_storeu_ps(u, _mm256_mul_ps(e1, invDet));
+      _mm256_storeu_ps(v, _mm256_mul_ps(e2, invDet));
+   }
+   return mask;
+}
+#endif
+
+inline int intersectTriangles(const TrianglePack &pack, const WatertightRay &ray, float tmin, float tmax,
+                              float *t, float *u, float *v) {
+#ifdef USE_SSE
+   return intersectTrianglesSSE(pack, ray, tmin, tmax, t, u, v);
+#else
+   return intersectTrianglesScalar(pack, ray, tmin, tmax, t, u, v);
+#endif
+}
+
+class TriangleMesh : public Hitable {
 public:
-   Metal(vector3f color, float fuzziness)
-      : mAlbedo(color)
+   // takes over the buffers. three indices per triangle, normals and uvs are per vertex and
+   // may be empty, the geometric normal and the barycentric coordinates are used instead
+   TriangleMesh(std::vector<vector3f> &positions, std::vector<uint32_t> &indices, std::vector<vector3f> &normals,
+                std::vector<vector2f> &uvs, Material *material)
+      : mMaterial(material)
+      , mFile(nullptr)
    {
-      if(fuzziness < 1)             //don't make it too big to be inside the object
-         mFuzziness = fuzziness;
+      mPositions.swap(positions);
+      mIndices.swap(indices);
+      mNormals.swap(normals);
+      mUVs.swap(uvs);
+      build();
+   }
+   // uses the arrays of a mapped mesh file in place, takes over the file. normals and uvs may
+   // be nullptr
+   TriangleMesh(MappedFile *file, vector3f *positions, size_t numberVertices, uint32_t *indices, size_t numberIndices,
+                vector3f *normals, vector2f *uvs, Material *material)
+      : mMaterial(material)
+      , mFile(file)
+   {
+      mPositions.map(positions, numberVertices);
+      mIndices.map(indices, numberIndices);
+      mNormals.map(normals, normals != nullptr ? numberVertices : 0);
+      mUVs.map(uvs, uvs != nullptr ? numberVertices : 0);
+      build();
+   }
+   ~TriangleMesh() {
+      delete mMaterial;
+      delete mFile;
+   }
+
+   // front to back like LinearBVH::hitOrdered
+   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
+      if(mNodes.empty())
+         return false;
+      struct StackEntry {
+         uint32_t mNode;
+         float mEntry;
+      } stack[cBVHStackSize];
+      int stackSize = 0;
+      uint32_t current = 0;
+      uint32_t nodesVisited = 1;
+      uint32_t trianglesTested = 0;
+      float tEntry, tEntrySecond;
+      uint32_t hitTriangle = UINT32_MAX;
+      float hitU = 0.0f, hitV = 0.0f;
+      WatertightRay watertight(ray);
+      if(mNodes[0].hit(ray, timeMin, timeMax, tEntry)) {
+         while(true) {
+            const LinearBVHNode &node = mNodes[current];
+            if(node.isLeaf()) {
+               trianglesTested += node.mNumberPrimitives;
+               intersectLeaf(node, watertight, timeMin, timeMax, hitTriangle, hitU, hitV);
+            } else {
+               uint32_t first = node.leftChild(current);
+               uint32_t second = node.rightChild(current);
+               if(ray.mSign[node.mAxis])
+                  std::swap(first, second);
+               bool hitFirst = mNodes[first].hit(ray, timeMin, timeMax, tEntry);
+               bool hitSecond = mNodes[second].hit(ray, timeMin, timeMax, tEntrySecond);
+               nodesVisited += 2;
+               if(hitFirst) {
+                  if(hitSecond) {
+                     stack[stackSize].mNode = second;
+                     stack[stackSize].mEntry = tEntrySecond;
+                     ++stackSize;
+                  }
+                  current = first;
+                  continue;
+               } else if(hitSecond) {
+                  current = second;
+                  continue;
+               }
+            }
+            while(stackSize > 0 && stack[stackSize-1].mEntry >= timeMax) {
+               --stackSize;
+            }
+            if(stackSize == 0)
+               break;
+            current = stack[--stackSize].mNode;
+         }
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += trianglesTested;
+      if(hitTriangle == UINT32_MAX)
+         return false;
+      record.time = timeMax;
+      record.object = this;
+      record.primitive = hitTriangle;
+      record.u = hitU;
+      record.v = hitV;
+      return true;
+   }
+   void finalizeHit(const Ray &ray, HitRecord &record) {
+      setRecord(ray, record.time, record.primitive, record.u, record.v, record);
+   }
+
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      if(mNodes.empty())
+         return false;
+      uint32_t stack[cBVHStackSize];
+      int stackSize = 0;
+      uint32_t current = 0;
+      uint32_t nodesVisited = 0;
+      uint32_t trianglesTested = 0;
+      bool occluded = false;
+      float tEntry;
+      uint32_t hitTriangle = UINT32_MAX;
+      float hitU, hitV;
+      WatertightRay watertight(ray);
+      while(true) {
+         const LinearBVHNode &node = mNodes[current];
+         nodesVisited += 1;
+         if(node.hit(ray, timeMin, timeMax, tEntry)) {
+            if(!node.isLeaf()) {
+               stack[stackSize++] = node.mOffset;
+               current = current + 1;
+               continue;
+            }
+            trianglesTested += node.mNumberPrimitives;
+            occluded = intersectLeaf(node, watertight, timeMin, timeMax, hitTriangle, hitU, hitV);
+         }
+         if(occluded || stackSize == 0)
+            break;
+         current = stack[--stackSize];
+      }
+      tCurrentRay.mNodesVisited += nodesVisited;
+      tCurrentRay.mPrimitivesTested += trianglesTested;
+      return occluded;
+   }
+
+   bool boundingBox(float t0, float t1, AABB &aabb) {
+      if(mNodes.empty())
+         return false;
+      aabb = mNodes[0].bounds();
+      return true;
+   }
+
+   uint32_t numberTriangles() const { return mIndices.size() / 3; }
+
+   MappableArray<vector3f> mPositions;
+   MappableArray<uint32_t> mIndices;
+   MappableArray<vector3f> mNormals;
+   MappableArray<vector2f> mUVs;
+   Material *mMaterial;
+   MappedFile *mFile;                       //mesh file the arrays are mapped from, if any
+   LinearBVHNodeArray mNodes;               //leaves reference their first pack
+   std::vector<TrianglePack, AlignedAllocator<TrianglePack, 64>> mPacks;
+
+private:
+   // the packs are filled in the order of the leaves, the last pack of a leaf is padded
+   void build() {
+      uint32_t size = numberTriangles();
+      std::vector<PrimitiveRef> refs(size);
+      for(uint32_t i=0; i<size; ++i) {
+         refs[i].mBox.reset();
+         for(int c=0; c<3; ++c) {
+            refs[i].mBox.extend(mPositions[mIndices[3*i+c]]);
+         }
+         refs[i].mCentroid = refs[i].mBox.center();
+         refs[i].mIndex = i;
+      }
+      // a pack costs about as much as a single triangle, so leaves are allowed to fill them
+      SAHSettings settings;
+      settings.mMaxLeafSize = cMeshLeafSize;
+      settings.mIntersectionCost = 1.0f / cTrianglePackSize;
+      std::vector<uint32_t> order;
+      SAHBuilder builder(settings);
+      builder.build(refs, mNodes, order);
+
+      for(size_t n=0; n<mNodes.size(); ++n) {
+         LinearBVHNode &node = mNodes[n];
+         if(!node.isLeaf())
+            continue;
+         uint32_t first = node.mOffset;
+         node.mOffset = mPacks.size();
+         for(uint32_t p=0; p<node.mNumberPrimitives; p+=cTrianglePackSize) {
+            TrianglePack pack;
+            memset(&pack, 0, sizeof(TrianglePack));
+            for(int i=0; i<cTrianglePackSize; ++i) {
+               if(p+i >= node.mNumberPrimitives) {
+                  pack.mTriangle[i] = UINT32_MAX;
+                  continue;
+               }
+               uint32_t triangle = order[first+p+i];
+               pack.mTriangle[i] = triangle;
+               for(int c=0; c<3; ++c) {
+                  const vector3f &position = mPositions[mIndices[3*triangle+c]];
+                  for(int a=0; a<3; ++a) {
+                     pack.mVertex[c][a][i] = position[a];
+                  }
+               }
+            }
+            mPacks.push_back(pack);
+         }
+      }
+   }
+
+   // closest hit among the triangles of a leaf, shortens timeMax
+   bool intersectLeaf(const LinearBVHNode &node, const WatertightRay &ray, float timeMin, float &timeMax,
+                      uint32_t &triangle, float &u, float &v) const {
+      const TrianglePack *packs = &mPacks[node.mOffset];
+      int numberPacks = (node.mNumberPrimitives + cTrianglePackSize - 1) / cTrianglePackSize;
+      float t[cMeshLeafSize], bu[cMeshLeafSize], bv[cMeshLeafSize];
+      int mask = 0;
+#ifdef USE_AVX2
+      if(numberPacks == 2 && gUseAVX2) {
+         mask = intersectTrianglesAVX2(packs, ray, timeMin, timeMax, t, bu, bv);
+      } else
+#endif
+      {
+         for(int p=0; p<numberPacks; ++p) {
+            int first = p*cTrianglePackSize;
+            mask |= intersectTriangles(packs[p], ray, timeMin, timeMax, t+first, bu+first, bv+first) << first;
+         }
+      }
+      mask &= (1 << node.mNumberPrimitives) - 1;
+      if(mask == 0)
+         return false;
+      int closest = -1;
+      while(mask != 0) {
+         int i = countTrailingZeros(mask);
+         mask &= mask - 1;
+         if(closest == -1 || t[i] < t[closest])
+            closest = i;
+      }
+      timeMax = t[closest];
+      triangle = packs[closest / cTrianglePackSize].mTriangle[closest % cTrianglePackSize];
+      u = bu[closest];
+      v = bv[closest];
+      return true;
+   }
+
+   // u and v weight the second and third corner
+   void setRecord(const Ray &ray, float time, uint32_t triangle, float u, float v, HitRecord &record) const {
+      uint32_t i0 = mIndices[3*triangle], i1 = mIndices[3*triangle+1], i2 = mIndices[3*triangle+2];
+      float w = 1.0f - u - v;
+      record.time = time;
+      record.point = ray.pointAtParameter(time);
+      if(mNormals.empty())
+         record.normal = cross(mPositions[i1] - mPositions[i0], mPositions[i2] - mPositions[i0]);
       else
-         mFuzziness = 1;
+         record.normal = w*mNormals[i0] + u*mNormals[i1] + v*mNormals[i2];
+      record.normal.normalize();
+      if(mUVs.empty()) {
+         record.u = u;
+         record.v = v;
+      } else {
+         vector2f uv = w*mUVs[i0] + u*mUVs[i1] + v*mUVs[i2];
+         record.u = uv[0];
+         record.v = uv[1];
+      }
+      record.material = mMaterial;
    }
-   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
-      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
-      vector3f reflected = reflect(rayIn.mDirection.normalize(), normal);
-      scattered = Ray(record.point + cEpsilon*normal, reflected + mFuzziness*randomOnUnitSphere());
-      attenuation = mAlbedo;
-      return (dot(scattered.mDirection, normal) > 0);
+};
+
+// torus around the y axis through center, tessellated into rings around the axis and sides
+// around the tube, with normals and uvs
+TriangleMesh *torusMesh(const vector3f &center, float majorRadius, float minorRadius, int rings, int sides, Material *material) {
+   std::vector<vector3f> positions, normals;
+   std::vector<vector2f> uvs;
+   std::vector<uint32_t> indices;
+   for(int r=0; r<rings; ++r) {
+      float phi = 2.0f * M_PI * r / rings;
+      vector3f direction(cos(phi), 0.0f, sin(phi));
+      for(int s=0; s<sides; ++s) {
+         float theta = 2.0f * M_PI * s / sides;
+         vector3f normal = cos(theta) * direction + vector3f(0.0f, sin(theta), 0.0f);
+         positions.push_back(center + majorRadius * direction + minorRadius * normal);
+         normals.push_back(normal);
+         uvs.push_back(vector2f(float(r) / rings, float(s) / sides));
+      }
    }
-   vector3f mAlbedo;
-   float mFuzziness;
+   // the last ring and side share the vertices of the first ones, so the surface is closed
+   for(int r=0; r<rings; ++r) {
+      for(int s=0; s<sides; ++s) {
+         uint32_t i00 = r*sides + s;
+         uint32_t i01 = r*sides + (s+1) % sides;
+         uint32_t i10 = ((r+1) % rings)*sides + s;
+         uint32_t i11 = ((r+1) % rings)*sides + (s+1) % sides;
+         uint32_t triangles[6] = { i00, i01, i11, i00, i11, i10 };
+         indices.insert(indices.end(), triangles, triangles+6);
+      }
+   }
+   return new TriangleMesh(positions, indices, normals, uvs, material);
+}
+
+// ================================================================================
+
+// mesh import from obj and binary ply files. the file is read in chunks of cMeshChunkSize and
+// every chunk is cut into ranges of about cMeshRangeSize bytes of whole lines or elements,
+// which are parsed as jobs. obj ranges keep their vertices and corners until the whole file is
+// parsed, only then the vertex counts before a range and so its relative indices are known.
+// binary ply vertices have a fixed size and the sizes of the faces are found by a quick walk
+// over their counts, so the ranges write straight into the mesh
+
+const size_t cMeshChunkSize = 64 << 20;      //bytes read at once
+const size_t cMeshRangeSize = 1 << 20;       //bytes parsed by one job
+
+struct MeshData {
+   std::vector<vector3f> mPositions;
+   std::vector<uint32_t> mIndices;           //three per triangle
+   std::vector<vector3f> mNormals;           //per vertex or empty
+   std::vector<vector2f> mUVs;
 };
 
-class Dielectric : public Material {
+// sliding window over a file. refill moves the bytes not consumed yet to the front and reads
+// the rest of the buffer
+class ChunkReader {
 public:
-   Dielectric(float refIndex)
-      : mRefIndex(refIndex)
+   ChunkReader(FILE *file)
+      : mFile(file)
+      , mBuffer(cMeshChunkSize)
+      , mBegin(0)
+      , mEnd(0)
+      , mBytesRead(0)
    {}
-   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
-      vector3f outwardNormal;
-      vector3f normal = dot(rayIn.mDirection, record.normal) < 0.0f ? record.normal : -record.normal;
-      vector3f reflected = reflect(rayIn.mDirection, normal);
-      float niOverT;
-      attenuation = vector3f(1.0f, 1.0f, 1.0f);
-      vector3f refracted;
-      float reflectProb;
-      float cosine;
-      if(dot(rayIn.mDirection, record.normal) > 0) {
-         outwardNormal = -record.normal;
-         niOverT = mRefIndex;
-         cosine = mRefIndex * dot(rayIn.mDirection, record.normal) / rayIn.mDirection.length();
-      } else {
-         outwardNormal = record.normal;
-         niOverT = 1.0f / mRefIndex;
-         cosine = -dot(rayIn.mDirection, record.normal) / rayIn.mDirection.length();
+   size_t refill() {
+      size_t left = mEnd - mBegin;
+      memmove(mBuffer.data(), mBuffer.data() + mBegin, left);
+      size_t read = fread(mBuffer.data() + left, 1, mBuffer.size() - left, mFile);
+      mBegin = 0;
+      mEnd = left + read;
+      mBytesRead += read;
+      return read;
+   }
+   // refills until at least size bytes are available, false if the file ends before
+   bool require(size_t size) {
+      while(available() < size) {
+         if(size > mBuffer.size() || refill() == 0)
+            return false;
       }
+      return true;
+   }
+   const char *data() const { return mBuffer.data() + mBegin; }
+   size_t available() const { return mEnd - mBegin; }
+   void consume(size_t size) { mBegin += size; }
+   bool atEnd() const { return feof(mFile) != 0; }
+   uint64_t bytesRead() const { return mBytesRead; }
 
-      if(refract(rayIn.mDirection, outwardNormal, niOverT, refracted)) {
-         reflectProb = schlick(cosine, niOverT);
-      } else {
-         reflectProb = 1.0f;
+private:
+   FILE *mFile;
+   std::vector<char> mBuffer;
+   size_t mBegin, mEnd;
+   uint64_t mBytesRead;
+};
+
+// splits [0, size) into ranges of about cMeshRangeSize that end after a newline
+void splitLines(const char *data, size_t size, std::vector<size_t> &ends) {
+   ends.clear();
+   size_t begin = 0;
+   while(begin < size) {
+      size_t end = std::min(size, begin + cMeshRangeSize);
+      const char *newline = end < size ? (const char*)memchr(data + end, '\n', size - end) : nullptr;
+      end = newline != nullptr ? newline - data + 1 : size;
+      ends.push_back(end);
+      begin = end;
+   }
+}
+
+inline const char *skipSpaces(const char *p, const char *end) {
+   while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      ++p;
+   return p;
+}
+
+// strtof without the locale, for the numbers exporters write
+inline float parseFloat(const char *&p, const char *end) {
+   p = skipSpaces(p, end);
+   bool negative = p < end && *p == '-';
+   if(p < end && (*p == '-' || *p == '+'))
+      ++p;
+   double value = 0.0;
+   while(p < end && *p >= '0' && *p <= '9') {
+      value = 10.0*value + (*p++ - '0');
+   }
+   if(p < end && *p == '.') {
+      ++p;
+      double fraction = 0.0, divisor = 1.0;
+      while(p < end && *p >= '0' && *p <= '9') {
+         fraction = 10.0*fraction + (*p++ - '0');
+         divisor *= 10.0;
+      }
+      value += fraction / divisor;
+   }
+   if(p < end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      bool negativeExponent = p < end && *p == '-';
+      if(p < end && (*p == '-' || *p == '+'))
+         ++p;
+      int exponent = 0;
+      while(p < end && *p >= '0' && *p <= '9') {
+         exponent = 10*exponent + (*p++ - '0');
       }
+      value *= pow(10.0, negativeExponent ? -exponent : exponent);
+   }
+   return float(negative ? -value : value);
+}
 
-      if(rnd.randomf() < reflectProb) {
-         scattered = Ray(record.point + cEpsilon*normal, reflected);
+// returns 0 if there is no number
+inline int64_t parseInt(const char *&p, const char *end) {
+   bool negative = p < end && *p == '-';
+   if(p < end && (*p == '-' || *p == '+'))
+      ++p;
+   int64_t value = 0;
+   while(p < end && *p >= '0' && *p <= '9') {
+      value = 10*value + (*p++ - '0');
+   }
+   return negative ? -value : value;
+}
+
+const int32_t cOBJMissing = INT32_MIN;       //corner without uv or normal
+
+// vertices and triangle corners of a range of lines. the corners hold the position, uv and
+// normal index, 0 based. negative indices count back from the last vertex before the face,
+// they are stored relative to the range and listed in mRelative until the merge adds the
+// vertex counts of the ranges before
+struct OBJRange {
+   std::vector<vector3f> mPositions;
+   std::vector<vector2f> mUVs;
+   std::vector<vector3f> mNormals;
+   std::vector<int32_t> mCorners;
+   std::vector<uint32_t> mRelative;
+};
+
+void parseOBJRange(const char *begin, const char *end, OBJRange &range) {
+   std::vector<int32_t> polygon;
+   std::vector<uint8_t> relative;
+   const char *p = begin;
+   while(p < end) {
+      const char *lineEnd = (const char*)memchr(p, '\n', end - p);
+      if(lineEnd == nullptr)
+         lineEnd = end;
+      p = skipSpaces(p, lineEnd);
+      if(lineEnd - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+         p += 1;
+         float x = parseFloat(p, lineEnd);
+         float y = parseFloat(p, lineEnd);
+         float z = parseFloat(p, lineEnd);
+         range.mPositions.push_back(vector3f(x, y, z));
+      } else if(lineEnd - p > 3 && p[0] == 'v' && p[1] == 't') {
+         p += 2;
+         float u = parseFloat(p, lineEnd);
+         float v = parseFloat(p, lineEnd);
+         range.mUVs.push_back(vector2f(u, v));
+      } else if(lineEnd - p > 3 && p[0] == 'v' && p[1] == 'n') {
+         p += 2;
+         float x = parseFloat(p, lineEnd);
+         float y = parseFloat(p, lineEnd);
+         float z = parseFloat(p, lineEnd);
+         range.mNormals.push_back(vector3f(x, y, z));
+      } else if(lineEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+         p += 1;
+         polygon.clear();
+         relative.clear();
+         int32_t counts[3] = { int32_t(range.mPositions.size()), int32_t(range.mUVs.size()), int32_t(range.mNormals.size()) };
+         while(true) {
+            p = skipSpaces(p, lineEnd);
+            if(p >= lineEnd || !(*p == '-' || (*p >= '0' && *p <= '9')))
+               break;
+            // v, v/vt, v//vn or v/vt/vn
+            for(int attribute=0; attribute<3; ++attribute) {
+               int64_t index = 0;
+               if(attribute == 0 || (p < lineEnd && *p == '/')) {
+                  if(attribute > 0)
+                     ++p;
+                  index = parseInt(p, lineEnd);
+               }
+               polygon.push_back(index > 0 ? int32_t(index - 1) : index < 0 ? int32_t(counts[attribute] + index) : cOBJMissing);
+               relative.push_back(index < 0);
+            }
+         }
+         // fans the polygon into triangles
+         size_t numberCorners = polygon.size() / 3;
+         for(size_t i=1; i+1<numberCorners; ++i) {
+            size_t fan[3] = { 0, i, i+1 };
+            for(int c=0; c<3; ++c) {
+               for(int attribute=0; attribute<3; ++attribute) {
+                  size_t value = 3*fan[c] + attribute;
+                  if(relative[value])
+                     range.mRelative.push_back(range.mCorners.size());
+                  range.mCorners.push_back(polygon[value]);
+               }
+            }
+         }
+      }
+      p = lineEnd + 1;
+   }
+}
+
+// unique vertices for the corners whose position, uv and normal indices differ. the corners
+// are sorted by their index triples instead of hashed, so there are no allocations per vertex
+void buildOBJVertices(const std::vector<vector3f> &positions, const std::vector<vector2f> &uvs, const std::vector<vector3f> &normals,
+                      const std::vector<int32_t> &corners, MeshData &mesh) {
+   uint32_t numberCorners = corners.size() / 3;
+   bool hasUVs = !uvs.empty(), hasNormals = !normals.empty();
+   bool shared = (!hasUVs || uvs.size() == positions.size()) && (!hasNormals || normals.size() == positions.size());
+   for(uint32_t i=0; i<numberCorners && shared; ++i) {
+      shared = (!hasUVs || corners[3*i+1] == corners[3*i]) && (!hasNormals || corners[3*i+2] == corners[3*i]);
+   }
+   mesh.mIndices.resize(numberCorners);
+   if(shared) {
+      mesh.mPositions = positions;
+      mesh.mUVs = uvs;
+      mesh.mNormals = normals;
+      for(uint32_t i=0; i<numberCorners; ++i) {
+         mesh.mIndices[i] = corners[3*i];
+      }
+      return;
+   }
+
+   std::vector<uint32_t> order(numberCorners);
+   for(uint32_t i=0; i<numberCorners; ++i) {
+      order[i] = i;
+   }
+   auto key = [&](uint32_t corner, int attribute) {
+      return (attribute == 1 && !hasUVs) || (attribute == 2 && !hasNormals) ? cOBJMissing : corners[3*corner+attribute];
+   };
+   std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      for(int attribute=0; attribute<3; ++attribute) {
+         if(key(a, attribute) != key(b, attribute))
+            return key(a, attribute) < key(b, attribute);
+      }
+      return false;
+   });
+   for(uint32_t i=0; i<numberCorners; ++i) {
+      uint32_t corner = order[i];
+      bool same = i > 0;
+      for(int attribute=0; attribute<3 && same; ++attribute) {
+         same = key(corner, attribute) == key(order[i-1], attribute);
+      }
+      if(!same) {
+         mesh.mPositions.push_back(positions[corners[3*corner]]);
+         if(hasUVs)
+            mesh.mUVs.push_back(corners[3*corner+1] != cOBJMissing ? uvs[corners[3*corner+1]] : vector2f(0.0f, 0.0f));
+         if(hasNormals)
+            mesh.mNormals.push_back(corners[3*corner+2] != cOBJMissing ? normals[corners[3*corner+2]] : vector3f(0.0f, 1.0f, 0.0f));
+      }
+      mesh.mIndices[corner] = mesh.mPositions.size() - 1;
+   }
+}
+
+bool loadOBJ(const char *filename, JobSystem *jobSystem, MeshData &mesh, ChunkReader &reader) {
+   std::vector<OBJRange> ranges;
+   std::vector<size_t> ends;
+   while(true) {
+      reader.refill();
+      size_t size = reader.available();
+      if(size == 0)
+         break;
+      // the last line of a chunk continues in the next one
+      if(!reader.atEnd()) {
+         const char *data = reader.data();
+         size_t last = size;
+         while(last > 0 && data[last-1] != '\n') {
+            --last;
+         }
+         if(last == 0) {
+            printf("%s: line longer than %lu bytes!\n", filename, (unsigned long)cMeshChunkSize);
+            return false;
+         }
+         size = last;
+      }
+      splitLines(reader.data(), size, ends);
+      size_t first = ranges.size();
+      ranges.resize(first + ends.size());
+      const char *data = reader.data();
+      parallelFor(jobSystem, 0, ends.size(), 1, [&](uint32_t chunk, uint32_t, uint32_t) {
+         size_t begin = chunk > 0 ? ends[chunk-1] : 0;
+         parseOBJRange(data + begin, data + ends[chunk], ranges[first + chunk]);
+      });
+      reader.consume(size);
+   }
+
+   // vertex counts before every range, then the ranges are copied into one array each
+   std::vector<uint64_t> bases(4*(ranges.size()+1), 0);
+   for(size_t r=0; r<ranges.size(); ++r) {
+      bases[4*(r+1)+0] = bases[4*r+0] + ranges[r].mPositions.size();
+      bases[4*(r+1)+1] = bases[4*r+1] + ranges[r].mUVs.size();
+      bases[4*(r+1)+2] = bases[4*r+2] + ranges[r].mNormals.size();
+      bases[4*(r+1)+3] = bases[4*r+3] + ranges[r].mCorners.size();
+   }
+   const uint64_t *totals = &bases[4*ranges.size()];
+   if(totals[0] > INT32_MAX || totals[3] > UINT32_MAX) {
+      printf("%s: too many vertices or triangles!\n", filename);
+      return false;
+   }
+   std::vector<vector3f> positions(totals[0]);
+   std::vector<vector2f> uvs(totals[1]);
+   std::vector<vector3f> normals(totals[2]);
+   std::vector<int32_t> corners(totals[3]);
+   std::atomic<bool> valid(true);
+   parallelFor(jobSystem, 0, ranges.size(), 1, [&](uint32_t r, uint32_t, uint32_t) {
+      OBJRange &range = ranges[r];
+      const uint64_t *base = &bases[4*r];
+      std::copy(range.mPositions.begin(), range.mPositions.end(), positions.begin() + base[0]);
+      std::copy(range.mUVs.begin(), range.mUVs.end(), uvs.begin() + base[1]);
+      std::copy(range.mNormals.begin(), range.mNormals.end(), normals.begin() + base[2]);
+      for(size_t i=0; i<range.mRelative.size(); ++i) {
+         range.mCorners[range.mRelative[i]] += base[range.mRelative[i] % 3];
+      }
+      for(size_t i=0; i<range.mCorners.size(); ++i) {
+         int32_t index = range.mCorners[i];
+         if(index != cOBJMissing && (index < 0 || uint64_t(index) >= totals[i % 3]))
+            valid = false;
+      }
+      std::copy(range.mCorners.begin(), range.mCorners.end(), corners.begin() + base[3]);
+      range = OBJRange();
+   });
+   if(!valid) {
+      printf("%s: face index out of range!\n", filename);
+      return false;
+   }
+   buildOBJVertices(positions, uvs, normals, corners, mesh);
+   return true;
+}
+
+// ================================================================================
+
+enum PLYType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+PLYType parsePLYType(const char *name) {
+   const char *names[] = { "", "char", "uchar", "short", "ushort", "int", "uint", "float", "double" };
+   const char *sizedNames[] = { "", "int8", "uint8", "int16", "uint16", "int32", "uint32", "float32", "float64" };
+   for(int type=PLY_INT8; type<=PLY_FLOAT64; ++type) {
+      if(strcmp(name, names[type]) == 0 || strcmp(name, sizedNames[type]) == 0)
+         return PLYType(type);
+   }
+   return PLY_NONE;
+}
+
+inline int plyTypeSize(PLYType type) {
+   const int sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+   return sizes[type];
+}
+
+inline double readPLYValue(const char *p, PLYType type, bool swap) {
+   uint8_t bytes[8];
+   int size = plyTypeSize(type);
+   memcpy(bytes, p, size);
+   if(swap)
+      std::reverse(bytes, bytes + size);
+   switch(type) {
+   case PLY_INT8: { int8_t value; memcpy(&value, bytes, 1); return value; }
+   case PLY_UINT8: return bytes[0];
+   case PLY_INT16: { int16_t value; memcpy(&value, bytes, 2); return value; }
+   case PLY_UINT16: { uint16_t value; memcpy(&value, bytes, 2); return value; }
+   case PLY_INT32: { int32_t value; memcpy(&value, bytes, 4); return value; }
+   case PLY_UINT32: { uint32_t value; memcpy(&value, bytes, 4); return value; }
+   case PLY_FLOAT32: { float value; memcpy(&value, bytes, 4); return value; }
+   case PLY_FLOAT64: { double value; memcpy(&value, bytes, 8); return value; }
+   default: return 0.0;
+   }
+}
+
+struct PLYProperty {
+   char mName[32];
+   PLYType mType;
+   PLYType mCountType;           //PLY_NONE unless the property is a list
+   uint32_t mOffset;             //in the element, for elements without lists
+};
+
+struct PLYElement {
+   char mName[32];
+   uint64_t mCount;
+   std::vector<PLYProperty> mProperties;
+   uint32_t mStride;             //0 if the element has lists
+};
+
+// walks one element with lists, returns its size or 0 if it doesn't fit into size bytes.
+// vertexIndices receives the position of the vertex_indices list
+inline size_t walkPLYElement(const PLYElement &element, const char *data, size_t size, bool swap, size_t &vertexIndices) {
+   size_t offset = 0;
+   for(size_t i=0; i<element.mProperties.size(); ++i) {
+      const PLYProperty &property = element.mProperties[i];
+      if(property.mCountType == PLY_NONE) {
+         offset += plyTypeSize(property.mType);
+         continue;
+      }
+      if(offset + plyTypeSize(property.mCountType) > size)
+         return 0;
+      if(strcmp(property.mName, "vertex_indices") == 0 || strcmp(property.mName, "vertex_index") == 0)
+         vertexIndices = offset;
+      uint64_t count = uint64_t(readPLYValue(data + offset, property.mCountType, swap));
+      offset += plyTypeSize(property.mCountType) + count * plyTypeSize(property.mType);
+   }
+   return offset <= size ? offset : 0;
+}
+
+bool loadPLY(const char *filename, JobSystem *jobSystem, MeshData &mesh, ChunkReader &reader) {
+   reader.refill();
+   const char *header = reader.data();
+   const char *headerEnd = nullptr;
+   for(size_t i=0; i+11<=reader.available(); ++i) {
+      if(memcmp(header + i, "end_header", 10) == 0 && (header[i+10] == '\n' || header[i+10] == '\r')) {
+         headerEnd = header + i + 10 + (header[i+10] == '\r' ? 2 : 1);
+         break;
+      }
+   }
+   if(headerEnd == nullptr) {
+      printf("%s: no ply header!\n", filename);
+      return false;
+   }
+
+   std::vector<PLYElement> elements;
+   bool swap = false;
+   const char *line = header;
+   while(line < headerEnd) {
+      const char *lineEnd = (const char*)memchr(line, '\n', headerEnd - line);
+      char text[256];
+      size_t length = std::min(size_t(lineEnd - line), sizeof(text) - 1);
+      memcpy(text, line, length);
+      text[length] = 0;
+      char word[3][32];
+      unsigned long long count;
+      int words = sscanf(text, "%31s %31s %31s", word[0], word[1], word[2]);
+      if(words >= 2 && strcmp(word[0], "format") == 0) {
+         if(strcmp(word[1], "binary_little_endian") == 0) {
+            swap = !isLittleEndian();
+         } else if(strcmp(word[1], "binary_big_endian") == 0) {
+            swap = isLittleEndian();
+         } else {
+            printf("%s: only binary ply files are supported!\n", filename);
+            return false;
+         }
+      } else if(sscanf(text, "element %31s %llu", word[1], &count) == 2) {
+         elements.push_back(PLYElement());
+         strcpy(elements.back().mName, word[1]);
+         elements.back().mCount = count;
+         elements.back().mStride = 0;
+      } else if(words >= 3 && strcmp(word[0], "property") == 0 && !elements.empty()) {
+         PLYProperty property;
+         property.mCountType = PLY_NONE;
+         if(strcmp(word[1], "list") == 0) {
+            char indexType[32], name[32];
+            if(sscanf(text, "property list %31s %31s %31s", word[2], indexType, name) != 3)
+               return false;
+            property.mCountType = parsePLYType(word[2]);
+            property.mType = parsePLYType(indexType);
+            strcpy(property.mName, name);
+         } else {
+            property.mType = parsePLYType(word[1]);
+            strcpy(property.mName, word[2]);
+         }
+         if(property.mType == PLY_NONE || (strcmp(word[1], "list") == 0 && property.mCountType == PLY_NONE)) {
+            printf("%s: unknown ply property type in '%s'!\n", filename, text);
+            return false;
+         }
+         elements.back().mProperties.push_back(property);
+      }
+      line = lineEnd + 1;
+   }
+   reader.consume(headerEnd - header);
+   for(size_t e=0; e<elements.size(); ++e) {
+      PLYElement &element = elements[e];
+      uint32_t offset = 0;
+      bool hasLists = false;
+      for(size_t i=0; i<element.mProperties.size(); ++i) {
+         element.mProperties[i].mOffset = offset;
+         offset += plyTypeSize(element.mProperties[i].mType);
+         hasLists |= element.mProperties[i].mCountType != PLY_NONE;
+      }
+      element.mStride = hasLists ? 0 : offset;
+   }
+
+   for(size_t e=0; e<elements.size(); ++e) {
+      const PLYElement &element = elements[e];
+      if(strcmp(element.mName, "vertex") == 0 && element.mStride > 0) {
+         // property offsets of x y z, nx ny nz and u v, -1 if missing
+         const char *names[8][3] = { {"x"}, {"y"}, {"z"}, {"nx"}, {"ny"}, {"nz"}, {"u", "s", "texture_u"}, {"v", "t", "texture_v"} };
+         int properties[8];
+         for(int i=0; i<8; ++i) {
+            properties[i] = -1;
+            for(size_t p=0; p<element.mProperties.size(); ++p) {
+               for(int n=0; n<3 && names[i][n] != nullptr; ++n) {
+                  if(strcmp(element.mProperties[p].mName, names[i][n]) == 0)
+                     properties[i] = p;
+               }
+            }
+         }
+         if(properties[0] < 0 || properties[1] < 0 || properties[2] < 0) {
+            printf("%s: ply vertices without positions!\n", filename);
+            return false;
+         }
+         bool hasNormals = properties[3] >= 0 && properties[4] >= 0 && properties[5] >= 0;
+         bool hasUVs = properties[6] >= 0 && properties[7] >= 0;
+         mesh.mPositions.resize(element.mCount);
+         mesh.mNormals.resize(hasNormals ? element.mCount : 0);
+         mesh.mUVs.resize(hasUVs ? element.mCount : 0);
+         uint64_t done = 0;
+         while(done < element.mCount) {
+            if(!reader.require(element.mStride)) {
+               printf("%s: file ends in the vertices!\n", filename);
+               return false;
+            }
+            uint32_t number = std::min(uint64_t(reader.available() / element.mStride), element.mCount - done);
+            const char *data = reader.data();
+            parallelFor(jobSystem, 0, number, cMeshRangeSize / element.mStride + 1, [&](uint32_t, uint32_t begin, uint32_t end) {
+               for(uint32_t i=begin; i<end; ++i) {
+                  const char *vertex = data + size_t(i) * element.mStride;
+                  float values[8];
+                  for(int p=0; p<8; ++p) {
+                     const PLYProperty *property = properties[p] >= 0 ? &element.mProperties[properties[p]] : nullptr;
+                     values[p] = property != nullptr ? float(readPLYValue(vertex + property->mOffset, property->mType, swap)) : 0.0f;
+                  }
+                  mesh.mPositions[done + i] = vector3f(values[0], values[1], values[2]);
+                  if(hasNormals)
+                     mesh.mNormals[done + i] = vector3f(values[3], values[4], values[5]);
+                  if(hasUVs)
+                     mesh.mUVs[done + i] = vector2f(values[6], values[7]);
+               }
+            });
+            reader.consume(size_t(number) * element.mStride);
+            done += number;
+         }
+      } else if(strcmp(element.mName, "face") == 0 || element.mStride == 0) {
+         // the walk finds the faces that are complete in the buffer and where the ranges start,
+         // the ranges then triangulate them as fans straight into the index array
+         bool isFace = strcmp(element.mName, "face") == 0;
+         const PLYProperty *indexList = nullptr;
+         for(size_t p=0; p<element.mProperties.size(); ++p) {
+            if(strcmp(element.mProperties[p].mName, "vertex_indices") == 0 || strcmp(element.mProperties[p].mName, "vertex_index") == 0)
+               indexList = &element.mProperties[p];
+         }
+         uint64_t done = 0;
+         std::vector<size_t> rangeOffsets;
+         std::vector<uint64_t> rangeTriangles;
+         while(done < element.mCount) {
+            if(!reader.require(1)) {
+               printf("%s: file ends in the %s elements!\n", filename, element.mName);
+               return false;
+            }
+            const char *data = reader.data();
+            size_t size = reader.available();
+            size_t offset = 0;
+            uint64_t triangles = mesh.mIndices.size() / 3;
+            rangeOffsets.clear();
+            rangeTriangles.clear();
+            uint64_t number = 0;
+            while(done + number < element.mCount) {
+               size_t listOffset = 0;
+               size_t elementSize = walkPLYElement(element, data + offset, size - offset, swap, listOffset);
+               if(elementSize == 0)
+                  break;
+               if(rangeOffsets.empty() || offset - rangeOffsets.back() >= cMeshRangeSize) {
+                  rangeOffsets.push_back(offset);
+                  rangeTriangles.push_back(triangles);
+               }
+               if(isFace && indexList != nullptr) {
+                  uint64_t count = uint64_t(readPLYValue(data + offset + listOffset, indexList->mCountType, swap));
+                  triangles += count >= 3 ? count - 2 : 0;
+               }
+               offset += elementSize;
+               number += 1;
+            }
+            if(number == 0) {
+               // an element larger than what is left in the buffer
+               if(reader.available() == cMeshChunkSize || reader.refill() == 0) {
+                  printf("%s: broken %s element!\n", filename, element.mName);
+                  return false;
+               }
+               continue;
+            }
+            if(isFace && indexList != nullptr) {
+               if(triangles > UINT32_MAX / 3) {
+                  printf("%s: too many triangles!\n", filename);
+                  return false;
+               }
+               mesh.mIndices.resize(3*triangles);
+               rangeOffsets.push_back(offset);
+               std::atomic<bool> valid(true);
+               parallelFor(jobSystem, 0, rangeOffsets.size()-1, 1, [&](uint32_t r, uint32_t, uint32_t) {
+                  uint32_t *indices = &mesh.mIndices[3*rangeTriangles[r]];
+                  size_t position = rangeOffsets[r];
+                  while(position < rangeOffsets[r+1]) {
+                     size_t listOffset = 0;
+                     size_t elementSize = walkPLYElement(element, data + position, size - position, swap, listOffset);
+                     const char *list = data + position + listOffset;
+                     uint32_t count = uint32_t(readPLYValue(list, indexList->mCountType, swap));
+                     list += plyTypeSize(indexList->mCountType);
+                     int indexSize = plyTypeSize(indexList->mType);
+                     double first = readPLYValue(list, indexList->mType, swap);
+                     double previous = count > 1 ? readPLYValue(list + indexSize, indexList->mType, swap) : 0.0;
+                     for(uint32_t i=2; i<count; ++i) {
+                        double current = readPLYValue(list + i*indexSize, indexList->mType, swap);
+                        if(first < 0.0 || previous < 0.0 || current < 0.0 || current >= mesh.mPositions.size() ||
+                           first >= mesh.mPositions.size() || previous >= mesh.mPositions.size())
+                           valid = false;
+                        *(indices++) = uint32_t(first);
+                        *(indices++) = uint32_t(previous);
+                        *(indices++) = uint32_t(current);
+                        previous = current;
+                     }
+                     position += elementSize;
+                  }
+               });
+               if(!valid) {
+                  printf("%s: face index out of range!\n", filename);
+                  return false;
+               }
+            }
+            reader.consume(offset);
+            done += number;
+         }
       } else {
-         scattered = Ray(record.point - cEpsilon*normal, refracted);
+         // other elements without lists are skipped
+         uint64_t left = element.mCount * element.mStride;
+         while(left > 0) {
+            if(!reader.require(1)) {
+               printf("%s: file ends in the %s elements!\n", filename, element.mName);
+               return false;
+            }
+            size_t skip = std::min(uint64_t(reader.available()), left);
+            reader.consume(skip);
+            left -= skip;
+         }
       }
-      return true;
    }
+   return true;
+}
 
-   float mRefIndex;
-};
-
-class DiffuseLight : public Material {
-public:
-   DiffuseLight(Texture *tex)
-      : mEmit(tex)
-   {}
-   ~DiffuseLight() {
-      delete mEmit;
+// reads an obj or binary ply file by its extension and reports the load throughput
+bool loadMesh(const char *filename, JobSystem *jobSystem, MeshData &mesh) {
+   const char *extension = strrchr(filename, '.');
+   bool isOBJ = extension != nullptr && (strcmp(extension, ".obj") == 0 || strcmp(extension, ".OBJ") == 0);
+   bool isPLY = extension != nullptr && (strcmp(extension, ".ply") == 0 || strcmp(extension, ".PLY") == 0);
+   if(!isOBJ && !isPLY) {
+      printf("%s: only obj and ply meshes are supported!\n", filename);
+      return false;
    }
-
-   bool scatter(Ray &rayIn, HitRecord &record, vector3f &attenuation, Ray &scattered) {
+   FILE *file = fopen(filename, "rb");
+   if(file == nullptr) {
+      printf("can't open mesh %s!\n", filename);
       return false;
    }
-   vector3f emitted(float u, float v, vector3f &point) {
-      return mEmit->getTexel(u, v, point);
+   std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+   mesh = MeshData();
+   ChunkReader reader(file);
+   bool loaded = isOBJ ? loadOBJ(filename, jobSystem, mesh, reader) : loadPLY(filename, jobSystem, mesh, reader);
+   fclose(file);
+   if(!loaded)
+      return false;
+   if(mesh.mIndices.empty()) {
+      printf("%s: no triangles!\n", filename);
+      return false;
    }
+   double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+   double megabytes = reader.bytesRead() / (1024.0*1024.0);
+   uint64_t triangles = mesh.mIndices.size() / 3;
+   printf("loaded %s: %lu vertices, %llu triangles%s%s, %.1f MB in %.0f ms, %.1f MB/s, %.2f M triangles/s\n", filename,
+      mesh.mPositions.size(), (unsigned long long)triangles, mesh.mNormals.empty() ? "" : ", normals", mesh.mUVs.empty() ? "" : ", uvs",
+      megabytes, seconds*1000.0, seconds > 0.0 ? megabytes / seconds : 0.0, seconds > 0.0 ? triangles / seconds * 1e-6 : 0.0);
+   return true;
+}
 
-   Texture *mEmit;
+// ================================================================================
+
+// native mesh files hold the arrays of a TriangleMesh the way they are laid out in memory, so
+// the renderer maps the array file and uses its pages as the mesh buffers without copying them.
+// the header carries a checksum of the arrays. -convertmesh writes them from obj and ply files.
+
+const char cMeshFileMagic[8] = { 'L', 'Y', 'R', 'M', 'E', 'S', 'H', '\0' };
+const uint32_t cMeshFileVersion = 1;
+
+enum MeshArray { MESH_POSITIONS, MESH_INDICES, MESH_NORMALS, MESH_UVS, NUMBER_MESH_ARRAYS };
+
+struct MeshFileHeader {
+   ArrayFileHeader mFile;
+   uint32_t mHeaderSize;
+   uint64_t mNumberVertices;
+   uint64_t mNumberIndices;
+   uint64_t mOffsets[NUMBER_MESH_ARRAYS];    //file offsets of the arrays
+   uint64_t mSizes[NUMBER_MESH_ARRAYS];      //in bytes, 0 for missing normals and uvs
+   uint64_t mChecksum;
+   uint64_t mPad[3];
 };
 
-// ================================================================================
+static_assert(sizeof(MeshFileHeader) == 128, "MeshFileHeader should be 128 bytes");
 
-class Sphere : public Hitable {
-public:
-   Sphere(vector3f center, float radius, Material *material)
-      : mCenter(center)
-      , mRadius(radius)
-      , mMaterial(material)
-   {}
-   ~Sphere() {
-      delete mMaterial;
+// hashes of blocks of cMeshRangeSize bytes are computed as jobs and then hashed in order,
+// so checking a large file runs on all workers
+uint64_t checksumMeshArrays(const char *const *arrays, const uint64_t *sizes, JobSystem *jobSystem) {
+   std::vector<uint64_t> firstBlock(NUMBER_MESH_ARRAYS+1, 0);
+   for(int a=0; a<NUMBER_MESH_ARRAYS; ++a) {
+      firstBlock[a+1] = firstBlock[a] + (sizes[a] + cMeshRangeSize - 1) / cMeshRangeSize;
    }
-   void getSphereUV(vector3f p, float &u, float &v) {
-      float phi = atan2(p[2], p[0]);
-      float theta = asin(p[1]);
-      u = 1.0f - (phi+M_PI) / (2*M_PI);
-      v = (theta+M_PI/2.0f) / M_PI;
+   std::vector<uint64_t> hashes(firstBlock[NUMBER_MESH_ARRAYS]);
+   parallelFor(jobSystem, 0, hashes.size(), 1, [&](uint32_t block, uint32_t, uint32_t) {
+      int a = std::upper_bound(firstBlock.begin(), firstBlock.end(), block) - firstBlock.begin() - 1;
+      uint64_t begin = (block - firstBlock[a]) * cMeshRangeSize;
+      uint64_t size = std::min(uint64_t(cMeshRangeSize), sizes[a] - begin);
+      hashes[block] = hashWords(0xcbf29ce484222325ull, arrays[a] + begin, size);
+   });
+   return hashWords(0xcbf29ce484222325ull, hashes.data(), hashes.size()*sizeof(uint64_t));
+}
+
+bool saveMeshFile(const char *filename, const MeshData &mesh, JobSystem *jobSystem) {
+   MeshFileHeader header;
+   memset(&header, 0, sizeof(header));
+   initArrayFileHeader(header.mFile, cMeshFileMagic, cMeshFileVersion);
+   header.mHeaderSize = sizeof(header);
+   header.mNumberVertices = mesh.mPositions.size();
+   header.mNumberIndices = mesh.mIndices.size();
+   const char *arrays[NUMBER_MESH_ARRAYS] = { (const char*)mesh.mPositions.data(), (const char*)mesh.mIndices.data(),
+                                              (const char*)mesh.mNormals.data(), (const char*)mesh.mUVs.data() };
+   header.mSizes[MESH_POSITIONS] = mesh.mPositions.size()*sizeof(vector3f);
+   header.mSizes[MESH_INDICES] = mesh.mIndices.size()*sizeof(uint32_t);
+   header.mSizes[MESH_NORMALS] = mesh.mNormals.size()*sizeof(vector3f);
+   header.mSizes[MESH_UVS] = mesh.mUVs.size()*sizeof(vector2f);
+   layoutArrayFile(sizeof(header), header.mSizes, NUMBER_MESH_ARRAYS, header.mOffsets);
+   header.mChecksum = checksumMeshArrays(arrays, header.mSizes, jobSystem);
+   return writeArrayFile(filename, &header, sizeof(header), arrays, header.mOffsets, header.mSizes, NUMBER_MESH_ARRAYS);
+}
+
+// returns nullptr if the file isn't a mesh file of this version or its checksum doesn't match
+TriangleMesh *loadMeshFile(const char *filename, JobSystem *jobSystem, Material *material) {
+   std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+   MappedFile *file = mapArrayFile(filename, sizeof(MeshFileHeader));
+   if(file == nullptr) {
+      printf("can't map mesh %s!\n", filename);
+      return nullptr;
    }
-   bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
-      vector3f oc = ray.mOrigin - mCenter;
-      float a = dot(ray.mDirection, ray.mDirection);
-      float b = dot(oc, ray.mDirection);
-      float c = dot(oc, oc) - mRadius*mRadius;
-      float discriminant = b*b - a*c;
-      if(discriminant > 0) {
-         float temp = (-b - sqrt(b*b-a*c))/a;
-         if(temp < timeMax && temp > timeMin) {
-            record.time = temp;
-            record.point = ray.pointAtParameter(temp);
-            record.normal = (record.point - mCenter) / mRadius;
-            getSphereUV((record.point - mCenter) / mRadius, record.u, record.v);
-            record.material = mMaterial;
-            return true;
-         }
-         temp = (-b + sqrt(b*b-a*c))/a;
-         if(temp < timeMax && temp > timeMin) {
-            record.time = temp;
-            record.point = ray.pointAtParameter(temp);
-            record.normal = (record.point - mCenter) / mRadius;
-            getSphereUV((record.point - mCenter) / mRadius, record.u, record.v);
-            record.material = mMaterial;
-            return true;
-         }
-      }
-      return false;
+   char *data = (char*)file->mData;
+   const MeshFileHeader &header = *(const MeshFileHeader*)data;
+   uint64_t numberVertices = header.mNumberVertices;
+   bool valid = header.mHeaderSize == sizeof(MeshFileHeader)
+      && numberVertices <= file->mSize
+      && header.mNumberIndices % 3 == 0 && header.mNumberIndices <= UINT32_MAX
+      && header.mSizes[MESH_POSITIONS] == numberVertices*sizeof(vector3f)
+      && header.mSizes[MESH_INDICES] == header.mNumberIndices*sizeof(uint32_t)
+      && (header.mSizes[MESH_NORMALS] == 0 || header.mSizes[MESH_NORMALS] == numberVertices*sizeof(vector3f))
+      && (header.mSizes[MESH_UVS] == 0 || header.mSizes[MESH_UVS] == numberVertices*sizeof(vector2f))
+      && validArrayFile(*file, cMeshFileMagic, cMeshFileVersion, sizeof(header), header.mOffsets, header.mSizes, NUMBER_MESH_ARRAYS);
+   const char *arrays[NUMBER_MESH_ARRAYS];
+   for(int a=0; a<NUMBER_MESH_ARRAYS && valid; ++a) {
+      arrays[a] = data + header.mOffsets[a];
    }
-
-   bool boundingBox(float t0, float t1, AABB &aabb) {
-      aabb = AABB(mCenter - vector3f(mRadius, mRadius, mRadius), mCenter + vector3f(mRadius, mRadius, mRadius));
-      return true;
+   if(!valid || checksumMeshArrays(arrays, header.mSizes, jobSystem) != header.mChecksum) {
+      printf("%s isn't a valid mesh file!\n", filename);
+      delete file;
+      return nullptr;
+   }
+   // the checksum only finds corruption, indices of another writer could still point past the positions
+   const uint32_t *indices = (const uint32_t*)arrays[MESH_INDICES];
+   std::atomic<bool> inRange(true);
+   parallelFor(jobSystem, 0, uint32_t(header.mNumberIndices), cMeshRangeSize / sizeof(uint32_t), [&](uint32_t chunk, uint32_t begin, uint32_t end) {
+      uint32_t maximum = 0;
+      for(uint32_t i=begin; i<end; ++i) {
+         maximum = std::max(maximum, indices[i]);
+      }
+      if(begin < end && maximum >= numberVertices)
+         inRange = false;
+   });
+   if(!inRange) {
+      printf("%s has indices outside of its %llu vertices!\n", filename, (unsigned long long)numberVertices);
+      delete file;
+      return nullptr;
    }
+   double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+   printf("mapped %s: %llu vertices, %llu triangles%s%s, %.1f MB checked in %.0f ms\n", filename, (unsigned long long)numberVertices,
+      (unsigned long long)(header.mNumberIndices / 3), header.mSizes[MESH_NORMALS] > 0 ? ", normals" : "",
+      header.mSizes[MESH_UVS] > 0 ? ", uvs" : "", file->mSize / (1024.0*1024.0), seconds*1000.0);
+   return new TriangleMesh(file, (vector3f*)(data + header.mOffsets[MESH_POSITIONS]), numberVertices,
+      (uint32_t*)(data + header.mOffsets[MESH_INDICES]), header.mNumberIndices,
+      header.mSizes[MESH_NORMALS] > 0 ? (vector3f*)(data + header.mOffsets[MESH_NORMALS]) : nullptr,
+      header.mSizes[MESH_UVS] > 0 ? (vector2f*)(data + header.mOffsets[MESH_UVS]) : nullptr, material);
+}
 
-private:
-   vector3f mCenter;
-   float mRadius;
-   Material *mMaterial;
-};
+// ================================================================================
 
-class XYRect : public Hitable {
+// places a shared object, usually the bvh of a model, with a transform. rays are moved into
+// object space on entry, so every placement only costs its matrices and bounds while the
+// geometry is stored once. the object isn't owned by the instance. a hit record keeps a single
+// instance and the primitive hit inside it, so instances can't be nested.
+class Instance : public Hitable {
 public:
-   XYRect() {}
-   XYRect(float x0, float x1, float y0, float y1, float k, Material *material, bool flipNormal = false)
-      : mX0(x0)
-      , mX1(x1)
-      , mY0(y0)
-      , mY1(y1)
-      , mK(k)
-      , mMaterial(material)
-      , mFlipNormal(flipNormal)
-   {}
-   ~XYRect() {
-      delete mMaterial;
+   Instance(Hitable *object, const matrix44f &transform)
+      : mObject(object)
+      , mTransform(transform)
+      , mInverse(inverse(transform))
+   {
+      if(containsInstance(object)) {
+         printf("instances can't contain instances!\n");
+         exit(-1);
+      }
+      mNormalTransform = transpose(mInverse);
+      AABB box;
+      mBox.reset();
+      if(mObject->boundingBox(0.0f, 0.0f, box)) {
+         for(int corner=0; corner<8; ++corner) {
+            vector3f point((corner & 1) ? box.mMax[0] : box.mMin[0],
+                           (corner & 2) ? box.mMax[1] : box.mMin[1],
+                           (corner & 4) ? box.mMax[2] : box.mMin[2]);
+            mBox.extend(transform_point(mTransform, point));
+         }
+      }
    }
+
+   // the object space ray is normalized again, so its distances are scaled by the length
+   // of the transformed direction and have to be scaled back for the world space record
    bool hit(Ray &ray, float timeMin, float timeMax, HitRecord &record) {
-      float t = (mK - ray.mOrigin[2]) / ray.mDirection[2];
-      if(t < timeMin || t > timeMax)
-         return false;
-      float x = ray.mOrigin[0] + t * ray.mDirection[0];
-      float y = ray.mOrigin[1] + t * ray.mDirection[1];
-      if(x < mX0 || x > mX1 || y < mY0 || y > mY1)
+      vector3f direction = transform_vector(mInverse, ray.mDirection);
+      float scale = direction.length();
+      Ray objectRay(transform_point(mInverse, ray.mOrigin), direction, ray.mTime);
+      if(!mObject->hit(objectRay, timeMin*scale, timeMax*scale, record))
          return false;
-      record.u = (x - mX0) / (mX1-mX0);
-      record.v = (y - mY0) / (mY1-mY0);
-      record.time = t;
-      record.material = mMaterial;
-      record.point = ray.pointAtParameter(t);
-      if(mFlipNormal)
-         record.normal = vector3f(0.0f, 0.0f, -1.0f);
-      else
-         record.normal = vector3f(0.0f, 0.0f, 1.0f);
-
+      record.time /= scale;
+      record.instanced = record.object;
+      record.object = this;
       return true;
    }
+   // the primitive finalizes its hit in object space, then point and normal are moved back
+   void finalizeHit(const Ray &ray, HitRecord &record) {
+      vector3f direction = transform_vector(mInverse, ray.mDirection);
+      float scale = direction.length();
+      Ray objectRay(transform_point(mInverse, ray.mOrigin), direction, ray.mTime);
+      float time = record.time;
+      record.time = time*scale;
+      record.instanced->finalizeHit(objectRay, record);
+      record.time = time;
+      record.point = ray.pointAtParameter(time);
+      record.normal = transform_vector(mNormalTransform, record.normal);
+      record.normal.normalize();
+   }
+   bool occluded(Ray &ray, float timeMin, float timeMax) {
+      vector3f direction = transform_vector(mInverse, ray.mDirection);
+      float scale = direction.length();
+      Ray objectRay(transform_point(mInverse, ray.mOrigin), direction, ray.mTime);
+      return mObject->occluded(objectRay, timeMin*scale, timeMax*scale);
+   }
    bool boundingBox(float t0, float t1, AABB &aabb) {
-      aabb = AABB(vector3f(mX0, mY0, mK-0.0001f), vector3f(mX1, mY1, mK+0.0001f));
+      aabb = mBox;
       return true;
    }
 
-   Material *mMaterial;
-   float mX0, mX1, mY0, mY1, mK;
-   bool mFlipNormal;
+   // models are instanced as a LinearBVH of their primitives, see buildModelBVH
+   static bool containsInstance(Hitable *object) {
+      if(dynamic_cast<Instance*>(object) != nullptr)
+         return true;
+      if(LinearBVH *bvh = dynamic_cast<LinearBVH*>(object)) {
+         for(size_t i=0; i<bvh->mIndices.size(); ++i) {
+            if(dynamic_cast<Instance*>(bvh->mList[bvh->mIndices[i]]) != nullptr)
+               return true;
+         }
+      }
+      return false;
+   }
+
+   Hitable *mObject;
+   matrix44f mTransform;
+   matrix44f mInverse;
+   matrix44f mNormalTransform;          //inverse transpose for the normals
+   AABB mBox;                           //world space bounds of the transformed object bounds
 };
 
+// bottom level bvh over the primitives of a model, shared by all instances of it
+LinearBVH *buildModelBVH(Hitable **list, int size) {
+   std::vector<PrimitiveRef> refs;
+   computePrimitiveRefs(list, size, 0.0f, 0.0f, nullptr, refs);
+   LinearBVHNodeArray nodes;
+   std::vector<uint32_t> indices;
+   SAHBuilder builder((SAHSettings()));
+   builder.build(refs, nodes, indices);
+   LinearBVH *bvh = new LinearBVH(list, nodes, indices);
+   if(cTypeSortedGeometry)
+      bvh->sortGeometry();
+   return bvh;
+}
+
 // ================================================================================
 
 // Plastic Low Discrepancy Sequence
@@ -628,11 +6098,11 @@ vector2f plastic(double index) {       //returns vector in [0..1[
 
 // ================================================================================
 
-vector3f computeColor(Ray& ray, Hitable *gWorld, int depth) {
-   statistics.numberRays += 1;
+vector3f computeColor(Ray& ray, Hitable *gWorld, int depth);
 
-   HitRecord record;
-   if(gWorld->hit(ray, 0.001f, MAXFLOAT, record)) {
+// color of a ray whose closest hit is already known
+vector3f shadeHit(Ray &ray, bool hit, HitRecord &record, Hitable *gWorld, int depth) {
+   if(hit) {
       Ray scattered;
       vector3f attenuation;
       vector3f emitted = record.material->emitted(record.u, record.v, record.point);
@@ -648,6 +6118,16 @@ vector3f computeColor(Ray& ray, Hitable *gWorld, int depth) {
    }
 }
 
+vector3f computeColor(Ray& ray, Hitable *gWorld, int depth) {
+   HitRecord record;
+   tCurrentRay = RayCounters();
+   bool hit = gWorld->hit(ray, 0.001f, MAXFLOAT, record);
+   tRayStatistics[depth == 0 ? RAY_PRIMARY : RAY_SECONDARY].add(tCurrentRay);
+   if(hit)
+      record.object->finalizeHit(ray, record);
+   return shadeHit(ray, hit, record, gWorld, depth);
+}
+
 inline vector3f deNAN(const vector3f &c) {
    vector3f temp = c;
    if(!(temp[0] == temp[0])) temp[0] = 1.0f;
@@ -664,6 +6144,20 @@ typedef struct {
 int gNumberSamples;
 Camera *gCamera;
 Hitable *gWorld;
+float gBuildSAHCost;                   //sah cost of gWorld right after it was built
+BVHReport gBuildReport;                //shape of gWorld right after it was built
+double gMegaRaysPerSecond;             //of the last rendering
+double gBuildMilliseconds;             //of the last build, primitive references included
+
+uint32_t packColor(const vector3f &color) {
+   vector3f gamma(sqrt(color[0]), sqrt(color[1]), sqrt(color[2]));       //gamma correct
+
+   int ir = int(255.99 * gamma[0]);
+   int ig = int(255.99 * gamma[1]);
+   int ib = int(255.99 * gamma[2]);
+
+   return (0xff000000) | (ib<<16) | (ig<<8) | ir;
+}
 
 void renderLine(void *data) {
    JobDescription *descr = (JobDescription*)data;
@@ -685,19 +6179,63 @@ void renderLine(void *data) {
          color += deNAN(computeColor(ray, gWorld, 0));
       }
       color /= float(gNumberSamples);
+      *(dstFrameBuffer++) = packColor(color);
+   }
+   statistics.merge(tRayStatistics);
+}
 
-      color = vector3f(sqrt(color[0]), sqrt(color[1]), sqrt(color[2]));       //gamma correct
-
-      int ir = int(255.99 * color[0]);
-      int ig = int(255.99 * color[1]);
-      int ib = int(255.99 * color[2]);
+// renders the cPacketWidth lines starting at descr->line in blocks of cPacketWidth pixels. every
+// sample traces the primary rays of a block as one packet, the bounces are traced one by one
+void renderPacketLines(void *data) {
+   JobDescription *descr = (JobDescription*)data;
+   int numberLines = std::min(cPacketWidth, cNY - int(descr->line));
 
-      *(dstFrameBuffer++) = (0xff000000) | (ib<<16) | (ig<<8) | ir;
+   for(int x0=0; x0<cNX; x0+=cPacketWidth) {
+      int numberColumns = std::min(cPacketWidth, cNX - x0);
+      int numberRays = numberLines * numberColumns;
+      vector3f colors[cPacketSize];
+      Ray rays[cPacketSize];
+      HitRecord records[cPacketSize];
+      RayPacket packet;
+      for(int i=0; i<numberRays; ++i) {
+         colors[i] = vector3f(0.0f, 0.0f, 0.0f);
+      }
+      for(int sample=0; sample<gNumberSamples; ++sample) {
+         for(int i=0; i<numberRays; ++i) {
+            static double plasticIndex = 1;
+            vector2f p(plastic(plasticIndex));
+            ++plasticIndex;
+            float u = (float(x0 + i % numberColumns) + p[0]) / float(cNX);
+            float v = (float(cNY - int(descr->line) - i / numberColumns) + p[1]) / float(cNY);
+            rays[i] = gCamera->getRay(u, v);
+         }
+         if(!packet.init(rays, records, numberRays, MAXFLOAT)) {
+            for(int i=0; i<numberRays; ++i) {
+               colors[i] += deNAN(computeColor(rays[i], gWorld, 0));
+            }
+            continue;
+         }
+         gWorld->hitPacket(packet, packet.allRays(), 0.001f);
+         for(int i=0; i<numberRays; ++i) {
+            RayCounters counters = { packet.mNodesVisited[i], packet.mPrimitivesTested[i], 0, 0 };
+            tRayStatistics[RAY_PRIMARY].add(counters);
+            bool hit = (packet.mHit >> i) & 1;
+            if(hit)
+               records[i].object->finalizeHit(rays[i], records[i]);
+            colors[i] += deNAN(shadeHit(rays[i], hit, records[i], gWorld, 0));
+         }
+      }
+      for(int i=0; i<numberRays; ++i) {
+         int y = descr->line + i / numberColumns;
+         descr->framebuffer[y * cNX + x0 + i % numberColumns] = packColor(colors[i] / float(gNumberSamples));
+      }
    }
+   statistics.merge(tRayStatistics);
 }
 
-int main() {
-   Hitable *list[6];
+Hitable **materialsScene(int &size) {
+   size = 6;
+   Hitable **list = new Hitable*[size];
    list[0] = new Sphere(vector3f(0.0f, 0.0f, -1.0f), 0.5f, new Lambertian(new ConstantTexture(vector3f(0.1f, 0.2f, 0.5f))));
    list[1] = new Sphere(vector3f(0.0f, -100.5f, -1.0f), 100.0f, new Lambertian(
       new CheckerTexture(new ConstantTexture(vector3f(0.2f, 0.3f, 0.1f)), new ConstantTexture(vector3f(0.9f,0.9f,0.9f)))));
@@ -706,56 +6244,652 @@ int main() {
    list[4] = new Sphere(vector3f(-1.0f, 0.0f, -1.0f), -0.45f, new Dielectric(1.5f));
 
    list[5] = new XYRect(3,5,1,3,-2,new DiffuseLight(new ConstantTexture(vector3f(4,4,4))));
-   gWorld = new HitableList(list, sizeof(list)/sizeof(list[0]));
+   return list;
+}
 
-   uint32_t *framebuffer = new uint32_t[cNX*cNY];
+// final scene of "ray tracing in one weekend", gridSize*gridSize small spheres on a ground sphere
+Hitable **randomSpheresScene(int gridSize, int &size) {
+   Hitable **list = new Hitable*[gridSize*gridSize + 4];
+   size = 0;
+   float groundRadius = 1000.0f * ffmax(1.0f, gridSize / 22.0f);
+   list[size++] = new Sphere(vector3f(0.0f, -groundRadius, 0.0f), groundRadius, new Lambertian(
+      new CheckerTexture(new ConstantTexture(vector3f(0.2f, 0.3f, 0.1f)), new ConstantTexture(vector3f(0.9f,0.9f,0.9f)))));
+   for(int a=-gridSize/2; a<gridSize-gridSize/2; ++a) {
+      for(int b=-gridSize/2; b<gridSize-gridSize/2; ++b) {
+         float chooseMaterial = rnd.randomf();
+         vector3f center(a + 0.9f*rnd.randomf(), 0.2f, b + 0.9f*rnd.randomf());
+         if(chooseMaterial < 0.8f) {
+            Material *material = new Lambertian(new ConstantTexture(
+               vector3f(rnd.randomf()*rnd.randomf(), rnd.randomf()*rnd.randomf(), rnd.randomf()*rnd.randomf())));
+            if(cMotionBlur)
+               list[size++] = new MovingSphere(center, center + vector3f(0.0f, 0.5f*rnd.randomf(), 0.0f), cShutterOpen, cShutterClose, 0.2f, material);
+            else
+               list[size++] = new Sphere(center, 0.2f, material);
+         } else if(chooseMaterial < 0.95f) {
+            list[size++] = new Sphere(center, 0.2f, new Metal(
+               vector3f(0.5f*(1.0f+rnd.randomf()), 0.5f*(1.0f+rnd.randomf()), 0.5f*(1.0f+rnd.randomf())), 0.5f*rnd.randomf()));
+         } else {
+            list[size++] = new Sphere(center, 0.2f, new Dielectric(1.5f));
+         }
+      }
+   }
+   list[size++] = new Sphere(vector3f(0.0f, 1.0f, 0.0f), 1.0f, new Dielectric(1.5f));
+   list[size++] = new Sphere(vector3f(-4.0f, 1.0f, 0.0f), 1.0f, new Lambertian(new ConstantTexture(vector3f(0.4f, 0.2f, 0.1f))));
+   list[size++] = new Sphere(vector3f(4.0f, 1.0f, 0.0f), 1.0f, new Metal(vector3f(0.7f, 0.6f, 0.5f), 0.0f));
+   return list;
+}
 
-   vector3f lookFrom(3.0f, 3.0f, 2.0f);
-   vector3f lookAt(0.0f, 0.0f, -1.0f);
-   float distanceToFocus = (lookFrom - lookAt).length();
-   float aperture = 0.1f;
-   gCamera = new Camera(lookFrom, lookAt, vector3f(0,1,0), 20, float(cNX)/float(cNY), aperture, distanceToFocus);
+// grid of instances of one sphere cluster model with random rotations and sizes. the top level
+// bvh is built over the instances, the model bvh exists once
+Hitable **instancesScene(int gridSize, int &size) {
+   const int numberModelSpheres = 64;
+   Hitable **model = new Hitable*[numberModelSpheres];
+   for(int i=0; i<numberModelSpheres; ++i) {
+      vector3f center;
+      do {
+         center = 2.0f*vector3f(rnd.randomf(), rnd.randomf(), rnd.randomf()) - vector3f(1.0f, 1.0f, 1.0f);
+      } while(dot(center, center) >= 1.0f);
+      vector3f albedo(rnd.randomf()*rnd.randomf(), rnd.randomf()*rnd.randomf(), rnd.randomf()*rnd.randomf());
+      if(rnd.randomf() < 0.8f)
+         model[i] = new Sphere(center, 0.2f, new Lambertian(new ConstantTexture(albedo)));
+      else
+         model[i] = new Sphere(center, 0.2f, new Metal(vector3f(0.5f, 0.5f, 0.5f) + 0.5f*albedo, 0.2f));
+   }
+   LinearBVH *modelBVH = buildModelBVH(model, numberModelSpheres);
+
+   Hitable **list = new Hitable*[gridSize*gridSize + 1];
+   size = 0;
+   float groundRadius = 1000.0f * ffmax(1.0f, gridSize / 22.0f);
+   list[size++] = new Sphere(vector3f(0.0f, -groundRadius, 0.0f), groundRadius, new Lambertian(
+      new CheckerTexture(new ConstantTexture(vector3f(0.2f, 0.3f, 0.1f)), new ConstantTexture(vector3f(0.9f,0.9f,0.9f)))));
+   for(int a=-gridSize/2; a<gridSize-gridSize/2; ++a) {
+      for(int b=-gridSize/2; b<gridSize-gridSize/2; ++b) {
+         float scale = 0.2f + 0.2f*rnd.randomf();
+         matrix44f translation, rotation, scaling;
+         matrix_translation(translation, vector3f(a + 0.5f + 0.4f*rnd.randomf(), 1.2f*scale, b + 0.5f + 0.4f*rnd.randomf()));
+         matrix_rotation_axis_angle(rotation, vector3f(0.0f, 1.0f, 0.0f), float(2.0*M_PI*rnd.randomf()));
+         matrix_uniform_scale(scaling, scale);
+         list[size++] = new Instance(modelBVH, translation*rotation*scaling);
+      }
+   }
+   printf("instances scene: %d instances (%lu bytes each) of a model with %d spheres (%lu bytes bvh)\n", size-1, sizeof(Instance),
+      numberModelSpheres, modelBVH->mNodes.size()*sizeof(LinearBVHNode) + modelBVH->mIndices.size()*sizeof(uint32_t));
+   return list;
+}
+
+// three tori of rings*sides quads lying on the ground, or the mesh of cMeshFile scaled to a size
+// of 3 and standing on the ground
+Hitable **meshesScene(int tessellation, JobSystem *jobSystem, int &size) {
+   Hitable **list = new Hitable*[4];
+   size = 0;
+   list[size++] = new Sphere(vector3f(0.0f, -1000.0f, 0.0f), 1000.0f, new Lambertian(
+      new CheckerTexture(new ConstantTexture(vector3f(0.2f, 0.3f, 0.1f)), new ConstantTexture(vector3f(0.9f,0.9f,0.9f)))));
+   if(cMeshFile != nullptr) {
+      // native mesh files are used in place, so the mesh is fitted by an instance instead of
+      // moving its vertices
+      Material *material = new Lambertian(new ConstantTexture(vector3f(0.6f, 0.5f, 0.4f)));
+      const char *extension = strrchr(cMeshFile, '.');
+      TriangleMesh *mesh = nullptr;
+      if(extension != nullptr && strcmp(extension, ".lyrmesh") == 0) {
+         mesh = loadMeshFile(cMeshFile, jobSystem, material);
+      } else {
+         MeshData data;
+         if(loadMesh(cMeshFile, jobSystem, data))
+            mesh = new TriangleMesh(data.mPositions, data.mIndices, data.mNormals, data.mUVs, material);
+      }
+      AABB box;
+      if(mesh == nullptr)
+         exit(-1);
+      if(!mesh->boundingBox(0.0f, 0.0f, box)) {
+         printf("meshes scene: no triangles in %s!\n", cMeshFile);
+         exit(-1);
+      }
+      vector3f extent = box.mMax - box.mMin;
+      matrix44f translation, scaling;
+      matrix_translation(translation, vector3f(-0.5f * (box.mMin[0] + box.mMax[0]), -box.mMin[1], -0.5f * (box.mMin[2] + box.mMax[2])));
+      matrix_uniform_scale(scaling, 3.0f / std::max(std::max(extent[0], extent[1]), std::max(extent[2], 1e-6f)));
+      list[size++] = new Instance(mesh, scaling*translation);
+      printf("meshes scene: %s with %u triangles\n", cMeshFile, mesh->numberTriangles());
+      return list;
+   }
+   int rings = 4*tessellation, sides = 2*tessellation;
+   list[size++] = torusMesh(vector3f(0.0f, 0.4f, 0.0f), 1.2f, 0.4f, rings, sides, new Dielectric(1.5f));
+   list[size++] = torusMesh(vector3f(0.0f, 0.35f, -3.0f), 1.0f, 0.35f, rings, sides,
+      new Lambertian(new ConstantTexture(vector3f(0.4f, 0.2f, 0.1f))));
+   list[size++] = torusMesh(vector3f(0.0f, 0.35f, 3.0f), 1.0f, 0.35f, rings, sides, new Metal(vector3f(0.7f, 0.6f, 0.5f), 0.0f));
+   printf("meshes scene: 3 tori of %u triangles\n", ((TriangleMesh*)list[1])->numberTriangles());
+   return list;
+}
 
-   statistics.numberRays = 0;
+// random walk of the small spheres on the ground, animates the scenes between frames
+void moveSpheres(Hitable **list, int size, float distance) {
+   for(int i=0; i<size; ++i) {
+      Sphere *sphere = dynamic_cast<Sphere*>(list[i]);
+      if(sphere != nullptr && sphere->radius() < 0.5f)
+         sphere->move(distance * vector3f(2.0f*rnd.randomf() - 1.0f, 0.0f, 2.0f*rnd.randomf() - 1.0f));
+   }
+}
 
-   JobSystem jobSystem( 4, 65536 );
-   Job *fenceJob = jobSystem.CreateEmptyJob();
-   JobDescription *descriptions = new JobDescription[cNY];
+void reportWorld(Hitable *world, const SAHSettings &settings, BVHReport &report) {
+   report = BVHReport();
+   if(BVHNode *node = dynamic_cast<BVHNode*>(world)) {
+      report.mType = "bvhnode";
+      reportBVHNode(node, 0, report);
+      AABB box;
+      node->boundingBox(0.0f, 0.0f, box);
+      report.finish(box, settings);
+   } else if(LinearBVH *bvh = dynamic_cast<LinearBVH*>(world)) {
+      bvh->report(settings, report);
+   } else if(WideBVH<4> *wide = dynamic_cast<WideBVH<4>*>(world)) {
+      wide->report(settings, report);
+   } else if(WideBVH<8> *wide8 = dynamic_cast<WideBVH<8>*>(world)) {
+      wide8->report(settings, report);
+   } else if(WideBVH<4, true> *quantized = dynamic_cast<WideBVH<4, true>*>(world)) {
+      quantized->report(settings, report);
+   } else if(WideBVH<8, true> *quantized8 = dynamic_cast<WideBVH<8, true>*>(world)) {
+      quantized8->report(settings, report);
+   } else if(UniformGrid *grid = dynamic_cast<UniformGrid*>(world)) {
+      grid->report(settings, report);
+   } else if(KdTree *tree = dynamic_cast<KdTree*>(world)) {
+      tree->report(settings, report);
+   }
+}
+
+// replaces the binary bvh by one with N children per node
+template<int N, bool Quantized>
+Hitable *collapseWorld(LinearBVH *bvh, const SAHSettings &settings) {
+   WideBVH<N, Quantized> *wide = new WideBVH<N, Quantized>(*bvh);
+   float megabytes = wide->mNodes.size() / (1024.0f*1024.0f);
+   printf("collapsed to bvh%d%s%s: %lu nodes, %.2f MB", N, N == 8 && gUseAVX2 ? " (avx2)" : "", Quantized ? " quantized" : "",
+      wide->mNodes.size(), megabytes*sizeof(typename WideBVH<N, Quantized>::Node));
+   if(Quantized)
+      printf(" (%.2f MB uncompressed)", megabytes*sizeof(WideBVHNode<N>));
+   printf("\n");
+   gBuildSAHCost = wide->sahCost(settings);
+   delete bvh;
+   return wide;
+}
 
-//   int testgNumberSamples[] = {1,10,20,30,50,100};
-   int testgNumberSamples[] = {30};
-   for(int currentSample = 0; currentSample < sizeof(testgNumberSamples)/sizeof(int); ++currentSample) {
-      gNumberSamples = testgNumberSamples[currentSample];
+// settings of the scene bvh. a batch of spheres costs about two single sphere tests, so leaves
+// may grow up to a full batch when most primitives are spheres
+SAHSettings worldSAHSettings(Hitable **list, int size) {
+   SAHSettings settings;
+   if(cTypeSortedGeometry && cSphereBatches && cBVHWidth == 2) {
+      int numberSpheres = 0;
+      for(int i=0; i<size; ++i) {
+         numberSpheres += primitiveType(list[i]) == PRIMITIVE_SPHERE;
+      }
+      if(2*numberSpheres > size) {
+         settings.mMaxLeafSize = cSphereBatchSize;
+         settings.mIntersectionCost = 0.25f;
+      }
+   }
+   return settings;
+}
 
-      printf("rendering with %d samples...\n", gNumberSamples);
+Hitable *buildWorld(Hitable **list, int size, JobSystem *jobSystem) {
+   if(cBVHBuilder == BVH_NONE) {
+      gBuildReport = BVHReport();
+      return new HitableList(list, size);
+   }
 
-      std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+   SAHSettings sahSettings = worldSAHSettings(list, size);
+   Hitable *world;
+   float sahCost;
+   std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+   std::vector<PrimitiveRef> refs;
+   computePrimitiveRefs(list, size, cShutterOpen, cShutterClose, jobSystem, refs);
+   std::chrono::high_resolution_clock::time_point refsTime = std::chrono::high_resolution_clock::now();
+   std::chrono::high_resolution_clock::time_point buildTime;
+   printf("primitive references of %d primitives took %lu ms\n", size,
+      std::chrono::duration_cast<std::chrono::milliseconds>(refsTime - startTime).count());
 
-      for(int y=0; y<cNY; ++y) {
-         descriptions[y].framebuffer = framebuffer;
-         descriptions[y].line = y;
-         Job *job = jobSystem.CreateJobAsChild(renderLine, fenceJob, &descriptions[y]);
-         jobSystem.Run(job);
+   if(cBVHBuilder == BVH_MEDIAN) {
+      world = new BVHNode(list, refs.data(), size);
+      buildTime = std::chrono::high_resolution_clock::now();
+      sahCost = computeSAHCost(world, sahSettings);
+      gBuildSAHCost = sahCost;
+   } else if(cBVHBuilder == BVH_GRID) {
+      UniformGrid *grid = new UniformGrid(list, refs);
+      buildTime = std::chrono::high_resolution_clock::now();
+      printf("grid builder: %dx%dx%d cells, %lu references, %lu primitives outside\n", grid->mResolution[0], grid->mResolution[1],
+         grid->mResolution[2], grid->mIndices.size(), grid->mLarge.size());
+      sahCost = grid->sahCost(sahSettings);
+      gBuildSAHCost = sahCost;
+      world = grid;
+   } else if(cBVHBuilder == BVH_KDTREE) {
+      KdTree *tree = new KdTree(list, refs, sahSettings);
+      buildTime = std::chrono::high_resolution_clock::now();
+      printf("kdtree builder: %lu nodes, %lu references (%.1f%% duplicates)\n", tree->mNodes.size(), tree->mIndices.size(),
+         100.0f * (tree->mIndices.size() - size) / size);
+      sahCost = tree->sahCost(sahSettings);
+      gBuildSAHCost = sahCost;
+      world = tree;
+   } else {
+      LinearBVH *bvh = nullptr;
+      uint64_t sceneHash = 0;
+      char cacheFilename[64];
+      if(cBVHCache) {
+         sceneHash = hashScene(refs, cBVHBuilder, sahSettings, cMortonCodeBits, cNodeLayout);
+         snprintf(cacheFilename, sizeof(cacheFilename), "bvh_%016llx.cache", (unsigned long long)sceneHash);
+         bvh = loadBVHCache(cacheFilename, sceneHash, list, size);
+         if(bvh != nullptr)
+            printf("mapped bvh cache %s\n", cacheFilename);
+      }
+      if(bvh == nullptr) {
+         LinearBVHNodeArray nodes;
+         std::vector<uint32_t> indices;
+         if(cBVHBuilder == BVH_LBVH) {
+            LBVHBuilder builder(cMortonCodeBits, jobSystem);
+            builder.build(refs, nodes, indices);
+         } else if(cBVHBuilder == BVH_SBVH) {
+            SBVHBuilder builder(sahSettings);
+            builder.build(refs, nodes, indices);
+            printf("sbvh builder: %u spatial splits, %u references (%.1f%% duplicates)\n", builder.mNumberSpatialSplits,
+               builder.mNumberReferences, 100.0f * (builder.mNumberReferences - size) / size);
+         } else {
+            SAHBuilder builder(sahSettings, jobSystem);
+            builder.build(refs, nodes, indices);
+         }
+         if(cNodeLayout != LAYOUT_BUILD) {
+            std::chrono::high_resolution_clock::time_point reorderTime = std::chrono::high_resolution_clock::now();
+            reorderNodes(nodes, cNodeLayout);
+            printf("%s node layout took %lu ms\n", cNodeLayoutNames[cNodeLayout], std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::high_resolution_clock::now() - reorderTime).count());
+         }
+         bvh = new LinearBVH(list, nodes, indices);
+      }
+      buildTime = std::chrono::high_resolution_clock::now();
+      if(cBVHCache && bvh->mFile == nullptr && saveBVHCache(cacheFilename, sceneHash, *bvh))
+         printf("wrote bvh cache %s\n", cacheFilename);
+      printf("%s builder: %lu nodes, %.2f MB\n", cBVHBuilderNames[cBVHBuilder], bvh->mNodes.size(),
+         bvh->mNodes.size()*sizeof(LinearBVHNode) / (1024.0f*1024.0f));
+      sahCost = bvh->sahCost(sahSettings);
+      gBuildSAHCost = sahCost;
+      world = bvh;
+      if(cBVHWidth == 4 && cQuantizedNodes)
+         world = collapseWorld<4, true>(bvh, sahSettings);
+      else if(cBVHWidth == 4)
+         world = collapseWorld<4, false>(bvh, sahSettings);
+      else if(cBVHWidth == 8 && cQuantizedNodes)
+         world = collapseWorld<8, true>(bvh, sahSettings);
+      else if(cBVHWidth == 8)
+         world = collapseWorld<8, false>(bvh, sahSettings);
+      else if(cQuantizedNodes)
+         printf("quantized nodes need -width 4 or 8, keeping the binary bvh\n");
+      // the other structures keep the bounds over the whole shutter interval
+      if(world == bvh && cTypeSortedGeometry) {
+         bvh->sortGeometry();
+         printf("type sorted geometry: %lu spheres, %lu rects, %lu other hitables, %.2f MB\n",
+            bvh->mGeometry.mObjects[PRIMITIVE_SPHERE].size(), bvh->mGeometry.mObjects[PRIMITIVE_XYRECT].size(),
+            bvh->mGeometry.mObjects[PRIMITIVE_HITABLE].size(), bvh->mGeometry.memory() / (1024.0f*1024.0f));
       }
+      if(world == bvh && cMotionBlur) {
+         bvh->refitMotion(cShutterOpen, cShutterClose, jobSystem);
+         gBuildSAHCost = bvh->sahCost(sahSettings);
+         printf("bvh nodes store their bounds at shutter open and close, sah cost %.3f at shutter open\n", gBuildSAHCost);
+      }
+   }
 
-      jobSystem.Run(fenceJob);
-      jobSystem.Wait(fenceJob);
+   printf("bvh build (%s) of %d primitives took %lu ms, sah cost %.3f\n", cBVHBuilderNames[cBVHBuilder], size,
+      std::chrono::duration_cast<std::chrono::milliseconds>(buildTime - refsTime).count(), sahCost);
+   gBuildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+   reportWorld(world, sahSettings, gBuildReport);
+   gBuildReport.print();
+   return world;
+}
+
+// refits the bvh to the moved primitives, once the refit tree costs cRebuildThreshold times
+// what it did after the last build, a new one is built from scratch instead
+Hitable *updateWorld(Hitable *world, Hitable **list, int size, JobSystem *jobSystem) {
+   if(cBVHBuilder == BVH_NONE)
+      return world;
+   // the grid and the kd-tree can't be refit, moved primitives need a new one
+   if(cBVHBuilder == BVH_GRID || cBVHBuilder == BVH_KDTREE) {
+      delete world;
+      return buildWorld(list, size, jobSystem);
+   }
+
+   SAHSettings sahSettings = worldSAHSettings(list, size);
+   float sahCost;
+   std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+   if(BVHNode *node = dynamic_cast<BVHNode*>(world)) {
+      node->refit(cShutterOpen, cShutterClose);
+      sahCost = computeSAHCost(node, sahSettings);
+   } else if(LinearBVH *bvh = dynamic_cast<LinearBVH*>(world)) {
+      if(bvh->hasMotion())
+         bvh->refitMotion(cShutterOpen, cShutterClose, jobSystem);
+      else
+         bvh->refit(cShutterOpen, cShutterClose, jobSystem);
+      sahCost = bvh->sahCost(sahSettings);
+   } else if(WideBVH<4> *wide = dynamic_cast<WideBVH<4>*>(world)) {
+      wide->refit(cShutterOpen, cShutterClose, jobSystem);
+      sahCost = wide->sahCost(sahSettings);
+   } else if(WideBVH<8> *wide8 = dynamic_cast<WideBVH<8>*>(world)) {
+      wide8->refit(cShutterOpen, cShutterClose, jobSystem);
+      sahCost = wide8->sahCost(sahSettings);
+   } else if(WideBVH<4, true> *quantized = dynamic_cast<WideBVH<4, true>*>(world)) {
+      quantized->refit(cShutterOpen, cShutterClose, jobSystem);
+      sahCost = quantized->sahCost(sahSettings);
+   } else {
+      WideBVH<8, true> *quantized8 = (WideBVH<8, true>*)world;
+      quantized8->refit(cShutterOpen, cShutterClose, jobSystem);
+      sahCost = quantized8->sahCost(sahSettings);
+   }
+   std::chrono::high_resolution_clock::time_point refitTime = std::chrono::high_resolution_clock::now();
+   printf("bvh refit took %lu ms, sah cost %.5f (%.5f after build)\n",
+      std::chrono::duration_cast<std::chrono::milliseconds>(refitTime - startTime).count(), sahCost, gBuildSAHCost);
+
+   if(sahCost > cRebuildThreshold * gBuildSAHCost) {
+      printf("sah cost grew by more than %.2fx, rebuilding\n", cRebuildThreshold);
+      delete world;
+      world = buildWorld(list, size, jobSystem);
+   }
+   return world;
+}
+
+// renders gWorld with gNumberSamples samples per pixel into the framebuffer
+void renderImage(JobSystem &jobSystem, uint32_t *framebuffer, JobDescription *descriptions) {
+   printf("rendering with %d samples...\n", gNumberSamples);
+
+   uint64_t raysBefore = statistics.mRays[RAY_PRIMARY].mNumberRays + statistics.mRays[RAY_SECONDARY].mNumberRays;
+   std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+   // the fence can't be reused, its pending count stays at zero once it ran
+   Job *fenceJob = jobSystem.CreateEmptyJob();
+   int lineStep = cPacketTracing ? cPacketWidth : 1;
+   for(int y=0; y<cNY; y+=lineStep) {
+      descriptions[y].framebuffer = framebuffer;
+      descriptions[y].line = y;
+      Job *job = jobSystem.CreateJobAsChild(cPacketTracing ? renderPacketLines : renderLine, fenceJob, &descriptions[y]);
+      jobSystem.Run(job);
+   }
+
+   fenceJob->Execute();          //not queued like in parallelFor, a worker would delete the fence once it finished
+   jobSystem.Wait(fenceJob);
+   delete fenceJob;
+
+   std::chrono::high_resolution_clock::time_point raytraceTime = std::chrono::high_resolution_clock::now();
+
+   uint64_t rays = statistics.mRays[RAY_PRIMARY].mNumberRays + statistics.mRays[RAY_SECONDARY].mNumberRays - raysBefore;
+   double seconds = std::chrono::duration<double>(raytraceTime - startTime).count();
+   gMegaRaysPerSecond = seconds > 0.0 ? rays / seconds * 1e-6 : 0.0;
+   printf("raytracing with %d samples took %lu ms, %.2f Mrays/s\n", gNumberSamples,
+      std::chrono::duration_cast<std::chrono::milliseconds>(raytraceTime - startTime).count(), gMegaRaysPerSecond);
+}
 
-      std::chrono::high_resolution_clock::time_point raytraceTime = std::chrono::high_resolution_clock::now();
+// builds and renders the scene once with every builder. the statistics start over for each,
+// so the counts per ray belong to one acceleration structure
+void compareAccelerators(Hitable **list, int size, JobSystem &jobSystem, uint32_t *framebuffer, JobDescription *descriptions) {
+   const int builders[] = { BVH_MEDIAN, BVH_SAH, BVH_LBVH, BVH_SBVH, BVH_GRID, BVH_KDTREE };
+   const int numberBuilders = sizeof(builders)/sizeof(int);
+   struct Result {
+      double mBuildMilliseconds;
+      uint64_t mMemory;
+      double mMegaRaysPerSecond;
+      double mNodesVisited;         //per ray
+      double mPrimitivesTested;
+   } results[numberBuilders];
 
-      printf("raytracing with %d samples took %lu ms\n", gNumberSamples, std::chrono::duration_cast<std::chrono::milliseconds>(raytraceTime - startTime).count());
+   for(int b=0; b<numberBuilders; ++b) {
+      cBVHBuilder = builders[b];
+      printf("-----------------\n");
+      gWorld = buildWorld(list, size, &jobSystem);
+      for(int type=0; type<NUMBER_RAY_TYPES; ++type) {
+         statistics.mRays[type].reset();
+      }
+      renderImage(jobSystem, framebuffer, descriptions);
 
       char filename[256];
-      sprintf(filename, "raytrace_plastic_%03d.png", gNumberSamples);
+      sprintf(filename, "raytrace_plastic_%03d_%s.png", gNumberSamples, cBVHBuilderNames[cBVHBuilder]);
       stbi_write_png(filename, cNX, cNY, 4, framebuffer, cNX*sizeof(uint32_t));
+
+      RayStatistics rays;
+      for(int type=0; type<NUMBER_RAY_TYPES; ++type) {
+         rays.merge(statistics.mRays[type]);
+      }
+      double numberRays = std::max(1.0, double(rays.mNumberRays));
+      results[b].mBuildMilliseconds = gBuildMilliseconds;
+      results[b].mMemory = gBuildReport.mMemory;
+      results[b].mMegaRaysPerSecond = gMegaRaysPerSecond;
+      results[b].mNodesVisited = rays.mNodesVisited / numberRays;
+      results[b].mPrimitivesTested = rays.mPrimitivesTested / numberRays;
+      delete gWorld;
+      gWorld = nullptr;
+   }
+
+   printf("-----------------\n");
+   printf("%-8s %10s %10s %10s %12s %12s\n", "builder", "build ms", "MB", "Mrays/s", "nodes/ray", "prims/ray");
+   for(int b=0; b<numberBuilders; ++b) {
+      printf("%-8s %10.1f %10.2f %10.2f %12.2f %12.2f\n", cBVHBuilderNames[builders[b]], results[b].mBuildMilliseconds,
+         results[b].mMemory / (1024.0*1024.0), results[b].mMegaRaysPerSecond, results[b].mNodesVisited, results[b].mPrimitivesTested);
+   }
+}
+
+void parseArguments(int argc, char **argv) {
+   for(int i=1; i<argc; ++i) {
+      const char *value = i+1 < argc ? argv[i+1] : "";
+      if(strcmp(argv[i], "-scene") == 0) {
+         if(strcmp(value, "random") == 0)
+            cScene = SCENE_RANDOM_SPHERES;
+         else if(strcmp(value, "instances") == 0)
+            cScene = SCENE_INSTANCES;
+         else if(strcmp(value, "meshes") == 0)
+            cScene = SCENE_MESHES;
+         else
+            cScene = SCENE_MATERIALS;
+         ++i;
+      } else if(strcmp(argv[i], "-scenesize") == 0) {
+         cRandomSceneSize = atoi(value);
+         ++i;
+      } else if(strcmp(argv[i], "-builder") == 0) {
+         if(strcmp(value, "none") == 0)
+            cBVHBuilder = BVH_NONE;
+         else if(strcmp(value, "median") == 0)
+            cBVHBuilder = BVH_MEDIAN;
+         else if(strcmp(value, "lbvh") == 0)
+            cBVHBuilder = BVH_LBVH;
+         else if(strcmp(value, "sbvh") == 0)
+            cBVHBuilder = BVH_SBVH;
+         else if(strcmp(value, "grid") == 0)
+            cBVHBuilder = BVH_GRID;
+         else if(strcmp(value, "kdtree") == 0)
+            cBVHBuilder = BVH_KDTREE;
+         else
+            cBVHBuilder = BVH_SAH;
+         ++i;
+      } else if(strcmp(argv[i], "-morton") == 0) {
+         cMortonCodeBits = atoi(value);
+         ++i;
+      } else if(strcmp(argv[i], "-layout") == 0) {
+         if(strcmp(value, "dfs") == 0)
+            cNodeLayout = LAYOUT_DEPTH_FIRST;
+         else if(strcmp(value, "treelet") == 0)
+            cNodeLayout = LAYOUT_TREELET;
+         else
+            cNodeLayout = LAYOUT_BUILD;
+         ++i;
+      } else if(strcmp(argv[i], "-width") == 0) {
+         cBVHWidth = atoi(value);
+         ++i;
+      } else if(strcmp(argv[i], "-threads") == 0) {
+         cNumberWorkers = atoi(value);
+         ++i;
+      } else if(strcmp(argv[i], "-unordered") == 0) {
+         cOrderedTraversal = false;
+      } else if(strcmp(argv[i], "-packets") == 0) {
+         cPacketTracing = true;
+      } else if(strcmp(argv[i], "-noavx2") == 0) {
+         gUseAVX2 = false;
+      } else if(strcmp(argv[i], "-quantize") == 0) {
+         cQuantizedNodes = true;
+      } else if(strcmp(argv[i], "-frames") == 0) {
+         cNumberFrames = atoi(value);
+         ++i;
+      } else if(strcmp(argv[i], "-rebuild") == 0) {
+         cRebuildThreshold = atof(value);
+         ++i;
+      } else if(strcmp(argv[i], "-bvhcache") == 0) {
+         cBVHCache = true;
+      } else if(strcmp(argv[i], "-buildonly") == 0) {
+         cBuildOnly = true;
+      } else if(strcmp(argv[i], "-motionblur") == 0) {
+         cMotionBlur = true;
+      } else if(strcmp(argv[i], "-compare") == 0) {
+         cCompareAccelerators = true;
+      } else if(strcmp(argv[i], "-virtualhit") == 0) {
+         cTypeSortedGeometry = false;
+      } else if(strcmp(argv[i], "-nobatches") == 0) {
+         cSphereBatches = false;
+      } else if(strcmp(argv[i], "-stats") == 0) {
+         cStatisticsFile = value;
+         ++i;
+      } else if(strcmp(argv[i], "-mesh") == 0) {
+         cMeshFile = value;
+         cScene = SCENE_MESHES;
+         ++i;
+      } else if(strcmp(argv[i], "-convertmesh") == 0) {
+         cConvertMeshFile = value;
+         ++i;
+      } else {
+         printf("usage: %s [-scene materials|random|instances|meshes] [-scenesize n] [-builder none|median|sah|lbvh|sbvh|grid|kdtree] [-morton 30|63] [-layout build|dfs|treelet] [-width 2|4|8] [-threads n] [-unordered] [-packets] [-noavx2] [-quantize] [-frames n] [-rebuild factor] [-bvhcache] [-buildonly] [-motionblur] [-compare] [-virtualhit] [-nobatches] [-stats file] [-mesh file.obj|file.ply|file.lyrmesh] [-convertmesh file.lyrmesh]\n", argv[0]);
+         exit(-1);
+      }
+   }
+}
+
+int main(int argc, char **argv) {
+   parseArguments(argc, argv);
+
+   int numberWorkers = cNumberWorkers;
+   if(numberWorkers <= 0)
+      numberWorkers = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+   JobSystem jobSystem( numberWorkers, 65536 );
+
+   if(cConvertMeshFile != nullptr) {
+      MeshData mesh;
+      if(cMeshFile == nullptr || !loadMesh(cMeshFile, &jobSystem, mesh))
+         return -1;
+      if(!saveMeshFile(cConvertMeshFile, mesh, &jobSystem)) {
+         printf("can't write mesh %s!\n", cConvertMeshFile);
+         return -1;
+      }
+      printf("wrote %s\n", cConvertMeshFile);
+      return 0;
+   }
+
+   int size;
+   Hitable **list;
+   vector3f lookFrom, lookAt;
+   float aperture;
+   if(cScene == SCENE_RANDOM_SPHERES) {
+      list = randomSpheresScene(cRandomSceneSize, size);
+      lookFrom = vector3f(13.0f, 2.0f, 3.0f);
+      lookAt = vector3f(0.0f, 0.0f, 0.0f);
+      aperture = 0.1f;
+   } else if(cScene == SCENE_INSTANCES) {
+      list = instancesScene(cRandomSceneSize, size);
+      lookFrom = vector3f(13.0f, 2.0f, 3.0f);
+      lookAt = vector3f(0.0f, 0.0f, 0.0f);
+      aperture = 0.1f;
+   } else if(cScene == SCENE_MESHES) {
+      list = meshesScene(cRandomSceneSize, &jobSystem, size);
+      lookFrom = vector3f(13.0f, 4.0f, 3.0f);
+      lookAt = vector3f(0.0f, 0.0f, 0.0f);
+      aperture = 0.1f;
+   } else {
+      list = materialsScene(size);
+      lookFrom = vector3f(3.0f, 3.0f, 2.0f);
+      lookAt = vector3f(0.0f, 0.0f, -1.0f);
+      aperture = 0.1f;
+   }
+
+   uint32_t *framebuffer = new uint32_t[cNX*cNY];
+
+   float distanceToFocus = (lookFrom - lookAt).length();
+   if(cMotionBlur)
+      gCamera = new Camera(lookFrom, lookAt, vector3f(0,1,0), 20, float(cNX)/float(cNY), aperture, distanceToFocus, cShutterOpen, cShutterClose);
+   else
+      gCamera = new Camera(lookFrom, lookAt, vector3f(0,1,0), 20, float(cNX)/float(cNY), aperture, distanceToFocus);
+
+   JobDescription *descriptions = new JobDescription[cNY];
+
+   if(cCompareAccelerators) {
+      gNumberSamples = 30;
+      compareAccelerators(list, size, jobSystem, framebuffer, descriptions);
+      delete[] descriptions;
+      delete gCamera;
+      delete[] framebuffer;
+      return 0;
+   }
+
+   gWorld = buildWorld(list, size, &jobSystem);
+
+   for(int frame = 0; frame < cNumberFrames; ++frame) {
+      if(frame > 0) {
+         moveSpheres(list, size, 0.1f);
+         gWorld = updateWorld(gWorld, list, size, &jobSystem);
+      }
+      if(cBuildOnly)
+         continue;
+
+//      int testgNumberSamples[] = {1,10,20,30,50,100};
+      int testgNumberSamples[] = {30};
+      for(int currentSample = 0; currentSample < sizeof(testgNumberSamples)/sizeof(int); ++currentSample) {
+         gNumberSamples = testgNumberSamples[currentSample];
+
+         renderImage(jobSystem, framebuffer, descriptions);
+
+         char filename[256];
+         if(cNumberFrames > 1)
+            sprintf(filename, "raytrace_plastic_%03d_frame%03d.png", gNumberSamples, frame);
+         else
+            sprintf(filename, "raytrace_plastic_%03d.png", gNumberSamples);
+         stbi_write_png(filename, cNX, cNY, 4, framebuffer, cNX*sizeof(uint32_t));
+      }
    }
 
    delete[] descriptions;
-   delete fenceJob;
    delete gCamera;
    delete[] framebuffer;
    delete gWorld;
 
    printf("-----------------\n");
-   printf("number rays: %d\n", statistics.numberRays);
+   printf("number rays: %llu\n", (unsigned long long)(statistics.mRays[RAY_PRIMARY].mNumberRays + statistics.mRays[RAY_SECONDARY].mNumberRays));
+   for(int type=0; type<NUMBER_RAY_TYPES; ++type) {
+      const RayStatistics &rays = statistics.mRays[type];
+      if(rays.mNumberRays == 0)
+         continue;
+      printf("%s rays (%s): %llu, nodes visited %.2f avg %u max, primitives tested %.2f avg %u max\n", cRayTypeNames[type],
+         cOrderedTraversal ? "ordered" : "unordered", (unsigned long long)rays.mNumberRays,
+         double(rays.mNodesVisited) / double(rays.mNumberRays), rays.mMaxNodesVisited,
+         double(rays.mPrimitivesTested) / double(rays.mNumberRays), rays.mMaxPrimitivesTested);
+      if(rays.mCacheLines > 0) {
+         printf("   %s node layout: %.2f cache lines, %.2f pages entered per ray\n", cNodeLayoutNames[cNodeLayout],
+            double(rays.mCacheLines) / double(rays.mNumberRays), double(rays.mPages) / double(rays.mNumberRays));
+      }
+   }
+
+   if(cStatisticsFile == nullptr)
+      return 0;
+   FILE *file = fopen(cStatisticsFile, "w");
+   if(file == nullptr) {
+      printf("can't write statistics %s!\n", cStatisticsFile);
+      return 0;
+   }
+   fprintf(file, "{\n  \"builder\": \"%s\",\n  \"primitives\": %d,\n  \"build\": ", cBVHBuilderNames[cBVHBuilder], size);
+   gBuildReport.writeJSON(file);
+   fprintf(file, ",\n  \"traversal\": {\n    \"order\": \"%s\",\n    \"nodeLayout\": \"%s\",\n    \"mraysPerSecond\": %.3f",
+      cOrderedTraversal ? "ordered" : "unordered", cNodeLayoutNames[cNodeLayout], gMegaRaysPerSecond);
+   for(int type=0; type<NUMBER_RAY_TYPES; ++type) {
+      const RayStatistics &rays = statistics.mRays[type];
+      double numberRays = std::max(1.0, double(rays.mNumberRays));
+      fprintf(file, ",\n    \"%s\": { \"rays\": %llu, \"averageNodesVisited\": %.3f, \"maxNodesVisited\": %u, "
+         "\"averagePrimitivesTested\": %.3f, \"maxPrimitivesTested\": %u, \"averageCacheLines\": %.3f, \"averagePages\": %.3f }",
+         cRayTypeNames[type], (unsigned long long)rays.mNumberRays, rays.mNodesVisited / numberRays, rays.mMaxNodesVisited,
+         rays.mPrimitivesTested / numberRays, rays.mMaxPrimitivesTested, rays.mCacheLines / numberRays, rays.mPages / numberRays);
+   }
+   fprintf(file, "\n  }\n}\n");
+   fclose(file);
+   printf("wrote statistics %s\n", cStatisticsFile);
 }